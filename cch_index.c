@@ -4,6 +4,12 @@
 #include <linux/module.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/prefetch.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/sort.h>
 
 #define LOG_PREFIX "cch_index"
 
@@ -99,10 +105,16 @@ void show_index_description(struct cch_index *index)
 }
 #endif
 
+/**
+ * Choose backend cluster size that fits root, mid and lowest level
+ * entries with least space left over by lowest level ones.
+ *
+ * @return -ENOENT if entries don't fit any cluster
+ */
 int cch_index_backend_cluster_calculate_size(struct cch_index *index, int *cluster_size)
 {
 	int result = 0;
-	int potential_cluster_size = {
+	static const int potential_cluster_size[] = {
 		1024,
 		1024 * 2,
 		1024 * 4,
@@ -110,33 +122,37 @@ int cch_index_backend_cluster_calculate_size(struct cch_index *index, int *clust
 		1024 * 16,
 		1024 * 32
 	};
-	int i, good_i, good_reminder, lowest_level_size, mid_level_size;
+	int i, good_i, good_reminder, usable;
+	int lowest_level_size, mid_level_size, root_level_size;
 
 	TRACE_ENTRY();
 
-	lowest_level_size = index->levels_desc[index->lowest_level].size *
-		sizeof(uint64_t) +
-		sizeof(cch_backend_index_entry);
-
-	mid_level_size = index->levels_desc[index->mid_level].size *
-		sizeof(uint64_t) +
-		sizeof(cch_backend_index_entry);
+	lowest_level_size = cch_backend_index_entry_bytes(
+		index->levels_desc[index->lowest_level].size);
+	mid_level_size = cch_backend_index_entry_bytes(
+		index->levels_desc[index->mid_level].size);
+	root_level_size = cch_backend_index_entry_bytes(
+		index->levels_desc[index->root_level].size);
 
 	good_i = -1;
-	good_reminder = 1024;
+	good_reminder = INT_MAX;
 
 	for (i = 0; i < ARRAY_SIZE(potential_cluster_size); i++) {
-		if (potential_cluster_size[i] < lowest_level_size)
+		usable = potential_cluster_size[i] -
+			CCH_INDEX_BACKEND_CLUSTER_OVERHEAD;
+
+		if (usable < lowest_level_size)
+			continue;
+
+		if (usable < mid_level_size)
 			continue;
 
-		if (potential_cluster_size[i] < mid_level_size)
+		if (usable < root_level_size)
 			continue;
 
-		if (potential_cluster_size[i] % lowest_level_size
-		    < good_reminder) {
+		if (usable % lowest_level_size < good_reminder) {
 			good_i = i;
-			good_reminder = potential_cluster_size[i] %
-				lowest_level_size;
+			good_reminder = usable % lowest_level_size;
 		}
 	}
 
@@ -145,7 +161,7 @@ int cch_index_backend_cluster_calculate_size(struct cch_index *index, int *clust
 		result = -ENOENT;
 	} else {
 		result = 0;
-		*cluster_size = potential_cluster_size[i];
+		*cluster_size = potential_cluster_size[good_i];
 	}
 
 	TRACE_EXIT_RES(result);
@@ -157,6 +173,7 @@ int cch_index_create(
 	int bits,
 	int root_bits,
 	int low_bits,
+	unsigned long flags,
 
 	cch_index_on_new_entry_alloc_fn_t on_new_entry_alloc_fn,
 	cch_index_on_entry_free_fn_t on_entry_free_fn,
@@ -176,11 +193,21 @@ int cch_index_create(
 #define CACHE_NAME_BUF_SIZE 30
 	char slab_name_buf[CACHE_NAME_BUF_SIZE];
 	int index_seq_n = 0;
+	int low_size = 0, mid_size = 0;
+	int i = 0;
 
 	TRACE_ENTRY();
 
+	if (levels + 2 > CCH_INDEX_MAX_LEVELS) {
+		PRINT_ERROR("too many levels %d", levels);
+		result = -EINVAL;
+		goto out;
+	}
+
+	/* root entry v[] table and its bitmap follow the index */
 	new_index = kzalloc(sizeof(struct cch_index) +
-			    (1 << root_bits) * sizeof(uint64_t),
+			    (1 << root_bits) * sizeof(uint64_t) +
+			    BITS_TO_LONGS(1 << root_bits) * sizeof(long),
 			    GFP_KERNEL);
 	if (new_index == NULL) {
 		PRINT_ERROR("vmalloc failed during index create");
@@ -188,6 +215,8 @@ int cch_index_create(
 		goto out;
 	}
 
+	new_index->flags = flags;
+
 	new_index->on_new_entry_alloc_fn = on_new_entry_alloc_fn;
 	new_index->on_entry_free_fn      = on_entry_free_fn;
 
@@ -201,10 +230,31 @@ int cch_index_create(
 	new_index->finish_transaction_fn = finish_transaction_fn;
 
 	mutex_init(&new_index->cch_index_value_mutex);
+	mutex_init(&new_index->save_mutex);
+	for (i = 0; i < CCH_INDEX_SUBTREE_LOCKS; i++)
+		mutex_init(&new_index->subtree_locks[i].mutex);
+	new_index->head.index = new_index;
+	new_index->head.nr = -1;
 	spin_lock_init(&new_index->index_lru_list_lock);
 	INIT_LIST_HEAD(&new_index->index_lru_list);
+	spin_lock_init(&new_index->fault_lock);
+	INIT_LIST_HEAD(&new_index->faults);
+
+	new_index->lru_pvecs = alloc_percpu(struct cch_index_lru_pvec);
+	if (new_index->lru_pvecs == NULL) {
+		result = -ENOMEM;
+		goto out_free_index;
+	}
+	for_each_possible_cpu(i)
+		spin_lock_init(&per_cpu_ptr(new_index->lru_pvecs, i)->lock);
 
-	atomic_set(&new_index->total_bytes, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+	result = percpu_counter_init(&new_index->total_bytes, 0, GFP_KERNEL);
+#else
+	result = percpu_counter_init(&new_index->total_bytes, 0);
+#endif
+	if (result)
+		goto out_free_lru_pvecs;
 
 	/* root + levels + lowest level */
 	new_index->levels = levels + 2;
@@ -213,25 +263,57 @@ int cch_index_create(
 		GFP_KERNEL);
 	if (new_index->levels_desc == NULL) {
 		result = -ENOMEM;
-		goto out_free_index;
+		goto out_free_total_bytes;
 	}
 
 	result = generate_level_descriptions(new_index, levels,
 		bits, root_bits, low_bits);
 	if (result) {
 		PRINT_ERROR("error creating caches\n");
-		goto out_free_index;
+		goto out_free_descriptions;
 	}
 
+#define CCH_INDEX_MATCH_GEOMETRY(n, g_levels, g_bits, g_root_bits,	\
+				 g_low_bits)				\
+	if (levels == (g_levels) && bits == (g_bits) &&			\
+	    root_bits == (g_root_bits) && low_bits == (g_low_bits))	\
+		new_index->geometry = (n);
+	CCH_INDEX_GEOMETRIES(CCH_INDEX_MATCH_GEOMETRY)
+#undef CCH_INDEX_MATCH_GEOMETRY
+	PRINT_INFO("geometry %d", new_index->geometry);
+
 #ifdef CCH_INDEX_DEBUG
 	show_index_description(new_index);
 #endif
 
 	index_seq_n = atomic_inc_return(&_index_seq_n);
 
-	new_index->lowest_level_entry_size =
-		new_index->levels_desc[new_index->lowest_level].size *
-		sizeof(new_index->head.v[0]) + sizeof(struct cch_index_entry);
+	low_size = new_index->levels_desc[new_index->lowest_level].size;
+	/* extent table takes place of compact one */
+	BUILD_BUG_ON(CCH_INDEX_EXTENT_RUNS * sizeof(struct cch_index_leaf_run) >
+		     CCH_INDEX_COMPACT_LEAF_SIZE * sizeof(void *));
+	if (flags & CCH_INDEX_EXTENT_LEAVES)
+		new_index->flags |= CCH_INDEX_COMPACT_LEAVES;
+	if ((new_index->flags & CCH_INDEX_COMPACT_LEAVES) &&
+	    (low_size <= 2 * CCH_INDEX_COMPACT_LEAF_SIZE ||
+	     low_size > (1 << 16))) {
+		PRINT_INFO("no compact leaves for lowest level size %d",
+			   low_size);
+		new_index->flags &= ~(CCH_INDEX_COMPACT_LEAVES |
+				      CCH_INDEX_EXTENT_LEAVES);
+	}
+
+	if (new_index->flags & CCH_INDEX_COMPACT_LEAVES) {
+		/* records are in struct cch_index_leaf */
+		new_index->lowest_level_entry_size =
+			sizeof(new_index->head.v[0]) +
+			sizeof(struct cch_index_entry);
+	} else {
+		new_index->lowest_level_entry_size =
+			low_size * sizeof(new_index->head.v[0]) +
+			sizeof(struct cch_index_entry) +
+			BITS_TO_LONGS(low_size) * sizeof(long);
+	}
 	snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
 		 "cch_index_low_level_%d", index_seq_n);
 	/* FIXME unique index name */
@@ -248,7 +330,9 @@ int cch_index_create(
 
 	new_index->mid_level_entry_size =
 		new_index->levels_desc[new_index->mid_level].size *
-		sizeof(new_index->head.v[0]) + sizeof(struct cch_index_entry);
+		sizeof(new_index->head.v[0]) + sizeof(struct cch_index_entry) +
+		BITS_TO_LONGS(new_index->levels_desc[
+			new_index->mid_level].size) * sizeof(long);
 	snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
 		 "cch_index_mid_level_%d", index_seq_n);
 	new_index->mid_level_kmem = kmem_cache_create(slab_name_buf,
@@ -262,24 +346,79 @@ int cch_index_create(
 	PRINT_INFO("cch_index_mid_level object size %d",
 		   kmem_cache_size(new_index->mid_level_kmem));
 
-	if (!cch_index_backend_cluster_calculate_size(new_index,
-		&new_index->backend_cluster_size)) {
-		result = -ENOMEM; // should we handle errors here?
-		goto out_free_mid_level_kmem;
-	};
+	mid_size = new_index->levels_desc[new_index->mid_level].size;
+	if ((flags & CCH_INDEX_COMPACT_MID) &&
+	    (mid_size <= 2 * CCH_INDEX_COMPACT_MID_SIZE ||
+	     mid_size > (1 << 16))) {
+		PRINT_INFO("no compact entries for mid level size %d",
+			   mid_size);
+		new_index->flags &= ~CCH_INDEX_COMPACT_MID;
+	}
 
-	snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
-		 "cch_index_backend_cluster_%d", index_seq_n);
-	new_index->backend_cluster_kmem = kmem_cache_create(slab_name_buf,
-		new_index->backend_cluster_size + sizeof(cch_backend_cluster),
-		1024, 0, NULL);
-	if (!new->index->backend_cluster_kmem) {
-		result = -ENOMEM;
-		goto out_free_mid_level_kmem;
+	if (new_index->flags & CCH_INDEX_COMPACT_MID) {
+		/* children, their offsets, then skip */
+		new_index->compact_mid_entry_size =
+			sizeof(struct cch_index_entry) +
+			CCH_INDEX_COMPACT_MID_SIZE *
+			(sizeof(new_index->head.v[0]) + sizeof(uint16_t)) +
+			sizeof(struct cch_index_skip);
+		snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
+			 "cch_index_compact_mid_%d", index_seq_n);
+		new_index->compact_mid_kmem = kmem_cache_create(slab_name_buf,
+			new_index->compact_mid_entry_size,
+			CCH_INDEX_MID_LEVEL_ALIGN, 0, NULL);
+		if (!new_index->compact_mid_kmem) {
+			result = -ENOMEM;
+			goto out_free_mid_level_kmem;
+		}
+	}
+
+	if (new_index->flags & CCH_INDEX_COMPACT_LEAVES) {
+		new_index->compact_leaf_size = sizeof(struct cch_index_leaf) +
+			CCH_INDEX_COMPACT_LEAF_SIZE * sizeof(void *);
+		snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
+			 "cch_index_compact_leaf_%d", index_seq_n);
+		new_index->compact_leaf_kmem = kmem_cache_create(slab_name_buf,
+			new_index->compact_leaf_size,
+			CCH_INDEX_LOW_LEVEL_ALIGN, 0, NULL);
+		if (!new_index->compact_leaf_kmem) {
+			result = -ENOMEM;
+			goto out_free_leaf_kmem;
+		}
+
+		new_index->dense_leaf_size = sizeof(struct cch_index_leaf) +
+			low_size * sizeof(void *) +
+			BITS_TO_LONGS(low_size) * sizeof(long);
+		snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
+			 "cch_index_dense_leaf_%d", index_seq_n);
+		new_index->dense_leaf_kmem = kmem_cache_create(slab_name_buf,
+			new_index->dense_leaf_size,
+			CCH_INDEX_LOW_LEVEL_ALIGN, 0, NULL);
+		if (!new_index->dense_leaf_kmem) {
+			result = -ENOMEM;
+			goto out_free_leaf_kmem;
+		}
 	}
 
-	PRINT_INFO("%s with size %d", slab_name_buf,
-		   new_index->backend_cluster_size);
+	/* index is still usable in memory if entries don't fit
+	 * clusters, full save fails then */
+	if (cch_index_backend_cluster_calculate_size(new_index,
+		&new_index->backend_cluster_size) == 0) {
+		snprintf(slab_name_buf, CACHE_NAME_BUF_SIZE,
+			 "cch_index_backend_cluster_%d", index_seq_n);
+		new_index->backend_cluster_kmem = kmem_cache_create(
+			slab_name_buf, new_index->backend_cluster_size,
+			1024, 0, NULL);
+		if (!new_index->backend_cluster_kmem) {
+			result = -ENOMEM;
+			goto out_free_leaf_kmem;
+		}
+
+		PRINT_INFO("%s with size %d", slab_name_buf,
+			   new_index->backend_cluster_size);
+	} else {
+		new_index->backend_cluster_size = 0;
+	}
 
 	*out = new_index;
 
@@ -287,12 +426,23 @@ out:
 	TRACE_EXIT_RES(result);
 	return result;
 
+out_free_leaf_kmem:
+	if (new_index->dense_leaf_kmem)
+		kmem_cache_destroy(new_index->dense_leaf_kmem);
+	if (new_index->compact_leaf_kmem)
+		kmem_cache_destroy(new_index->compact_leaf_kmem);
+	if (new_index->compact_mid_kmem)
+		kmem_cache_destroy(new_index->compact_mid_kmem);
 out_free_mid_level_kmem:
 	kmem_cache_destroy(new_index->mid_level_kmem);
 out_free_low_level_kmem:
 	kmem_cache_destroy(new_index->lowest_level_kmem);
 out_free_descriptions:
 	kfree(new_index->levels_desc);
+out_free_total_bytes:
+	percpu_counter_destroy(&new_index->total_bytes);
+out_free_lru_pvecs:
+	free_percpu(new_index->lru_pvecs);
 out_free_index:
 	kfree(new_index);
 	goto out;
@@ -300,532 +450,716 @@ out_free_index:
 EXPORT_SYMBOL(cch_index_create);
 
 /**
- * Frees records of lowest level entry, checks if reference
- * count is right, puts entry back to kmem_cache
+ * Move entries buffered in per-cpu LRU touch buffer to the
+ * tail of LRU list, in order of access.
  *
- * @arg entry entry to be freed
+ * Called with pvec->lock held.
  */
-void cch_index_destroy_lowest_level_entry(
-	struct cch_index *index,
-	struct cch_index_entry *entry)
+static void cch_index_lru_pvec_drain(struct cch_index *index,
+	struct cch_index_lru_pvec *pvec)
 {
-	int current_size = 0;
+	struct cch_index_entry *entry;
 	int i = 0;
 
-	TRACE_ENTRY();
-
-	// should we LOCK something?
-
-	sBUG_ON(entry == NULL);
-	sBUG_ON(POINTER_FREED(entry));
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-
-	current_size = cch_index_entry_size(index, entry);
-	for (i = 0; i < current_size; i++) {
-		if (entry->v[i].value != NULL) {
-			entry->v[i].value = NULL;
-			entry->ref_cnt--;
-		}
+	spin_lock(&index->index_lru_list_lock);
+	for (i = 0; i < pvec->nr; i++) {
+		entry = pvec->entries[i];
+		/* forgotten on entry removal */
+		if (entry == NULL)
+			continue;
+		/* picked by cch_index_shrink() stays on its list */
+		if (!list_empty(&entry->index_lru_list_entry) &&
+		    !(atomic_read(&entry->ref_cnt) &
+		      CCH_INDEX_ENTRY_UNLOADING))
+			list_move_tail(&entry->index_lru_list_entry,
+				       &index->index_lru_list);
+		atomic_dec(&entry->lru_buffered);
 	}
-	TRACE(TRACE_DEBUG, "refcount is %d", entry->ref_cnt);
-	sBUG_ON(entry->ref_cnt != 0);
+	spin_unlock(&index->index_lru_list_lock);
 
-	cch_index_entry_lru_remove(index, entry);
+	pvec->nr = 0;
+}
 
-	kmem_cache_free(index->lowest_level_kmem, entry);
+void cch_index_lru_drain(struct cch_index *index)
+{
+	struct cch_index_lru_pvec *pvec;
+	unsigned long flags;
+	int cpu;
 
-	index->on_entry_free_fn(index, index->lowest_level_entry_size,
-		atomic_sub_return(index->lowest_level_entry_size,
-			&index->total_bytes));
+	TRACE_ENTRY();
+
+	for_each_possible_cpu(cpu) {
+		pvec = per_cpu_ptr(index->lru_pvecs, cpu);
+		spin_lock_irqsave(&pvec->lock, flags);
+		cch_index_lru_pvec_drain(index, pvec);
+		spin_unlock_irqrestore(&pvec->lock, flags);
+	}
 
 	TRACE_EXIT();
 	return;
 }
+EXPORT_SYMBOL(cch_index_lru_drain);
 
-/**
- * Call appropriate *_destroy_* function on records of entry,
- * decrease reference count for each freed entry,
- * check if it's zero at moment of destruction,
- * puts entry back to cache.
- *
- * @arg index
- * @arg entry mid-level entry to be freed
- * @arg level -- level of current entry for debug purposes,
- *      children entries get (level + 1)
+/*
+ * Lookups run under rcu_read_lock() only, so entry may be already
+ * removed from LRU by writer and waiting for grace period. Such
+ * entries are CCH_INDEX_ENTRY_DEAD and must stay off the list, their
+ * index_lru_list_entry is reused by rcu_head.
  *
+ * Touch is only recorded in per-cpu buffer, LRU list is updated
+ * when buffer is full. With CCH_INDEX_CLOCK_EVICTION it is just
+ * a referenced mark, examined by clock hand on eviction.
  */
-void cch_index_destroy_mid_level_entry(struct cch_index *index,
-	struct cch_index_entry *entry, int level)
+static inline void cch_index_entry_lru_update(
+	struct cch_index *index,
+	struct cch_index_entry *entry)
 {
-	int current_size = 0, i = 0;
-
-	TRACE_ENTRY();
-
-	// should we LOCK anything?
-	sBUG_ON(entry == NULL);
-	sBUG_ON(POINTER_FREED(entry));
-
-	TRACE(TRACE_DEBUG, "destroy mid level %p, level %d, references %d",
-	      entry, level, entry->ref_cnt);
+	struct cch_index_lru_pvec *pvec;
+	unsigned long flags;
 
-	if (!cch_index_entry_is_mid_level(entry)) {
-		if (cch_index_entry_is_lowest_level(entry)) {
-			PRINT_INFO("entry is lowest");
-			sBUG();
-		} else if (cch_index_entry_is_root(entry)) {
-			PRINT_INFO("entry is root %p %p", entry, &index->head);
-			sBUG();
-		} else {
-			PRINT_ERROR("unknown type of entry");
-			sBUG();
-		}
+	if (index->flags & CCH_INDEX_CLOCK_EVICTION) {
+		if (!entry->referenced)
+			entry->referenced = 1;
+		return;
 	}
 
-	current_size = cch_index_entry_size(index, entry);
-	/* FIXME unloaded entries or shall we? */
-	for (i = 0; i < current_size; i++) {
-		/* FIXME if_loaded? */
-		if (entry->v[i].entry == NULL)
-			continue;
-		/* how can an entry here be already free? */
-		sBUG_ON(POINTER_FREED(entry->v[i].entry));
+	pvec = get_cpu_ptr(index->lru_pvecs);
+	spin_lock_irqsave(&pvec->lock, flags);
 
-		if (cch_index_entry_is_lowest_level(entry->v[i].entry)) {
-			PRINT_INFO("destroying lowest level 0x%x", i);
-			cch_index_destroy_lowest_level_entry(index,
-				entry->v[i].entry);
-		} else {
-			PRINT_INFO("destroying mid level 0x%x", i);
-			cch_index_destroy_mid_level_entry(index,
-				entry->v[i].entry, level + 1);
-		}
-		entry->v[i].entry = NULL;
-		entry->ref_cnt--;
+	if (pvec->nr != 0 && pvec->entries[pvec->nr - 1] == entry)
+		goto out_unlock;
+	/* counted before it's checked, see cch_index_entry_lru_remove() */
+	atomic_inc(&entry->lru_buffered);
+	smp_mb__after_atomic();
+	if (atomic_read(&entry->ref_cnt) &
+	    (CCH_INDEX_ENTRY_DEAD | CCH_INDEX_ENTRY_UNLOADING)) {
+		atomic_dec(&entry->lru_buffered);
+		goto out_unlock;
 	}
 
-	PRINT_INFO("refcount is %d", entry->ref_cnt);
-	sBUG_ON(entry->ref_cnt != 0);
-
-	kmem_cache_free(index->mid_level_kmem, entry);
-
-	index->on_entry_free_fn(index, index->mid_level_entry_size,
-		atomic_sub_return(index->mid_level_entry_size,
-			&index->total_bytes));
+	pvec->entries[pvec->nr++] = entry;
+	if (pvec->nr == CCH_INDEX_LRU_BATCH)
+		cch_index_lru_pvec_drain(index, pvec);
 
-	TRACE_EXIT();
-	return;
+out_unlock:
+	spin_unlock_irqrestore(&pvec->lock, flags);
+	put_cpu_ptr(index->lru_pvecs);
 }
 
-void cch_index_destroy_entry(
+/* remove entry from LRU list. Required on entry removal, once
+ * entry is CCH_INDEX_ENTRY_DEAD or index is being destroyed */
+static void cch_index_entry_lru_remove(
 	struct cch_index *index,
 	struct cch_index_entry *entry)
 {
+	struct cch_index_lru_pvec *pvec;
+	unsigned long flags;
+	int cpu, i;
+
+	spin_lock_irqsave(&(index->index_lru_list_lock), flags);
+	list_del_init(&(entry->index_lru_list_entry));
+	spin_unlock_irqrestore(&(index->index_lru_list_lock), flags);
+
+	/* entry is dead, so no cpu can buffer it again. Touch counted
+	 * before dead mark is seen here, so with no count there are no
+	 * buffered touches to forget before entry is freed */
+	smp_mb();
+	if ((index->flags & CCH_INDEX_CLOCK_EVICTION) ||
+	    atomic_read(&entry->lru_buffered) == 0)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pvec = per_cpu_ptr(index->lru_pvecs, cpu);
+		spin_lock_irqsave(&pvec->lock, flags);
+		for (i = 0; i < pvec->nr; i++) {
+			if (pvec->entries[i] == entry)
+				pvec->entries[i] = NULL;
+		}
+		spin_unlock_irqrestore(&pvec->lock, flags);
+	}
+}
+
+/**
+ * Select lowest level entry to be evicted, victim is left at the
+ * head of LRU list. Returns NULL when there are no entries.
+ *
+ * In CLOCK mode the head of the list is the clock hand: referenced
+ * entries get their mark cleared and are moved behind the hand,
+ * first unreferenced entry is the victim. Otherwise list is kept in
+ * LRU order and its head is the victim.
+ *
+ * Called with index_lru_list_lock held. For strict LRU order buffered
+ * touches should be applied first with cch_index_lru_drain().
+ */
+struct cch_index_entry *__cch_index_lru_pick_victim(struct cch_index *index)
+{
+	struct cch_index_entry *entry = NULL;
+
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
+	while (!list_empty(&index->index_lru_list)) {
+		entry = list_first_entry(&index->index_lru_list,
+			struct cch_index_entry, index_lru_list_entry);
 
-	if (cch_index_entry_is_lowest_level(entry))
-		cch_index_destroy_lowest_level_entry(index, entry);
-	else if (cch_index_entry_is_mid_level(entry))
-		cch_index_destroy_mid_level_entry(index, entry, 1);
-	else
-		sBUG();
+		if (!(index->flags & CCH_INDEX_CLOCK_EVICTION) ||
+		    !entry->referenced)
+			goto out;
 
-	/*
-	 * we should also delete ourselves from parent, put NULL
-	 * down there and decrease reference count
-	 *
-	 * Finding ourselves in parent table is O(size) for
-	 * _every_ entry that is being removed (with appropriate 1/O(size)
-	 * of chance to have ref_cnt == 0;
-	 */
+		/* second chance */
+		entry->referenced = 0;
+		list_move_tail(&entry->index_lru_list_entry,
+			       &index->index_lru_list);
+	}
+	entry = NULL;
 
+out:
 	TRACE_EXIT();
-	return;
+	return entry;
 }
+EXPORT_SYMBOL(__cch_index_lru_pick_victim);
 
 /**
- * Remove record from given entry at given offset,
- * decreasing reference count and, possibly, freeing all
- * unused index entries on this path.
- *
- * Supposed to be called under cch_index_value_mutex.
+ * Get writer lock of the subtree hanging off given root entry slot.
  */
-void __cch_index_entry_remove_value(
+static inline struct mutex *cch_index_subtree_mutex(
 	struct cch_index *index,
-	struct cch_index_entry *entry,
-	int offset)
+	int root_offset)
 {
-	TRACE_ENTRY();
-
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-
-	TRACE(TRACE_DEBUG, "removing at offset 0x%x", offset);
-	entry->v[offset].value = NULL;
-	/* FIXME lock */
-	TRACE(TRACE_DEBUG, "refcnt was %d, become %d\n", entry->ref_cnt,
-		   entry->ref_cnt - 1);
-	entry->ref_cnt--;
+	return &index->subtree_locks[root_offset &
+		(CCH_INDEX_SUBTREE_LOCKS - 1)].mutex;
+}
 
-	TRACE_EXIT();
-	return;
+/* cch_index_pin() count of subtrees sharing lock with root slot */
+static inline int *cch_index_subtree_pins(struct cch_index *index,
+	int root_offset)
+{
+	return &index->subtree_locks[root_offset &
+		(CCH_INDEX_SUBTREE_LOCKS - 1)].nr_pinned;
 }
 
 /**
- * Destroy all linked records (mid_level), decrease reference count,
- * check if it's zero at the end. Can't free because it is
- * allocated inside cch_index.
+ * Find root entry slot of the subtree that holds given entry.
+ *
+ * @arg entry any non-root entry
  */
-void cch_index_destroy_root_entry(struct cch_index *index)
+static int cch_index_entry_root_offset(struct cch_index_entry *entry)
 {
-	int current_size = 0;
-	int i = 0;
+	struct cch_index_entry *parent;
 
-	TRACE_ENTRY();
+	sBUG_ON(cch_index_entry_is_root(entry));
 
-	current_size = cch_index_entry_size(index, &index->head);
-	for (i = 0; i < current_size; i++) {
-		if (index->head.v[i].entry == NULL)
-			continue;
-		cch_index_destroy_mid_level_entry(index,
-			index->head.v[i].entry, 1);
-		index->head.v[i].entry = NULL;
-		index->head.ref_cnt--;
+	rcu_read_lock();
+	parent = cch_index_entry_get_parent(entry);
+	while (!cch_index_entry_is_root(parent)) {
+		entry = parent;
+		parent = cch_index_entry_get_parent(entry);
 	}
+	rcu_read_unlock();
 
-	TRACE(TRACE_DEBUG, "remaning reference for root is %d",
-	      index->head.ref_cnt);
-	sBUG_ON(index->head.ref_cnt != 0);
-
-	TRACE_EXIT();
-	return;
+	return entry->parent_offset;
 }
 
 /**
- * Create index entry of lowest level, attach it to parent,
- * update reference counts.
- *
- * When debugging, check for common memory allocation problems.
- *
- * @arg parent
- * @arg new_entr
- * @arg offset
+ * Lock subtrees of two root entry slots, always in the same order
+ * to avoid deadlock. Slots sharing one lock take it once.
  */
-int cch_index_create_lowest_entry(
+static void cch_index_subtree_lock_pair(
 	struct cch_index *index,
-	struct cch_index_entry *parent,
-	struct cch_index_entry **new_entry,
-	int offset)
+	int first_root_offset,
+	int second_root_offset)
 {
-	int result = 0;
-	unsigned long flags;
-#ifdef CCH_INDEX_DEBUG
-	int i = 0;
-#endif
-
-	TRACE_ENTRY();
+	struct mutex *first, *second;
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(parent == NULL);
+	first = cch_index_subtree_mutex(index, first_root_offset);
+	second = cch_index_subtree_mutex(index, second_root_offset);
+	if (first > second)
+		swap(first, second);
 
-	*new_entry = kmem_cache_zalloc(index->lowest_level_kmem, GFP_KERNEL);
-	if (!*new_entry) {
-		PRINT_ERROR("low level alloc failure");
-		result = -ENOMEM;
-		goto out;
-	}
+	mutex_lock(first);
+	if (second != first)
+		mutex_lock_nested(second, SINGLE_DEPTH_NESTING);
+}
 
-	// LOCK parent, new_entry
-	parent->v[offset].entry = *new_entry;
-	(*new_entry)->parent = (struct cch_index_entry *)
-		(((unsigned long) parent) | ENTRY_LOWEST_ENTRY_BIT);
-	(*new_entry)->parent_offset = offset;
-	parent->ref_cnt++;
-	// UNLOCK parent, new_entry
+static void cch_index_subtree_unlock_pair(
+	struct cch_index *index,
+	int first_root_offset,
+	int second_root_offset)
+{
+	struct mutex *first, *second;
 
-#ifdef CCH_INDEX_DEBUG
-	/* check real bounds of new object */
-	for (i = 0; i < cch_index_entry_size(index, *new_entry); i++)
-		sBUG_ON((*new_entry)->v[i].entry != NULL);
-	(*new_entry)->magic = CCH_INDEX_ENTRY_MAGIC;
-#endif
+	first = cch_index_subtree_mutex(index, first_root_offset);
+	second = cch_index_subtree_mutex(index, second_root_offset);
 
-	/* memory accounting */
-	index->on_new_entry_alloc_fn(index, index->lowest_level_entry_size,
-		atomic_add_return(index->lowest_level_entry_size,
-			&index->total_bytes));
+	if (second != first)
+		mutex_unlock(second);
+	mutex_unlock(first);
+}
 
-	/* LRU */
-	INIT_LIST_HEAD(&((*new_entry)->index_lru_list_entry));
-	spin_lock_irqsave(&(index->index_lru_list_lock), flags);
-	list_add_tail(&((*new_entry)->index_lru_list_entry),
-		      &index->index_lru_list);
-	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
+/**
+ * Drop skips that may go through or to children of @arg entry
+ * before they change. Skips of entries above end at the first one
+ * with other children, see struct cch_index_skip.
+ *
+ * Called under subtree lock before @arg entry ref_cnt changes.
+ */
+static void cch_index_skip_clear(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	struct cch_index_skip *skip;
+
+	while (!cch_index_entry_is_root(entry) &&
+	       cch_index_entry_is_compact(entry)) {
+		skip = cch_index_entry_skip(entry);
+		if (skip->target != NULL)
+			WRITE_ONCE(skip->target, NULL);
+		if (atomic_read(&entry->ref_cnt) != 1)
+			break;
+		entry = cch_index_entry_get_parent(entry);
+	}
+}
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+/**
+ * Publish new entry in parent v[] table. Parent is protected
+ * by subtree lock, root entry reference count is shared by all
+ * subtrees and so is changed atomically.
+ */
+static void cch_index_entry_link(
+	struct cch_index *index,
+	struct cch_index_entry *parent,
+	struct cch_index_entry *entry,
+	int offset)
+{
+	struct cch_index_entry **slot;
+
+	/* compact parent got room for it, see cch_index_entry_create() */
+	slot = cch_index_entry_child_slot(index, parent, offset);
+	sBUG_ON(slot == NULL);
+
+	cch_index_skip_clear(index, parent);
+	rcu_assign_pointer(*slot, entry);
+	if (!cch_index_entry_is_compact(parent))
+		set_bit(offset, cch_index_entry_bitmap(index, parent));
+	atomic_inc(&parent->ref_cnt);
+	cch_index_entry_mark_dirty(parent);
 }
 
 /**
- * Create index entry of mid level, updating parent and reference counts.
- *
- * @arg parent
- * @arg new_entry
- * @arg offset
+ * Detach entry from parent v[] table, see cch_index_entry_link()
  */
-int cch_index_create_mid_entry(
+static void cch_index_entry_unlink(
 	struct cch_index *index,
 	struct cch_index_entry *parent,
-	struct cch_index_entry **new_entry,
 	int offset)
 {
-	int result = 0;
-#ifdef CCH_INDEX_DEBUG
-	int i = 0;
-#endif
+	cch_index_skip_clear(index, parent);
+	/* offset stays in compact parent with no child */
+	*cch_index_entry_child_slot(index, parent, offset) = NULL;
+	if (!cch_index_entry_is_compact(parent))
+		clear_bit(offset, cch_index_entry_bitmap(index, parent));
+	atomic_dec(&parent->ref_cnt);
+	cch_index_entry_mark_dirty(parent);
+}
 
-	TRACE_ENTRY();
+/**
+ * Take reference for a value about to be put to lowest level entry.
+ * Inserters don't hold subtree lock when the entry exists, so
+ * this fails once __cch_index_entry_cleanup() marked entry dead
+ * or while cch_index_shrink() unloads it.
+ */
+static int cch_index_entry_get_ref(struct cch_index_entry *entry)
+{
+	int cnt, old;
+
+	cnt = atomic_read(&entry->ref_cnt);
+	for (;;) {
+		if (cnt & (CCH_INDEX_ENTRY_DEAD | CCH_INDEX_ENTRY_UNLOADING))
+			return 0;
+		old = atomic_cmpxchg(&entry->ref_cnt, cnt, cnt + 1);
+		if (old == cnt)
+			return 1;
+		cnt = old;
+	}
+}
+
+/**
+ * Account entry allocation (positive delta) or free (negative delta).
+ * Returns new total for entry alloc/free callbacks, which is exact
+ * only with CCH_INDEX_EXACT_ACCOUNTING, clamped to their int.
+ */
+static int cch_index_total_bytes_add(struct cch_index *index, int delta)
+{
+	s64 total;
+
+	percpu_counter_add(&index->total_bytes, delta);
+
+	if (unlikely(index->flags & CCH_INDEX_EXACT_ACCOUNTING))
+		total = percpu_counter_sum_positive(&index->total_bytes);
+	else
+		total = percpu_counter_read_positive(&index->total_bytes);
+
+	return min_t(s64, total, INT_MAX);
+}
 
+s64 cch_index_total_bytes(struct cch_index *index)
+{
 	sBUG_ON(index == NULL);
-	sBUG_ON(parent == NULL);
 
-	*new_entry = kmem_cache_zalloc(index->mid_level_kmem, GFP_KERNEL);
-	if (!*new_entry) {
-		PRINT_ERROR("mid level alloc failure");
-		result = -ENOMEM;
-		goto out;
+	return percpu_counter_sum(&index->total_bytes);
+}
+EXPORT_SYMBOL(cch_index_total_bytes);
+
+/**
+ * Mark lowest level entry dead while it still holds values, so
+ * lockless inserters don't take new references. Caller waits for
+ * the ones in flight with synchronize_rcu() before freeing it.
+ */
+static void cch_index_entry_set_dead(struct cch_index_entry *entry)
+{
+	int cnt, old;
+
+	cnt = atomic_read(&entry->ref_cnt);
+	for (;;) {
+		old = atomic_cmpxchg(&entry->ref_cnt, cnt,
+			cnt | CCH_INDEX_ENTRY_DEAD);
+		if (old == cnt)
+			break;
+		cnt = old;
 	}
+}
 
-	parent->v[offset].entry = *new_entry;
-	(*new_entry)->parent_offset = offset;
-	(*new_entry)->parent = parent;
-	parent->ref_cnt++;
+/**
+ * Put entry back to kmem_cache once RCU grace period is over,
+ * so lookups that walked into this entry are already done with it.
+ */
+static void cch_index_entry_free_rcu(struct rcu_head *head)
+{
+	struct cch_index_entry *entry =
+		container_of(head, struct cch_index_entry, rcu_head);
 
-#ifdef CCH_INDEX_DEBUG
-	for (i = 0; i < cch_index_entry_size(index, *new_entry); i++)
-		sBUG_ON((*new_entry)->v[i].entry != NULL);
-	(*new_entry)->magic = CCH_INDEX_ENTRY_MAGIC;
-#endif
+	if (cch_index_entry_is_lowest_level(entry))
+		kmem_cache_free(entry->index->lowest_level_kmem, entry);
+	else if (cch_index_entry_is_compact(entry))
+		kmem_cache_free(entry->index->compact_mid_kmem, entry);
+	else
+		kmem_cache_free(entry->index->mid_level_kmem, entry);
+}
 
-	/* memory accounting */
-	index->on_new_entry_alloc_fn(index, index->mid_level_entry_size,
-		atomic_add_return(index->mid_level_entry_size,
-			   &index->total_bytes));
+/**
+ * Free unlinked entry after RCU grace period. Fingers taken before
+ * this may point to it and are invalidated by generation change.
+ */
+static void cch_index_entry_free(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	atomic_long_inc(&index->free_generation);
+	call_rcu(&entry->rcu_head, cch_index_entry_free_rcu);
+}
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+/* memory taken by mid level entry, compact or full one */
+static int cch_index_mid_entry_kmem_size(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	return cch_index_entry_is_compact(entry) ?
+		index->compact_mid_entry_size : index->mid_level_entry_size;
 }
 
 /**
- * Decide whether to create mid or lowest level entry upon given
- * index level number.
+ * Replace compact mid level entry with a copy that has room for child
+ * at @arg offset, which is compact while the children fit it and full
+ * otherwise. Children and parent are moved to the copy, offsets left
+ * without children are dropped. Old entry is freed after RCU grace
+ * period, lookups in it find the same children.
  *
- * @arg parent parent index entry to attach new entry to
- * @arg level level number of new entry
- * @arg offset offset of new entry in parent v[] table.
+ * Called under subtree lock.
  */
-int cch_index_entry_create(
-	struct cch_index *index,
-	struct cch_index_entry *parent,
-	struct cch_index_entry **new_entry,
-	int level,
-	int offset)
+static int __cch_index_entry_grow(struct cch_index *index,
+	struct cch_index_entry *entry, int offset,
+	struct cch_index_entry **new_entry)
 {
-	int result;
+	struct cch_index_entry *copy, *child, *parent;
+	uint16_t *keys = cch_index_entry_keys(entry), *copy_keys;
+	int size = cch_index_entry_size(index, entry);
+	int result = 0;
+	int nr = 0, i = 0;
+	bool compact, placed = false;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(parent == NULL);
-	sBUG_ON(new_entry == NULL);
+	sBUG_ON(!cch_index_entry_is_compact(entry));
 
-	if (level == index->levels - 1) {
-		/* level is lowest level */
-		result = cch_index_create_lowest_entry(
-			index, parent, new_entry, offset);
-		if (result)
-			goto out;
-	} else {
-		/* next level is mid level */
-		result = cch_index_create_mid_entry(
-			index, parent, new_entry, offset);
-		if (result)
-			goto out;
+	for (i = 0; i < entry->nr; i++) {
+		if (entry->v[i].entry != NULL)
+			nr++;
+	}
+	/* and the new one */
+	compact = nr < CCH_INDEX_COMPACT_MID_SIZE;
+
+	copy = kmem_cache_zalloc(compact ? index->compact_mid_kmem :
+		index->mid_level_kmem, GFP_KERNEL);
+	if (copy == NULL) {
+		PRINT_ERROR("mid level alloc failure");
+		result = -ENOMEM;
+		goto out;
+	}
+
+	copy->parent = entry->parent;
+	copy->parent_offset = entry->parent_offset;
+	copy->backend_offs = entry->backend_offs;
+	copy->index = index;
+	copy->nr = compact ? 0 : -1;
+	atomic_set(&copy->ref_cnt, nr);
+#ifdef CCH_INDEX_DEBUG
+	copy->magic = CCH_INDEX_ENTRY_MAGIC;
+#endif
+	copy_keys = cch_index_entry_keys(copy);
+
+	for (i = 0; i < entry->nr; i++) {
+		child = entry->v[i].entry;
+		if (child == NULL)
+			continue;
+		if (!compact) {
+			copy->v[keys[i]].entry = child;
+			__set_bit(keys[i], cch_index_entry_bitmap(index, copy));
+			continue;
+		}
+		/* offset of new child in key order, with no child yet */
+		if (!placed && offset < keys[i]) {
+			copy_keys[copy->nr++] = offset;
+			placed = true;
+		}
+		copy->v[copy->nr].entry = child;
+		copy_keys[copy->nr++] = keys[i];
+	}
+	if (compact && !placed)
+		copy_keys[copy->nr++] = offset;
+
+	TRACE(TRACE_DEBUG, "entry %p with %d children grows to %s %p",
+	      entry, nr, compact ? "compact" : "full", copy);
+
+	/* copy starts with no skip, skips above may lead to entry */
+	parent = cch_index_entry_get_parent(entry);
+	cch_index_skip_clear(index, parent);
+	rcu_assign_pointer(*cch_index_entry_child_slot(index, parent,
+		entry->parent_offset), copy);
+
+	/* climbers may come to either of them meanwhile */
+	for (i = cch_index_entry_next_child(index, copy, 0); i < size;
+	     i = cch_index_entry_next_child(index, copy, i + 1)) {
+		child = *cch_index_entry_child_slot(index, copy, i);
+		if (child != NULL && !cch_index_entry_is_unloaded(child))
+			cch_index_entry_set_parent(child, copy);
 	}
 
+	index->on_new_entry_alloc_fn(index,
+		cch_index_mid_entry_kmem_size(index, copy),
+		cch_index_total_bytes_add(index,
+			cch_index_mid_entry_kmem_size(index, copy)));
+
+	cch_index_entry_free(index, entry);
+	index->on_entry_free_fn(index,
+		cch_index_mid_entry_kmem_size(index, entry),
+		cch_index_total_bytes_add(index,
+			-cch_index_mid_entry_kmem_size(index, entry)));
+
+	*new_entry = copy;
+
 out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
 
 /**
- * Create all index entries required for holding @arg key, returning
- * lowest entry of the path.
- * @arg key
- * @arg lowest_etnry
+ * Allocate empty records table of lowest level entry with
+ * CCH_INDEX_COMPACT_LEAVES, format is CCH_INDEX_LEAF_*
  */
-int __cch_index_create_path(
-	struct cch_index *index,
-	uint64_t key,
-	struct cch_index_entry **lowest_entry)
+static struct cch_index_leaf *cch_index_leaf_alloc(struct cch_index *index,
+	int format)
 {
-	int result = 0;
-	struct cch_index_entry *new_entry;
-	struct cch_index_entry *current_entry;
-	int record_offset;
-	int i = 0;
-	/* current iteration of key traverse is next to lowest level of index */
-	int next_to_lowest_level;
+	struct cch_index_leaf *leaf;
+	int size;
 
-	TRACE_ENTRY();
+	if (format == CCH_INDEX_LEAF_DENSE) {
+		leaf = kmem_cache_zalloc(index->dense_leaf_kmem, GFP_KERNEL);
+		size = index->dense_leaf_size;
+	} else {
+		leaf = kmem_cache_zalloc(index->compact_leaf_kmem, GFP_KERNEL);
+		size = index->compact_leaf_size;
+	}
+	if (leaf == NULL) {
+		PRINT_ERROR("leaf table alloc failure");
+		return NULL;
+	}
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(lowest_entry == NULL);
+	leaf->index = index;
+	leaf->format = format;
 
-	current_entry = &index->head;
+	index->on_new_entry_alloc_fn(index, size,
+		cch_index_total_bytes_add(index, size));
 
-	for (i = 0; i < index->levels - 1; i++) {
-		sBUG_ON(current_entry == NULL);
-		next_to_lowest_level = i == index->levels - 2;
+	return leaf;
+}
 
-		record_offset = EXTRACT_BIASED_VALUE(key,
-			index->levels_desc, i);
-		PRINT_INFO("offset is 0x%x", record_offset);
-		PRINT_INFO("value is %p",
-			   current_entry->v[record_offset].value);
+static void cch_index_leaf_free_rcu(struct rcu_head *head)
+{
+	struct cch_index_leaf *leaf =
+		container_of(head, struct cch_index_leaf, rcu_head);
 
-		if (current_entry->v[record_offset].entry == NULL) {
-			result = cch_index_entry_create(
-				index, current_entry, &new_entry, i + 1,
-				record_offset);
-			if (result)
-				goto out;
+	if (cch_index_leaf_is_dense(leaf))
+		kmem_cache_free(leaf->index->dense_leaf_kmem, leaf);
+	else
+		kmem_cache_free(leaf->index->compact_leaf_kmem, leaf);
+}
 
-			PRINT_INFO("created new index entry at %p",
-				current_entry);
-		}
-		current_entry = current_entry->v[record_offset].entry;
-	}
+/**
+ * Free replaced or unlinked records table after RCU grace period
+ */
+static void cch_index_leaf_free(struct cch_index *index,
+	struct cch_index_leaf *leaf)
+{
+	int size = cch_index_leaf_is_dense(leaf) ?
+		index->dense_leaf_size : index->compact_leaf_size;
 
-	*lowest_entry = current_entry;
+	call_rcu(&leaf->rcu_head, cch_index_leaf_free_rcu);
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+	index->on_entry_free_fn(index, size,
+		cch_index_total_bytes_add(index, -size));
+}
+
+/* put record to table that isn't visible to lookups yet */
+static void cch_index_leaf_put(struct cch_index_leaf *leaf, int size,
+	int offset, void *value)
+{
+	if (cch_index_leaf_is_dense(leaf)) {
+		leaf->values[offset] = value;
+		__set_bit(offset, (unsigned long *) &leaf->values[size]);
+	} else {
+		sBUG_ON(leaf->nr == CCH_INDEX_COMPACT_LEAF_SIZE);
+		leaf->keys[leaf->nr] = offset;
+		leaf->values[leaf->nr] = value;
+		leaf->nr++;
+	}
 }
 
 /**
- * Try to walk index using @arg key, returning lowest level entry,
- * if it's found, -ENOENT if not
+ * Put value to extent table of lowest level entry without replacing
+ * it: extend last run by one if the value follows its step, or start
+ * new run past it. Lookups see either old or longer runs.
  *
- * Should be called under cch_index_value_mutex.
+ * Called under subtree lock.
  *
- * @arg key
- * @arg found_entry
+ * @return -EAGAIN if runs can't take the value, -EEXIST if offset
+ * is taken and replace is not allowed
  */
-int __cch_index_walk_path(
-	struct cch_index *index,
-	uint64_t key,
-	struct cch_index_entry **found_entry)
+static int __cch_index_leaf_extent_append(struct cch_index *index,
+	struct cch_index_entry *entry, int offset, bool replace, void *value)
 {
-	int record_offset = 0;
-	struct cch_index_entry *current_entry;
+	struct cch_index_leaf *leaf = entry->v[0].leaf;
+	struct cch_index_leaf_run *run = cch_index_leaf_runs(leaf);
+	struct cch_index_leaf_run *last;
 	int result = 0;
-	int i = 0;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(found_entry == NULL);
-
-	// LOCK head?
-	current_entry = &index->head;
-	/* all levels except last one */
-	for (i = 0; i < index->levels - 1; i++) {
-		sBUG_ON(current_entry == NULL);
-
-		record_offset = EXTRACT_BIASED_VALUE(key,
-			index->levels_desc, i);
-		PRINT_INFO("offset is 0x%x", record_offset);
-		PRINT_INFO("value is %p",
-			   current_entry->v[record_offset].value);
+	if (cch_index_leaf_extent_value(leaf, offset) != NULL) {
+		result = replace ? -EAGAIN : -EEXIST;
+		goto out;
+	}
 
-		if (current_entry->v[record_offset].entry != NULL) {
-			current_entry = current_entry->v[record_offset].entry;
-		} else {
-			result = -ENOENT;
+	last = leaf->nr > 0 ? &run[leaf->nr - 1] : NULL;
+	if (last != NULL && offset == last->start + last->len) {
+		if (last->len == 1) {
+			last->stride = (unsigned long) value - last->base;
+			/* step is set before readers see second value */
+			smp_wmb();
+			last->len = 2;
+			goto out;
+		}
+		if ((unsigned long) value == last->base +
+		    (unsigned long) (last->len * last->stride)) {
+			last->len++;
 			goto out;
 		}
-		// UNLOCK previous
-		// LOCK new
 	}
 
-	*found_entry = current_entry;
+	if ((last != NULL && offset < last->start + last->len) ||
+	    leaf->nr == CCH_INDEX_EXTENT_RUNS) {
+		result = -EAGAIN;
+		goto out;
+	}
 
-	sBUG_ON(*found_entry == NULL);
-	sBUG_ON(!cch_index_entry_is_lowest_level(*found_entry));
+	run[leaf->nr].start = offset;
+	run[leaf->nr].len = 1;
+	run[leaf->nr].base = (unsigned long) value;
+	run[leaf->nr].stride = 0;
+	/* run is filled before readers count it */
+	smp_wmb();
+	leaf->nr++;
 
 out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
 
-
-
 /**
- * Insert value to given lowest level entry at given offset,
- * replacing old value if required. Updates reference counter.
+ * Replace records table of lowest level entry with a new one,
+ * holding the same records and @arg value at @arg offset unless
+ * it's NULL. Offset must have no record yet. Compact table is
+ * taken while the records fit it, empty records are dropped.
+ * Extent table runs are turned into records the same way.
  *
- * @arg entry index entry to insert to
- * @arg offset insert to entry->v[offset]
- * @arg value value to insert
+ * Called under subtree lock, lookups see either old or new table.
  */
-int __cch_index_entry_insert_direct(
-	struct cch_index *index,
-	struct cch_index_entry *entry,
-	int offset,
-	bool replace,
-	void *value)
+static int __cch_index_leaf_rebuild(struct cch_index *index,
+	struct cch_index_entry *entry, int offset, void *value)
 {
+	struct cch_index_leaf *old_leaf, *leaf;
+	int size = cch_index_entry_size(index, entry);
 	int result = 0;
+	int nr = 0, i = 0;
+	void *v;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-	sBUG_ON(offset >= cch_index_entry_size(index, entry));
-	sBUG_ON(offset < 0);
+	sBUG_ON(!(index->flags & CCH_INDEX_COMPACT_LEAVES));
 
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
+	old_leaf = entry->v[0].leaf;
 
-	TRACE(TRACE_DEBUG,
-	      "inserting direct to %p at offset %d value %p, "
-	      "current value %p",
-	      entry, offset, value, entry->v[offset].value);
-
-	if (entry->v[offset].value == NULL) {
-		entry->ref_cnt++;
-		entry->v[offset].value = value;
-	} else if (replace) {
-		/* no new value thus no ref_cnt */
-		entry->v[offset].value = value;
-	} else {
-		result = -EEXIST;
+	for (i = cch_index_entry_next_offset(index, entry, 0); i < size;
+	     i = cch_index_entry_next_offset(index, entry, i + 1)) {
+		if (cch_index_entry_value(index, entry, i) != NULL)
+			nr++;
+	}
+	if (value != NULL)
+		nr++;
+
+	leaf = cch_index_leaf_alloc(index,
+		nr <= CCH_INDEX_COMPACT_LEAF_SIZE ?
+		CCH_INDEX_LEAF_COMPACT : CCH_INDEX_LEAF_DENSE);
+	if (leaf == NULL) {
+		result = -ENOMEM;
 		goto out;
 	}
 
-	TRACE(TRACE_DEBUG,
-	      "result of insert is %p", entry->v[offset].value);
+	/* merge new record in offset order */
+	for (i = cch_index_entry_next_offset(index, entry, 0); i < size;
+	     i = cch_index_entry_next_offset(index, entry, i + 1)) {
+		v = cch_index_entry_value(index, entry, i);
+		if (v == NULL)
+			continue;
+		if (value != NULL && offset < i) {
+			cch_index_leaf_put(leaf, size, offset, value);
+			value = NULL;
+		}
+		cch_index_leaf_put(leaf, size, i, v);
+	}
+	if (value != NULL)
+		cch_index_leaf_put(leaf, size, offset, value);
+
+	TRACE(TRACE_DEBUG, "entry %p records %d moved to %s table",
+	      entry, nr, cch_index_leaf_is_dense(leaf) ? "dense" : "compact");
 
-	cch_index_entry_lru_update(index, entry);
+	rcu_assign_pointer(entry->v[0].leaf, leaf);
+	cch_index_leaf_free(index, old_leaf);
 
 out:
 	TRACE_EXIT_RES(result);
@@ -833,279 +1167,239 @@ out:
 }
 
 /**
- * Checks if entry should be removed by ref_cnt value,
- * check all parents for same problem
+ * Frees records of lowest level entry, checks if reference
+ * count is right, puts entry back to kmem_cache
  *
- * @arg index
- * @arg entry
+ * @arg entry entry to be freed
  */
-void __cch_index_entry_cleanup(
+void cch_index_destroy_lowest_level_entry(
 	struct cch_index *index,
 	struct cch_index_entry *entry)
 {
-	struct cch_index_entry *parent, *current_entry;
-	int parent_entry_size;
+	int current_size = 0;
+	int i = 0, values = 0;
+	int ref_cnt;
+	void **slot;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
+	/* under subtree lock or from cch_index_destroy() */
 
-	current_entry = entry;
+	sBUG_ON(entry == NULL);
+	sBUG_ON(POINTER_FREED(entry));
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
 
-	while (!cch_index_entry_is_root(current_entry)) {
-		if (current_entry->ref_cnt != 0)
-			goto done;
-		parent = cch_index_entry_get_parent(current_entry);
-		parent_entry_size = cch_index_entry_size(index, current_entry);
+	current_size = cch_index_entry_size(index, entry);
+	for (i = cch_index_entry_next_offset(index, entry, 0);
+	     i < current_size;
+	     i = cch_index_entry_next_offset(index, entry, i + 1)) {
+		slot = cch_index_entry_value_slot(index, entry, i);
+		if (slot == NULL) {
+			/* extent table, values are computed */
+			if (cch_index_entry_value(index, entry, i) != NULL)
+				values++;
+		} else if (*slot != NULL) {
+			*slot = NULL;
+			values++;
+		}
+	}
+	ref_cnt = atomic_read(&entry->ref_cnt) &
+		~(CCH_INDEX_ENTRY_DEAD | CCH_INDEX_ENTRY_UNLOADING);
+	TRACE(TRACE_DEBUG, "refcount is %d, values %d", ref_cnt, values);
+	sBUG_ON(ref_cnt != values);
 
-		TRACE(TRACE_DEBUG, "destroy entry %p "
-		      "with parent %p, offset = %d",
-		      current_entry, parent, current_entry->parent_offset);
+	cch_index_entry_lru_remove(index, entry);
 
-		parent->v[current_entry->parent_offset].entry = NULL;
-		parent->ref_cnt--;
-		cch_index_destroy_entry(index, current_entry);
+	if (index->flags & CCH_INDEX_COMPACT_LEAVES)
+		cch_index_leaf_free(index, entry->v[0].leaf);
+	cch_index_entry_free(index, entry);
 
-		current_entry = parent;
-	}
+	index->on_entry_free_fn(index, index->lowest_level_entry_size,
+		cch_index_total_bytes_add(index,
+			-index->lowest_level_entry_size));
 
-done:
 	TRACE_EXIT();
 	return;
 }
 
 /**
- * Search first index entry that is capable of holding
- * (i + 1)th branch started at @arg entry.
- *
- * Get parent of current entry, find current entry in parent,
- * see if (i + 1) is possible. If not, go up one level, if yes --
- * that's the result. Repeat till root entry which is capable
- * of holding 2^bits keys with low chances of overflow.
- *
- * Needed to extract this code as it is reusable for *_direct functions.
- *
- * Also, this function can not fail thus no return code.
- * When it fails, it's a programming bug.
+ * Call appropriate *_destroy_* function on records of entry,
+ * decrease reference count for each freed entry,
+ * check if it's zero at moment of destruction,
+ * puts entry back to cache.
  *
  * @arg index
- * @arg entry -- starting entry, always of lowest level
- * @arg subtree_root -- the result (any from parent of "entry" to root entry)
- * @arg offset -- offset of path from "entry" to "subtree_root" in
- *      subtree_root v[] table
- * @arg entry_level -- level of subtree_root, 0 -- root,
- *      index->levels -1 -- lowest
- * @arg direction -- for capabilities of backwards traversal,
- *      this arg specifies if we're searching for (i+1)-capable subtree_root,
- *      or (i-1) one.
+ * @arg entry mid-level entry to be freed
+ * @arg level -- level of current entry for debug purposes,
+ *      children entries get (level + 1)
+ *
  */
-void __cch_index_climb_to_first_capable_parent(
-	struct cch_index *index,
-	struct cch_index_entry *entry,
-	struct cch_index_entry **subtree_root,
-	int *offset,
-	int *entry_level,
-	int direction)
+void cch_index_destroy_mid_level_entry(struct cch_index *index,
+	struct cch_index_entry *entry, int level)
 {
-	struct cch_index_entry *this_entry, *parent_entry;
-	int this_entry_level;
-	int parent_entry_size;
-	int result = 0;
+	struct cch_index_entry **slot;
+	int current_size = 0, i = 0;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
+	/* under subtree lock or from cch_index_destroy() */
 	sBUG_ON(entry == NULL);
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-	sBUG_ON(entry_level == NULL);
-	sBUG_ON(subtree_root == NULL);
-	sBUG_ON(offset == NULL);
-	sBUG_ON(entry_level == 0);
-
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
-
-	this_entry = entry;
-	parent_entry = cch_index_entry_get_parent(this_entry);
-	/* this_entry is at lowest level */
-	this_entry_level = index->levels - 1;
+	sBUG_ON(POINTER_FREED(entry));
 
-	while (!cch_index_entry_is_root(parent_entry)) {
-		parent_entry_size = cch_index_entry_size(index, parent_entry);
-		result = 0;
+	TRACE(TRACE_DEBUG, "destroy mid level %p, level %d, references %d",
+	      entry, level, atomic_read(&entry->ref_cnt));
 
-		/* i now holds this_entry offset in parent_entry */
+	if (!cch_index_entry_is_mid_level(entry)) {
+		if (cch_index_entry_is_lowest_level(entry)) {
+			PRINT_INFO("entry is lowest");
+			sBUG();
+		} else if (cch_index_entry_is_root(entry)) {
+			PRINT_INFO("entry is root %p %p", entry, &index->head);
+			sBUG();
+		} else {
+			PRINT_ERROR("unknown type of entry");
+			sBUG();
+		}
+	}
 
-		this_entry_level--;
+	current_size = cch_index_entry_size(index, entry);
+	for (i = cch_index_entry_next_child(index, entry, 0);
+	     i < current_size;
+	     i = cch_index_entry_next_child(index, entry, i + 1)) {
+		slot = cch_index_entry_child_slot(index, entry, i);
+		if (*slot == NULL)
+			continue;
 
-		TRACE(TRACE_DEBUG, "climb i is %d and size is %d",
-		      this_entry->parent_offset, parent_entry_size);
-		if (this_entry->parent_offset + 1 < parent_entry_size)
-			break; /* we can use that */
+		if (cch_index_entry_is_unloaded(*slot)) {
+			/* nothing in memory, its backend space is dropped */
+			atomic_dec(&index->nr_unloaded);
+			goto unlink;
+		}
+		/* how can an entry here be already free? */
+		sBUG_ON(POINTER_FREED(*slot));
 
-		this_entry = parent_entry;
-		parent_entry = cch_index_entry_get_parent(this_entry);
+		if (cch_index_entry_is_lowest_level(*slot)) {
+			PRINT_INFO("destroying lowest level 0x%x", i);
+			cch_index_destroy_lowest_level_entry(index, *slot);
+		} else {
+			PRINT_INFO("destroying mid level 0x%x", i);
+			cch_index_destroy_mid_level_entry(index, *slot,
+				level + 1);
+		}
+unlink:
+		*slot = NULL;
+		atomic_dec(&entry->ref_cnt);
 	}
 
-	sBUG_ON(cch_index_entry_is_root(this_entry) && (this_entry_level != 0));
-	sBUG_ON(parent_entry->v[this_entry->parent_offset].entry != this_entry);
+	PRINT_INFO("refcount is %d", atomic_read(&entry->ref_cnt));
+	sBUG_ON(atomic_read(&entry->ref_cnt) & ~CCH_INDEX_ENTRY_DEAD);
 
-	*subtree_root = parent_entry;
-	*entry_level = this_entry_level;
-	*offset = this_entry->parent_offset;
+	cch_index_entry_free(index, entry);
+
+	index->on_entry_free_fn(index,
+		cch_index_mid_entry_kmem_size(index, entry),
+		cch_index_total_bytes_add(index,
+			-cch_index_mid_entry_kmem_size(index, entry)));
 
 	TRACE_EXIT();
 	return;
 }
 
-/*
- * Find lowest level index entry that is next in key order to
- * given entry, creating one if required.
- *
- * @arg index
- * @arg entry -- lowest level index_entry which sibling we are looking
- *               for
- * @arg sibling -- found or created (with all levels) sibling
- */
-int __cch_index_entry_create_next_sibling(
+void cch_index_destroy_entry(
 	struct cch_index *index,
-	struct cch_index_entry *entry,
-	struct cch_index_entry **sibling)
+	struct cch_index_entry *entry)
 {
-	int result = 0;
-	struct cch_index_entry *parent_entry, *this_entry;
-	int this_entry_level = 0;
-	int sibling_offset = 0;
-	int i = 0;
-
 	TRACE_ENTRY();
 
 	sBUG_ON(index == NULL);
 	sBUG_ON(entry == NULL);
-	sBUG_ON(sibling == NULL);
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
+
+	if (cch_index_entry_is_lowest_level(entry))
+		cch_index_destroy_lowest_level_entry(index, entry);
+	else if (cch_index_entry_is_mid_level(entry))
+		cch_index_destroy_mid_level_entry(index, entry, 1);
+	else
+		sBUG();
 
 	/*
-	 * The function consists of two parts:
-	 *
-	 * 1. Find index_entry that is root point for (i+1) transition
+	 * we should also delete ourselves from parent, put NULL
+	 * down there and decrease reference count
 	 *
-	 * 2. Go down from that entry to lowest level, creating
-	 *    entries on the way, so we create a lowest_level
-	 *    entry that is a (i + 1) sibling to "entry" argument
-	 */
-	__cch_index_climb_to_first_capable_parent(
-		index, entry, &parent_entry, &i, &this_entry_level, 1);
-
-	sibling_offset = i + 1;
-	TRACE(TRACE_DEBUG, "we can traverse down from %p at offset %d, "
-	      "level %d", parent_entry, sibling_offset, this_entry_level);
-
-	/* all of this complexity is to check if "i + 1" is safe */
-	/* now in this_entry we have entry we should climb down
-	 * at v[0] entries to get the right sibling
+	 * Finding ourselves in parent table is O(size) for
+	 * _every_ entry that is being removed (with appropriate 1/O(size)
+	 * of chance to have ref_cnt == 0;
 	 */
-	while (this_entry_level < index->levels - 1) {
-		this_entry = parent_entry->v[sibling_offset].entry;
-		this_entry_level++;
-
-		TRACE(TRACE_DEBUG, "this level is %d", this_entry_level);
-		if (this_entry == NULL) {
-			result = cch_index_entry_create(
-				index, parent_entry, &this_entry,
-				this_entry_level, sibling_offset);
-			if (result) {
-				PRINT_ERROR("couldn't create new entry while "
-					"doing next_sibling search\n");
-				goto out;
-			}
-
-			sBUG_ON(this_entry == NULL);
-		}
-
-		parent_entry = this_entry;
-		sibling_offset = 0;
-	};
-
-	*sibling = this_entry;
-
-	/* this function did effectively nothing if this bug happens */
-	sBUG_ON(*sibling == entry);
-	/* result should be same level as input -- lowest one */
-	sBUG_ON(!cch_index_entry_is_lowest_level(*sibling));
 
-out:
-	TRACE_EXIT_RES(result);
-	return result;
+	TRACE_EXIT();
+	return;
 }
 
 /**
- * Find next (in key order) sibling to given entry, if there is one.
+ * Remove record from given entry at given offset,
+ * decreasing reference count. Unused entries on this path
+ * are freed by __cch_index_entry_cleanup().
  *
- * The difference with previous (..._create_next_sibling)
- * is that this function doesn't create any new index entries, so
- * it is suitable for search.
+ * Supposed to be called under subtree lock, races only with
+ * lockless inserters of __cch_index_entry_insert_direct().
+ *
+ * @return -ENOENT if there was no value at offset
  */
-int __cch_index_entry_find_next_sibling(
+int __cch_index_entry_remove_value(
 	struct cch_index *index,
 	struct cch_index_entry *entry,
-	struct cch_index_entry **sibling)
+	int offset)
 {
 	int result = 0;
-	struct cch_index_entry *parent_entry, *this_entry = NULL;
-	int this_entry_level = 0;
-	int sibling_offset = 0;
-	int i = 0;
+	void *old_value;
+	void **slot;
+	unsigned long *bitmap;
+	int ref_cnt;
 
 	TRACE_ENTRY();
 
 	sBUG_ON(index == NULL);
 	sBUG_ON(entry == NULL);
-	sBUG_ON(sibling == NULL);
 	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
 
-	/*
-	 * The function consists of two parts:
-	 *
-	 * 1. Find index_entry that is root point for (i+1) transition
-	 *
-	 * 2. Go down from that entry to lowest level, creating
-	 *    entries on the way, so we create a lowest_level
-	 *    entry that is a (i + 1) sibling to "entry" argument
-	 */
-	__cch_index_climb_to_first_capable_parent(
-		index, entry, &parent_entry, &i, &this_entry_level, 1);
-
-	TRACE(TRACE_DEBUG,
-	      "we can traverse down from %p at offset %d, level %d",
-	      parent_entry, i + 1, this_entry_level);
-
-	/* all of this complexity is to check if "i + 1" is safe */
-	sibling_offset = i + 1;
-	/* now in this_entry we have entry we should climb down
-	 * at v[0] entries to get th e right sibling
-	 */
-	while (this_entry_level < index->levels - 1) {
-		this_entry = parent_entry->v[sibling_offset].entry;
-		this_entry_level++;
-
-		PRINT_INFO("this level is %d", this_entry_level);
-		if (this_entry == NULL) {
+	TRACE(TRACE_DEBUG, "removing at offset 0x%x", offset);
+	if ((index->flags & CCH_INDEX_EXTENT_LEAVES) &&
+	    cch_index_leaf_is_extent(entry->v[0].leaf)) {
+		if (cch_index_entry_value(index, entry, offset) == NULL) {
 			result = -ENOENT;
 			goto out;
 		}
+		/* runs can't have holes */
+		result = __cch_index_leaf_rebuild(index, entry, 0, NULL);
+		if (result)
+			goto out;
+	}
 
-		parent_entry = this_entry;
-		sibling_offset = 0;
-	};
+	slot = cch_index_entry_value_slot(index, entry, offset);
+	old_value = slot ? xchg(slot, NULL) : NULL;
+	if (old_value == NULL) {
+		result = -ENOENT;
+		goto out;
+	}
 
-	*sibling = this_entry;
-	result = 0;
+	bitmap = cch_index_entry_value_bitmap(index, entry);
+	if (bitmap != NULL) {
+		clear_bit(offset, bitmap);
+		smp_mb();
+		/* lockless inserter may have put new value and set the bit
+		 * before we cleared it, keep value slots marked */
+		if (*slot != NULL)
+			set_bit(offset, bitmap);
+	}
+	ref_cnt = atomic_dec_return(&entry->ref_cnt);
+	TRACE(TRACE_DEBUG, "refcnt become %d\n", ref_cnt);
+
+	/* mostly empty dense table goes back to compact one,
+	 * it just stays dense if there is no memory for that */
+	if ((index->flags & CCH_INDEX_COMPACT_LEAVES) && bitmap != NULL &&
+	    ref_cnt > 0 && ref_cnt <= CCH_INDEX_COMPACT_LEAF_SIZE / 2)
+		__cch_index_leaf_rebuild(index, entry, 0, NULL);
+
+	cch_index_entry_mark_dirty(entry);
 
 out:
 	TRACE_EXIT_RES(result);
@@ -1113,463 +1407,4104 @@ out:
 }
 
 /**
- * Find lowest level index entry that is previous in key order
- * to given entry, creating one if required
- * @arg
+ * Destroy all linked records (mid_level), decrease reference count,
+ * check if it's zero at the end. Can't free because it is
+ * allocated inside cch_index.
  */
-int __cch_index_entry_find_prev_sibling(
-	struct cch_index *index,
-	struct cch_index_entry *entry,
-	struct cch_index_entry **sibling)
+void cch_index_destroy_root_entry(struct cch_index *index)
 {
-	int result = 0;
+	int current_size = 0;
+	int i = 0;
 
 	TRACE_ENTRY();
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	sBUG_ON(*sibling == NULL);
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
+	current_size = cch_index_entry_size(index, &index->head);
+	for_each_set_bit(i, cch_index_entry_bitmap(index, &index->head),
+			 current_size) {
+		if (index->head.v[i].entry == NULL)
+			continue;
+		cch_index_destroy_mid_level_entry(index,
+			index->head.v[i].entry, 1);
+		index->head.v[i].entry = NULL;
+		atomic_dec(&index->head.ref_cnt);
+	}
 
-	TRACE_EXIT_RES(result);
-	return result;
+	TRACE(TRACE_DEBUG, "remaning reference for root is %d",
+	      atomic_read(&index->head.ref_cnt));
+	sBUG_ON(atomic_read(&index->head.ref_cnt) != 0);
+
+	TRACE_EXIT();
+	return;
 }
 
-int cch_index_remove_direct(
+/**
+ * Allocate index entry of lowest level with no records for
+ * parent->v[offset]. It isn't on LRU list and lookups don't see it yet.
+ *
+ * When debugging, check for common memory allocation problems.
+ */
+static int cch_index_lowest_entry_alloc(
 	struct cch_index *index,
-	struct cch_index_entry *entry,
-	int offset)
+	struct cch_index_entry *parent,
+	int offset,
+	struct cch_index_entry **new_entry)
 {
-	TRACE_ENTRY();
+	int result = 0;
+#ifdef CCH_INDEX_DEBUG
+	int i = 0;
+#endif
 
-	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	/* FIXME locking */
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+	*new_entry = kmem_cache_zalloc(index->lowest_level_kmem, GFP_KERNEL);
+	if (!*new_entry) {
+		PRINT_ERROR("low level alloc failure");
+		result = -ENOMEM;
+		goto out;
+	}
 
-	mutex_lock(&index->cch_index_value_mutex);
+	(*new_entry)->parent = (struct cch_index_entry *)
+		(((unsigned long) parent) | ENTRY_LOWEST_ENTRY_BIT);
+	(*new_entry)->parent_offset = offset;
+	(*new_entry)->index = index;
 
-	/*
-	 * doesn't seem like we should leap to next entry
-	 * on offset overflow. Or should we?
-	 */
-	__cch_index_entry_remove_value(index, entry, offset);
+#ifdef CCH_INDEX_DEBUG
+	/* check real bounds of new object */
+	for (i = 0; i < (index->lowest_level_entry_size -
+			 sizeof(struct cch_index_entry)) /
+		     sizeof((*new_entry)->v[0]); i++)
+		sBUG_ON((*new_entry)->v[i].entry != NULL);
+	(*new_entry)->magic = CCH_INDEX_ENTRY_MAGIC;
+#endif
 
-	mutex_unlock(&index->cch_index_value_mutex);
+	if (index->flags & CCH_INDEX_COMPACT_LEAVES) {
+		(*new_entry)->v[0].leaf = cch_index_leaf_alloc(index,
+			(index->flags & CCH_INDEX_EXTENT_LEAVES) ?
+			CCH_INDEX_LEAF_EXTENT : CCH_INDEX_LEAF_COMPACT);
+		if ((*new_entry)->v[0].leaf == NULL) {
+			kmem_cache_free(index->lowest_level_kmem, *new_entry);
+			*new_entry = NULL;
+			result = -ENOMEM;
+			goto out;
+		}
+	}
 
-	TRACE_EXIT();
-	return 0;
+	/* memory accounting */
+	index->on_new_entry_alloc_fn(index, index->lowest_level_entry_size,
+		cch_index_total_bytes_add(index,
+			index->lowest_level_entry_size));
+
+	INIT_LIST_HEAD(&((*new_entry)->index_lru_list_entry));
+
+out:
+	return result;
 }
-EXPORT_SYMBOL(cch_index_remove_direct);
 
-int cch_index_insert_direct(
+/* put lowest level entry to LRU tail, as most recently used */
+static void cch_index_entry_lru_add(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&(index->index_lru_list_lock), flags);
+	list_add_tail(&(entry->index_lru_list_entry),
+		      &index->index_lru_list);
+	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
+}
+
+/**
+ * Create index entry of lowest level, attach it to parent,
+ * update reference counts.
+ *
+ * @arg parent
+ * @arg new_entr
+ * @arg offset
+ */
+int cch_index_create_lowest_entry(
 	struct cch_index *index,
-	struct cch_index_entry *entry,
-	int offset,
-	bool replace,
-	void *value,
-	struct cch_index_entry **new_index_entry,
-	int *new_value_offset)
+	struct cch_index_entry *parent,
+	struct cch_index_entry **new_entry,
+	int offset)
 {
 	int result = 0;
-	int lowest_entry_size = 0;
-	struct cch_index_entry *right_entry = NULL;
 
 	TRACE_ENTRY();
 
 	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	/* we can insert entry only to lowest entry */
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+	sBUG_ON(parent == NULL);
 
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
+	result = cch_index_lowest_entry_alloc(index, parent, offset,
+		new_entry);
+	if (result)
+		goto out;
 
-	mutex_lock(&index->cch_index_value_mutex);
+	cch_index_entry_lru_add(index, *new_entry);
 
-	right_entry = entry;
-	lowest_entry_size = cch_index_entry_size(index, entry);
+	/* entry is initialized, now lookups may see it */
+	cch_index_entry_link(index, parent, *new_entry, offset);
 
-	TRACE(TRACE_DEBUG, "insert_direct: offset: %d, size: %d\n",
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * Create index entry of mid level, updating parent and reference counts.
+ *
+ * @arg parent
+ * @arg new_entry
+ * @arg offset
+ */
+int cch_index_create_mid_entry(
+	struct cch_index *index,
+	struct cch_index_entry *parent,
+	struct cch_index_entry **new_entry,
+	int offset)
+{
+	int result = 0;
+	bool compact = index->flags & CCH_INDEX_COMPACT_MID;
+#ifdef CCH_INDEX_DEBUG
+	int i = 0;
+#endif
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(parent == NULL);
+
+	/* new entry has single child, so it starts compact */
+	*new_entry = kmem_cache_zalloc(compact ? index->compact_mid_kmem :
+		index->mid_level_kmem, GFP_KERNEL);
+	if (!*new_entry) {
+		PRINT_ERROR("mid level alloc failure");
+		result = -ENOMEM;
+		goto out;
+	}
+
+	(*new_entry)->parent_offset = offset;
+	(*new_entry)->parent = parent;
+	(*new_entry)->index = index;
+	(*new_entry)->nr = compact ? 0 : -1;
+
+#ifdef CCH_INDEX_DEBUG
+	for (i = 0; i < (compact ? CCH_INDEX_COMPACT_MID_SIZE :
+			 cch_index_entry_size(index, *new_entry)); i++)
+		sBUG_ON((*new_entry)->v[i].entry != NULL);
+	(*new_entry)->magic = CCH_INDEX_ENTRY_MAGIC;
+#endif
+
+	cch_index_entry_link(index, parent, *new_entry, offset);
+
+	/* memory accounting */
+	index->on_new_entry_alloc_fn(index,
+		cch_index_mid_entry_kmem_size(index, *new_entry),
+		cch_index_total_bytes_add(index,
+			cch_index_mid_entry_kmem_size(index, *new_entry)));
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * Decide whether to create mid or lowest level entry upon given
+ * index level number.
+ *
+ * @arg parent parent index entry to attach new entry to
+ * @arg level level number of new entry
+ * @arg offset offset of new entry in parent v[] table.
+ */
+int cch_index_entry_create(
+	struct cch_index *index,
+	struct cch_index_entry *parent,
+	struct cch_index_entry **new_entry,
+	int level,
+	int offset)
+{
+	int result;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(parent == NULL);
+	sBUG_ON(new_entry == NULL);
+
+	/* compact parent gets room for new child first */
+	if (cch_index_entry_child_slot(index, parent, offset) == NULL) {
+		result = __cch_index_entry_grow(index, parent, offset,
+			&parent);
+		if (result)
+			goto out;
+	}
+
+	if (level == index->levels - 1) {
+		/* level is lowest level */
+		result = cch_index_create_lowest_entry(
+			index, parent, new_entry, offset);
+		if (result)
+			goto out;
+	} else {
+		/* next level is mid level */
+		result = cch_index_create_mid_entry(
+			index, parent, new_entry, offset);
+		if (result)
+			goto out;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* first key of entry at given level, parent offsets give its bits */
+static uint64_t cch_index_entry_first_key(struct cch_index *index,
+	struct cch_index_entry *entry, int level)
+{
+	uint64_t key = 0;
+
+	while (!cch_index_entry_is_root(entry)) {
+		level--;
+		key |= (uint64_t) entry->parent_offset <<
+			index->levels_desc[level].offset;
+		entry = cch_index_entry_get_parent(entry);
+	}
+
+	return key;
+}
+
+/**
+ * Point skip of compact @arg entry to @arg target at @arg level,
+ * or drop it if @arg target is NULL. Key and mask are written while
+ * there is no target, lookups check it's the same after reading
+ * them, see cch_index_skip_follow().
+ *
+ * Called under subtree lock.
+ */
+static void cch_index_skip_set(struct cch_index *index,
+	struct cch_index_entry *entry, struct cch_index_entry *target,
+	int level)
+{
+	struct cch_index_skip *skip = cch_index_entry_skip(entry);
+
+	if (skip->target == target)
+		return;
+
+	WRITE_ONCE(skip->target, NULL);
+	if (target == NULL)
+		return;
+
+	smp_wmb();
+	WRITE_ONCE(skip->key, cch_index_entry_first_key(index, target, level));
+	WRITE_ONCE(skip->mask, ~cch_index_level_span_mask(index, level));
+	WRITE_ONCE(skip->level, level);
+	smp_wmb();
+	rcu_assign_pointer(skip->target, target);
+}
+
+/**
+ * Update skips of entries above @arg entry at @arg level, each single
+ * child compact one goes to the deepest entry its chain leads to.
+ * @arg entry is lowest level one or end of the chain below it.
+ *
+ * Called under subtree lock.
+ */
+static void cch_index_skip_update(struct cch_index *index,
+	struct cch_index_entry *entry, int level)
+{
+	struct cch_index_entry *target = entry;
+	int target_level = level;
+
+	for (entry = cch_index_entry_get_parent(entry), level--;
+	     !cch_index_entry_is_root(entry);
+	     entry = cch_index_entry_get_parent(entry), level--) {
+		if (!cch_index_entry_is_compact(entry) ||
+		    atomic_read(&entry->ref_cnt) != 1) {
+			target = entry;
+			target_level = level;
+			continue;
+		}
+		/* nothing to skip in child itself */
+		cch_index_skip_set(index, entry,
+			target_level > level + 1 ? target : NULL,
+			target_level);
+	}
+}
+
+static int __cch_index_entry_load(struct cch_index *index,
+	struct cch_index_entry *parent, int offset, uint64_t key,
+	struct cch_index_entry **loaded);
+
+/**
+ * Create all index entries required for holding @arg key, returning
+ * lowest entry of the path. Unloaded entry of the path is loaded.
+ * @arg key
+ * @arg lowest_etnry
+ */
+int __cch_index_create_path(
+	struct cch_index *index,
+	uint64_t key,
+	struct cch_index_entry **lowest_entry)
+{
+	int result = 0;
+	struct cch_index_entry *new_entry;
+	struct cch_index_entry *current_entry;
+	int record_offset;
+	int i = 0;
+	/* current iteration of key traverse is next to lowest level of index */
+	int next_to_lowest_level;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(lowest_entry == NULL);
+
+	current_entry = &index->head;
+
+	for (i = 0; i < index->levels - 1; i++) {
+		sBUG_ON(current_entry == NULL);
+		next_to_lowest_level = i == index->levels - 2;
+
+		record_offset = EXTRACT_BIASED_VALUE(key,
+			index->levels_desc, i);
+		PRINT_INFO("offset is 0x%x", record_offset);
+
+		new_entry = cch_index_entry_child(index, current_entry,
+			record_offset);
+		if (new_entry == NULL) {
+			/* current_entry may be replaced by a bigger one */
+			result = cch_index_entry_create(
+				index, current_entry, &new_entry, i + 1,
+				record_offset);
+			if (result)
+				goto out;
+
+			PRINT_INFO("created new index entry at %p",
+				new_entry);
+		} else if (cch_index_entry_is_unloaded(new_entry)) {
+			result = __cch_index_entry_load(index, current_entry,
+				record_offset, key, &new_entry);
+			if (result)
+				goto out;
+		}
+		current_entry = new_entry;
+	}
+
+	if (index->flags & CCH_INDEX_COMPACT_MID)
+		cch_index_skip_update(index, current_entry,
+			index->levels - 1);
+
+	*lowest_entry = current_entry;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* bits of mid level entry, see generate_level_descriptions() */
+#define CCH_INDEX_MID_BITS(levels, bits, root_bits, low_bits)	\
+	(((bits) - ((root_bits) + (low_bits))) / (levels))
+
+/**
+ * Go by skip of compact mid level @arg entry at @arg level for
+ * @arg key, see struct cch_index_skip. Returns level @arg entry is
+ * at then, which is NULL if the key isn't on skipped path.
+ *
+ * Called under subtree lock of @arg key or rcu_read_lock().
+ */
+static __always_inline int cch_index_skip_follow(struct cch_index *index,
+	uint64_t key, struct cch_index_entry **entry, int level)
+{
+	struct cch_index_skip *skip = cch_index_entry_skip(*entry);
+	struct cch_index_entry *target;
+	uint64_t skip_key, mask;
+	int skip_level;
+
+	target = rcu_dereference(skip->target);
+	if (target == NULL)
+		return level;
+
+	/* read for this target unless it's changed meanwhile */
+	smp_rmb();
+	skip_key = READ_ONCE(skip->key);
+	mask = READ_ONCE(skip->mask);
+	skip_level = READ_ONCE(skip->level);
+	smp_rmb();
+	if (READ_ONCE(skip->target) != target)
+		return level;
+
+	*entry = ((key ^ skip_key) & mask) ? NULL : target;
+	return skip_level;
+}
+
+/*
+ * One step of __cch_index_walk_path_geometry(), folded away by
+ * compiler for levels the geometry doesn't have. Lowest level is
+ * at key offset 0, every level above it is mid_bits higher. Steps
+ * above the level skip went to do nothing.
+ */
+#define CCH_INDEX_WALK_STEP(level)					\
+	if ((level) < levels - 1 && (!skips || (level) == cur)) {	\
+		current_entry = cch_index_entry_child(index, current_entry, \
+			(key >> ((level) < levels - 1 ?			\
+				 (levels - 1 - (level)) * mid_bits : 0)) & \
+			((1UL << ((level) ? mid_bits : root_bits)) - 1)); \
+		if (current_entry == NULL)				\
+			return -ENOENT;					\
+		if (skips && (level) + 1 < levels - 1 &&		\
+		    cch_index_entry_is_compact(current_entry)) {	\
+			cur = cch_index_skip_follow(index, key,		\
+				&current_entry, (level) + 1);		\
+			if (current_entry == NULL)			\
+				return -ENOENT;				\
+		} else {						\
+			cur = (level) + 1;				\
+		}							\
+	}
+
+/**
+ * __cch_index_walk_path() for geometry known at compile time, with
+ * @arg levels total levels. Shifts and masks are constants and the
+ * descent is unrolled. @arg skips is set for CCH_INDEX_COMPACT_MID.
+ */
+static __always_inline int __cch_index_walk_path_geometry(
+	struct cch_index *index,
+	uint64_t key,
+	struct cch_index_entry **found_entry,
+	const int levels,
+	const int root_bits,
+	const int mid_bits,
+	const bool skips)
+{
+	struct cch_index_entry *current_entry = &index->head;
+	/* level of current_entry */
+	int cur = 0;
+
+	BUILD_BUG_ON(CCH_INDEX_MAX_LEVELS > 16);
+
+	/* all levels except last one */
+	CCH_INDEX_WALK_STEP(0);
+	CCH_INDEX_WALK_STEP(1);
+	CCH_INDEX_WALK_STEP(2);
+	CCH_INDEX_WALK_STEP(3);
+	CCH_INDEX_WALK_STEP(4);
+	CCH_INDEX_WALK_STEP(5);
+	CCH_INDEX_WALK_STEP(6);
+	CCH_INDEX_WALK_STEP(7);
+	CCH_INDEX_WALK_STEP(8);
+	CCH_INDEX_WALK_STEP(9);
+	CCH_INDEX_WALK_STEP(10);
+	CCH_INDEX_WALK_STEP(11);
+	CCH_INDEX_WALK_STEP(12);
+	CCH_INDEX_WALK_STEP(13);
+	CCH_INDEX_WALK_STEP(14);
+
+	if (cch_index_entry_is_unloaded(current_entry))
+		return -EREMOTE;
+
+	*found_entry = current_entry;
+	return 0;
+}
+
+#define CCH_INDEX_WALK_GEOMETRY(n, g_levels, g_bits, g_root_bits,	\
+				g_low_bits)				\
+	case (n):							\
+		if (index->flags & CCH_INDEX_COMPACT_MID)		\
+			result = __cch_index_walk_path_geometry(index,	\
+				key, found_entry, (g_levels) + 2,	\
+				(g_root_bits),				\
+				CCH_INDEX_MID_BITS(g_levels, g_bits,	\
+					g_root_bits, g_low_bits), true); \
+		else							\
+			result = __cch_index_walk_path_geometry(index,	\
+				key, found_entry, (g_levels) + 2,	\
+				(g_root_bits),				\
+				CCH_INDEX_MID_BITS(g_levels, g_bits,	\
+					g_root_bits, g_low_bits), false); \
+		goto out;
+
+/**
+ * Try to walk index using @arg key, returning lowest level entry,
+ * if it's found, -ENOENT if not and -EREMOTE if it's unloaded, see
+ * __cch_index_fault_in(). Geometries of CCH_INDEX_GEOMETRIES
+ * have their own walks, others loop over levels_desc. Chains of
+ * single child compact entries are skipped, see struct cch_index_skip.
+ *
+ * Should be called under subtree lock of @arg key or rcu_read_lock().
+ *
+ * @arg key
+ * @arg found_entry
+ */
+int __cch_index_walk_path(
+	struct cch_index *index,
+	uint64_t key,
+	struct cch_index_entry **found_entry)
+{
+	int record_offset = 0;
+	struct cch_index_entry *current_entry;
+	int result = 0;
+	int i = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(found_entry == NULL);
+
+	switch (index->geometry) {
+	CCH_INDEX_GEOMETRIES(CCH_INDEX_WALK_GEOMETRY)
+	default:
+		break;
+	}
+
+	current_entry = &index->head;
+	/* all levels except last one */
+	for (i = 0; i < index->levels - 1; i++) {
+		sBUG_ON(current_entry == NULL);
+
+		record_offset = EXTRACT_BIASED_VALUE(key,
+			index->levels_desc, i);
+		PRINT_INFO("offset is 0x%x", record_offset);
+
+		current_entry = cch_index_entry_child(index, current_entry,
+			record_offset);
+		if (current_entry == NULL) {
+			result = -ENOENT;
+			goto out;
+		}
+
+		if ((index->flags & CCH_INDEX_COMPACT_MID) &&
+		    i + 1 < index->levels - 1 &&
+		    cch_index_entry_is_compact(current_entry)) {
+			/* loop goes on from level skip went to */
+			i = cch_index_skip_follow(index, key, &current_entry,
+				i + 1) - 1;
+			if (current_entry == NULL) {
+				result = -ENOENT;
+				goto out;
+			}
+		}
+	}
+
+	if (cch_index_entry_is_unloaded(current_entry)) {
+		result = -EREMOTE;
+		goto out;
+	}
+
+	*found_entry = current_entry;
+
+	sBUG_ON(*found_entry == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(*found_entry));
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+
+
+/**
+ * Put value to given lowest level entry at given offset,
+ * replacing old value if required. Updates reference counter,
+ * doesn't touch LRU nor makes entry dirty, callers do.
+ *
+ * Value is published with cmpxchg(), so this may be called either
+ * under subtree lock or just under rcu_read_lock() for entry that
+ * is already linked to the index.
+ *
+ * @arg entry index entry to insert to
+ * @arg offset insert to entry->v[offset]
+ * @arg value value to insert
+ *
+ * @return -EAGAIN if entry is being freed or lockless insert left it
+ * empty, see below
+ */
+static int __cch_index_entry_publish_value(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset,
+	bool replace,
+	void *value)
+{
+	int result = 0;
+	void *old_value, *prev_value;
+	void **slot;
+	unsigned long *bitmap;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+	sBUG_ON(offset >= cch_index_entry_size(index, entry));
+	sBUG_ON(offset < 0);
+
+#ifdef CCH_INDEX_DEBUG
+	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
+#endif
+
+	/* reference is dropped below if there was a value already */
+	if (!cch_index_entry_get_ref(entry)) {
+		result = -EAGAIN;
+		goto out;
+	}
+
+	if ((index->flags & CCH_INDEX_EXTENT_LEAVES) &&
+	    cch_index_leaf_is_extent(entry->v[0].leaf)) {
+		result = __cch_index_leaf_extent_append(index, entry, offset,
+							replace, value);
+		if (result != -EAGAIN) {
+			if (result)
+				atomic_dec(&entry->ref_cnt);
+			goto out;
+		}
+		/* runs are broken, go on with plain records */
+		result = __cch_index_leaf_rebuild(index, entry, 0, NULL);
+		if (result) {
+			atomic_dec(&entry->ref_cnt);
+			goto out;
+		}
+	}
+
+	slot = cch_index_entry_value_slot(index, entry, offset);
+	if (slot == NULL) {
+		/* compact table has no record for offset, lockless
+		 * inserters are off with compact leaves */
+		result = __cch_index_leaf_rebuild(index, entry, offset, value);
+		if (result)
+			atomic_dec(&entry->ref_cnt);
+		goto out;
+	}
+
+	old_value = *slot;
+
+	TRACE(TRACE_DEBUG,
+	      "inserting direct to %p at offset %d value %p, "
+	      "current value %p",
+	      entry, offset, value, old_value);
+
+	for (;;) {
+		if (old_value != NULL && !replace) {
+			result = -EEXIST;
+			break;
+		}
+		/* full barrier, value contents are visible to readers */
+		prev_value = cmpxchg(slot, old_value, value);
+		if (prev_value == old_value)
+			break;
+		old_value = prev_value;
+	}
+
+	/*
+	 * no new value thus no ref_cnt. If a remover took the value seen
+	 * meanwhile this drops the last reference and nobody frees the
+	 * empty entry. Insert is done again under subtree lock then, which
+	 * removers hold, so the entry is in use again.
+	 */
+	if (old_value != NULL) {
+		if (atomic_dec_and_test(&entry->ref_cnt))
+			result = -EAGAIN;
+		if (result)
+			goto out;
+	} else {
+		bitmap = cch_index_entry_value_bitmap(index, entry);
+		if (bitmap != NULL)
+			set_bit(offset, bitmap);
+	}
+
+	TRACE(TRACE_DEBUG, "result of insert is %p", *slot);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * __cch_index_entry_publish_value() under subtree lock. Entry picked
+ * by cch_index_shrink() is kept then, it's unloaded under the lock.
+ */
+static int __cch_index_entry_publish_locked(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset,
+	bool replace,
+	void *value)
+{
+	int result;
+
+	for (;;) {
+		result = __cch_index_entry_publish_value(index, entry, offset,
+			replace, value);
+		/* mark is set by picker without the lock, cleared with it */
+		if (result != -EAGAIN || !(atomic_read(&entry->ref_cnt) &
+					   CCH_INDEX_ENTRY_UNLOADING))
+			break;
+		atomic_sub(CCH_INDEX_ENTRY_UNLOADING, &entry->ref_cnt);
+	}
+
+	return result;
+}
+
+/**
+ * Insert value to given lowest level entry at given offset,
+ * see __cch_index_entry_publish_value(), make it dirty and touch
+ * entry in LRU.
+ */
+int __cch_index_entry_insert_direct(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset,
+	bool replace,
+	void *value)
+{
+	int result;
+
+	result = __cch_index_entry_publish_value(index, entry, offset,
+		replace, value);
+	if (!result) {
+		/* after the value is visible, see __cch_index_save_put() */
+		cch_index_entry_mark_dirty(entry);
+		cch_index_entry_lru_update(index, entry);
+	}
+
+	return result;
+}
+
+/* same under subtree lock, see __cch_index_entry_publish_locked() */
+static int __cch_index_entry_insert_locked(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset,
+	bool replace,
+	void *value)
+{
+	int result;
+
+	result = __cch_index_entry_publish_locked(index, entry, offset,
+		replace, value);
+	if (!result) {
+		cch_index_entry_mark_dirty(entry);
+		cch_index_entry_lru_update(index, entry);
+	}
+
+	return result;
+}
+
+/*
+ * Cluster read for unloaded entries. It stays in index->faults while
+ * someone holds it, so faulters of entries in the same cluster share
+ * one read. Full save may rewrite any cluster, so reads of
+ * different save generations are never shared.
+ */
+struct cch_index_fault {
+	struct list_head list;
+	/* device offset of cluster */
+	uint64_t offset;
+	unsigned long generation;
+	/* under index->fault_lock */
+	int refs;
+	/* read and checked once this is done */
+	struct completion done;
+	int result;
+	struct cch_backend_cluster *cluster;
+};
+
+static void cch_index_fault_put(struct cch_index *index,
+	struct cch_index_fault *fault)
+{
+	spin_lock(&index->fault_lock);
+	if (--fault->refs > 0) {
+		spin_unlock(&index->fault_lock);
+		return;
+	}
+	list_del(&fault->list);
+	spin_unlock(&index->fault_lock);
+
+	if (fault->cluster != NULL)
+		kmem_cache_free(index->backend_cluster_kmem, fault->cluster);
+	kfree(fault);
+}
+
+/**
+ * Get cluster at device @arg offset read with read_cluster_data_fn
+ * and checked by cch_index_backend_cluster_parse_start(). If it's
+ * being read already, wait for that read instead of issuing own one.
+ * Put it with cch_index_fault_put() on success.
+ *
+ * May sleep, doesn't need subtree lock.
+ */
+static int cch_index_fault_get(struct cch_index *index, uint64_t offset,
+	unsigned long generation, struct cch_index_fault **fault)
+{
+	struct cch_index_fault *new_fault, *f;
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	new_fault = kzalloc(sizeof(*new_fault), GFP_KERNEL);
+	if (new_fault == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	spin_lock(&index->fault_lock);
+	list_for_each_entry(f, &index->faults, list) {
+		if (f->offset == offset && f->generation == generation) {
+			f->refs++;
+			spin_unlock(&index->fault_lock);
+			kfree(new_fault);
+
+			wait_for_completion(&f->done);
+			goto out_done;
+		}
+	}
+	f = new_fault;
+	f->offset = offset;
+	f->generation = generation;
+	f->refs = 1;
+	init_completion(&f->done);
+	list_add(&f->list, &index->faults);
+	spin_unlock(&index->fault_lock);
+
+	f->result = cch_index_backend_cluster_alloc(index,
+		CCH_INDEX_BACKEND_CLUSTER_LOW, &f->cluster);
+	if (!f->result) {
+		f->result = index->read_cluster_data_fn(index, offset,
+			(uint8_t *) f->cluster, index->backend_cluster_size);
+		if (f->result < 0)
+			PRINT_ERROR("read of cluster at %llu failed, "
+				    "result %d", (unsigned long long) offset,
+				    f->result);
+		else
+			f->result = cch_index_backend_cluster_parse_start(
+				index, f->cluster);
+	}
+	complete_all(&f->done);
+
+out_done:
+	result = f->result;
+	if (result) {
+		cch_index_fault_put(index, f);
+		goto out;
+	}
+	*fault = f;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Lowest level record at device offset @arg offs inside of cluster
+ * got by cch_index_fault_get(), it must hold @arg key.
+ */
+static int cch_index_fault_record(struct cch_index *index,
+	struct cch_index_fault *fault, uint64_t offs, uint64_t key,
+	struct cch_backend_index_entry **backend_entry)
+{
+	struct cch_backend_cluster *cluster = fault->cluster;
+	int pos, next, entry_bytes;
+	int result = 0;
+
+	pos = offs - fault->offset - offsetof(struct cch_backend_cluster, data);
+	if (cluster->signature != CCH_INDEX_BACKEND_CLUSTER_LOW || pos < 0) {
+		result = -EIO;
+		goto out;
+	}
+	entry_bytes = cch_backend_index_entry_bytes(
+		cch_backend_cluster_entry_size(index, cluster));
+	if (pos % entry_bytes != 0) {
+		result = -EIO;
+		goto out;
+	}
+
+	next = pos / entry_bytes;
+	result = cch_index_backend_cluster_parse_get(index, cluster,
+		backend_entry, &next);
+	if (result == -ENOENT)
+		result = -EIO;
+	if (result)
+		goto out;
+
+	if (((*backend_entry)->start_offs_key ^ key) &
+	    ~cch_index_level_span_mask(index, index->lowest_level))
+		result = -EIO;
+
+out:
+	if (result)
+		PRINT_ERROR("no lowest level entry of key 0x%llx at %llu",
+			    (unsigned long long) key,
+			    (unsigned long long) offs);
+	return result;
+}
+
+/**
+ * Read lowest level entry unloaded by cch_index_shrink() from
+ * device offset in parent->v[offset] and put it back there. Backend
+ * entry must hold @arg key. Loaded entry is saved and most recently
+ * used, parent stays as it is.
+ *
+ * Called under subtree lock.
+ */
+static int __cch_index_entry_load(struct cch_index *index,
+	struct cch_index_entry *parent, int offset, uint64_t key,
+	struct cch_index_entry **loaded)
+{
+	struct cch_index_entry **slot, *entry;
+	struct cch_index_fault *fault;
+	struct cch_backend_index_entry *backend_entry;
+	uint64_t offs, cluster_offset;
+	int result = 0;
+	int i;
+
+	TRACE_ENTRY();
+
+	slot = cch_index_entry_child_slot(index, parent, offset);
+	sBUG_ON(slot == NULL || !cch_index_entry_is_unloaded(*slot));
+
+	offs = cch_index_entry_unloaded_offs(*slot);
+	cluster_offset = offs & ~((uint64_t) index->backend_cluster_size - 1);
+
+	/* usually read by __cch_index_fault_in() already */
+	result = cch_index_fault_get(index, cluster_offset,
+		index->save_generation, &fault);
+	if (result)
+		goto out;
+
+	result = cch_index_fault_record(index, fault, offs, key,
+		&backend_entry);
+	if (result)
+		goto out_put_fault;
+
+	result = cch_index_lowest_entry_alloc(index, parent, offset, &entry);
+	if (result)
+		goto out_put_fault;
+
+	for (i = 0; i < backend_entry->len; i++) {
+		if (backend_entry->v[i].value == NULL)
+			continue;
+		result = __cch_index_entry_publish_value(index, entry, i,
+			false, backend_entry->v[i].value);
+		if (result) {
+			cch_index_destroy_lowest_level_entry(index, entry);
+			goto out_put_fault;
+		}
+	}
+
+	/* same as on backend, so not dirty */
+	entry->backend_offs = offs;
+	cch_index_entry_set_saved(entry);
+	cch_index_entry_lru_add(index, entry);
+
+	/* records are in place, now lookups may see it */
+	rcu_assign_pointer(*slot, entry);
+	atomic_dec(&index->nr_unloaded);
+
+	*loaded = entry;
+
+out_put_fault:
+	cch_index_fault_put(index, fault);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * Load unloaded lowest level entry of @arg key, if it is.
+ * Called under subtree lock of @arg key.
+ *
+ * @return -ENOENT if there is no entry for the key
+ */
+static int __cch_index_load_path(struct cch_index *index, uint64_t key)
+{
+	struct cch_index_entry *entry = &index->head, *child;
+	int level, offset;
+	int result = 0;
+
+	for (level = 0; level < index->levels - 1; level++) {
+		offset = EXTRACT_BIASED_VALUE(key, index->levels_desc, level);
+		child = cch_index_entry_child(index, entry, offset);
+		if (child == NULL) {
+			result = -ENOENT;
+			break;
+		}
+		if (cch_index_entry_is_unloaded(child)) {
+			result = __cch_index_entry_load(index, entry, offset,
+				key, &child);
+			if (!result && (index->flags & CCH_INDEX_COMPACT_MID))
+				cch_index_skip_update(index, child,
+					index->levels - 1);
+			break;
+		}
+		entry = child;
+	}
+
+	return result;
+}
+
+/*
+ * Cluster is read before subtree lock is taken, so writers of the
+ * subtree aren't blocked by I/O. Entry is built under the lock from
+ * the same cluster unless a full save came in between.
+ */
+int __cch_index_fault_in(struct cch_index *index, uint64_t key)
+{
+	struct cch_index_entry *entry;
+	struct cch_index_fault *fault = NULL;
+	struct mutex *subtree_mutex;
+	unsigned long generation;
+	uint64_t offs = 0;
+	int result = 0;
+	int level = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+
+	/* unloaded entry seen below is saved by this generation */
+	generation = READ_ONCE(index->save_generation);
+	smp_rmb();
+
+	rcu_read_lock();
+	entry = &index->head;
+	for (level = 0; entry != NULL && level < index->levels - 1; level++)
+		entry = cch_index_entry_child(index, entry,
+			EXTRACT_BIASED_VALUE(key, index->levels_desc, level));
+	if (entry != NULL && cch_index_entry_is_unloaded(entry))
+		offs = cch_index_entry_unloaded_offs(entry);
+	rcu_read_unlock();
+
+	/* errors are found again under the lock, if it's still there */
+	if (offs != 0 && cch_index_fault_get(index,
+			offs & ~((uint64_t) index->backend_cluster_size - 1),
+			generation, &fault))
+		fault = NULL;
+
+	subtree_mutex = cch_index_subtree_mutex(index,
+		EXTRACT_BIASED_VALUE(key, index->levels_desc, 0));
+	mutex_lock(subtree_mutex);
+	result = __cch_index_load_path(index, key);
+	mutex_unlock(subtree_mutex);
+
+	if (fault != NULL)
+		cch_index_fault_put(index, fault);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(__cch_index_fault_in);
+
+/**
+ * Update skips on the path through mid level @arg entry at @arg level
+ * once it's left with single child, see cch_index_skip_update().
+ *
+ * Called under subtree lock.
+ */
+static void cch_index_skip_collapse(struct cch_index *index,
+	struct cch_index_entry *entry, int level)
+{
+	struct cch_index_entry *child;
+	int i;
+
+	/* unloaded child ends the chain too */
+	while (level < index->levels - 1 &&
+	       cch_index_entry_is_compact(entry) &&
+	       atomic_read(&entry->ref_cnt) == 1) {
+		child = NULL;
+		/* offsets of removed children stay with no child */
+		for (i = 0; i < entry->nr && child == NULL; i++)
+			child = entry->v[i].entry;
+		if (child == NULL || cch_index_entry_is_unloaded(child))
+			break;
+		entry = child;
+		level++;
+	}
+
+	cch_index_skip_update(index, entry, level);
+}
+
+/**
+ * Checks if entry should be removed by ref_cnt value,
+ * check all parents for same problem
+ *
+ * @arg index
+ * @arg entry lowest level entry
+ */
+void __cch_index_entry_cleanup(
+	struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	struct cch_index_entry *parent, *current_entry;
+	int parent_entry_size;
+	int level = index->levels - 1;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+
+	current_entry = entry;
+
+	/* kept empty till cch_index_unpin() */
+	if (entry->pinned)
+		goto done;
+
+	while (!cch_index_entry_is_root(current_entry)) {
+		/* lockless inserters can't take reference once it's dead */
+		if (atomic_cmpxchg(&current_entry->ref_cnt, 0,
+				CCH_INDEX_ENTRY_DEAD) != 0)
+			goto done;
+		parent = cch_index_entry_get_parent(current_entry);
+		parent_entry_size = cch_index_entry_size(index, current_entry);
+
+		TRACE(TRACE_DEBUG, "destroy entry %p "
+		      "with parent %p, offset = %d",
+		      current_entry, parent, current_entry->parent_offset);
+
+		cch_index_entry_unlink(index, parent,
+			current_entry->parent_offset);
+		cch_index_destroy_entry(index, current_entry);
+
+		current_entry = parent;
+		level--;
+	}
+
+done:
+	/* entry left may have single child now */
+	if ((index->flags & CCH_INDEX_COMPACT_MID) &&
+	    current_entry != entry && !cch_index_entry_is_root(current_entry))
+		cch_index_skip_collapse(index, current_entry, level);
+
+	TRACE_EXIT();
+	return;
+}
+
+/**
+ * Search first index entry that holds both @arg entry and lowest
+ * level entry which is @arg delta entries after (before, if negative)
+ * it in key order.
+ *
+ * Get parent of current entry, find current entry in parent,
+ * see if (i + delta) is inside of it. If not, carry the overflow one
+ * level up, if yes -- that's the result. Repeat till root entry.
+ * So nearby entries don't need walking from root.
+ *
+ * Needed to extract this code as it is reusable for *_direct functions.
+ *
+ * @arg index
+ * @arg entry -- starting entry, always of lowest level
+ * @arg delta -- distance to target entry in lowest level entries
+ * @arg digits -- offsets of path from "subtree_root" down to target,
+ *      digits[level] is offset in v[] table of entry at that level
+ * @arg subtree_root -- the result (any from parent of "entry" to root entry)
+ * @arg entry_level -- level of subtree_root, 0 -- root,
+ *      index->levels -1 -- lowest
+ *
+ * @return -ENOENT if target is out of index key space, -EAGAIN if
+ *         subtree_root found under rcu_read_lock() doesn't hold the
+ *         path anymore, climb should be repeated then
+ */
+int __cch_index_climb_to_first_capable_parent(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int delta,
+	int *digits,
+	struct cch_index_entry **subtree_root,
+	int *entry_level)
+{
+	struct cch_index_entry *this_entry, *parent_entry, **slot;
+	int parent_entry_level;
+	int parent_entry_size;
+	int pos, digit;
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+	sBUG_ON(entry_level == NULL);
+	sBUG_ON(subtree_root == NULL);
+	sBUG_ON(digits == NULL);
+	sBUG_ON(delta == 0);
+
+#ifdef CCH_INDEX_DEBUG
+	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
+#endif
+
+	this_entry = entry;
+	parent_entry = cch_index_entry_get_parent(this_entry);
+	/* this_entry is at lowest level */
+	parent_entry_level = index->levels - 2;
+
+	for (;;) {
+		parent_entry_size = cch_index_entry_size(index, parent_entry);
+		pos = this_entry->parent_offset + delta;
+
+		/* floor division, digit is never negative */
+		delta = pos / parent_entry_size;
+		digit = pos % parent_entry_size;
+		if (digit < 0) {
+			digit += parent_entry_size;
+			delta--;
+		}
+		digits[parent_entry_level] = digit;
+
+		TRACE(TRACE_DEBUG, "climb i is %d, size is %d, carry %d",
+		      this_entry->parent_offset, parent_entry_size, delta);
+		if (delta == 0)
+			break; /* we can use that */
+
+		if (cch_index_entry_is_root(parent_entry)) {
+			result = -ENOENT;
+			goto out;
+		}
+
+		this_entry = parent_entry;
+		parent_entry = cch_index_entry_get_parent(this_entry);
+		parent_entry_level--;
+	}
+
+	sBUG_ON(cch_index_entry_is_root(parent_entry) &&
+		(parent_entry_level != 0));
+
+	/* compact mid level entry climbed through without the lock may
+	 * be replaced by its grown copy, which isn't in its old parent */
+	slot = cch_index_entry_child_slot(index, parent_entry,
+		this_entry->parent_offset);
+	if (unlikely(slot == NULL ||
+		     rcu_dereference(*slot) != this_entry)) {
+		result = -EAGAIN;
+		goto out;
+	}
+
+	*subtree_root = parent_entry;
+	*entry_level = parent_entry_level;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * Go down from @arg entry at @arg level by digits[] found by
+ * __cch_index_climb_to_first_capable_parent() to lowest level,
+ * creating missing entries if @arg create is set. Unloaded target
+ * is loaded when creating.
+ *
+ * Should be called under subtree lock of target when creating,
+ * under rcu_read_lock() or subtree lock otherwise.
+ *
+ * @return -ENOENT if there is no target and we don't create it,
+ * -EREMOTE if it's unloaded
+ */
+static int __cch_index_descend(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int level,
+	const int *digits,
+	bool create,
+	struct cch_index_entry **target)
+{
+	struct cch_index_entry *child;
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	while (level < index->levels - 1) {
+		child = cch_index_entry_child(index, entry, digits[level]);
+		level++;
+
+		TRACE(TRACE_DEBUG, "this level is %d", level);
+		if (child == NULL) {
+			if (!create) {
+				result = -ENOENT;
+				goto out;
+			}
+			result = cch_index_entry_create(index, entry, &child,
+				level, digits[level - 1]);
+			if (result) {
+				PRINT_ERROR("couldn't create new entry while "
+					"doing sibling search\n");
+				goto out;
+			}
+
+			sBUG_ON(child == NULL);
+		} else if (cch_index_entry_is_unloaded(child)) {
+			if (!create) {
+				result = -EREMOTE;
+				goto out;
+			}
+			result = __cch_index_entry_load(index, entry,
+				digits[level - 1],
+				cch_index_entry_first_key(index, entry,
+							  level - 1) |
+				((uint64_t) digits[level - 1] <<
+				 index->levels_desc[level - 1].offset),
+				&child);
+			if (result)
+				goto out;
+		}
+
+		entry = child;
+	}
+
+	*target = entry;
+
+	/* result should be same level as input -- lowest one */
+	sBUG_ON(!cch_index_entry_is_lowest_level(*target));
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/**
+ * Find lowest level entry @arg delta entries after (before, if negative)
+ * given one in key order, if there is one. Doesn't create any new
+ * index entries, so it is suitable for search, -EREMOTE if it is
+ * unloaded. Should be called under subtree lock or rcu_read_lock(),
+ * -EAGAIN under the latter means the path changed and it's to be
+ * repeated.
+ */
+static int __cch_index_entry_find_sibling(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	struct cch_index_entry **sibling,
+	int delta)
+{
+	int result = 0;
+	struct cch_index_entry *subtree_root;
+	int digits[CCH_INDEX_MAX_LEVELS];
+	int level = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	sBUG_ON(sibling == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+
+	result = __cch_index_climb_to_first_capable_parent(
+		index, entry, delta, digits, &subtree_root, &level);
+	if (result)
+		goto out;
+
+	TRACE(TRACE_DEBUG, "we can traverse down from %p, level %d",
+	      subtree_root, level);
+
+	result = __cch_index_descend(index, subtree_root, level, digits,
+		false, sibling);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+int __cch_index_entry_find_next_sibling(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	struct cch_index_entry **sibling)
+{
+	return __cch_index_entry_find_sibling(index, entry, sibling, 1);
+}
+
+int __cch_index_entry_find_prev_sibling(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	struct cch_index_entry **sibling)
+{
+	return __cch_index_entry_find_sibling(index, entry, sibling, -1);
+}
+
+/**
+ * Turn offset relative to beginning of lowest level entry into
+ * distance in entries and offset inside of target entry.
+ */
+static inline int cch_index_split_offset(int *offset, int size)
+{
+	int delta = *offset / size;
+
+	*offset %= size;
+	if (*offset < 0) {
+		*offset += size;
+		delta--;
+	}
+	return delta;
+}
+
+int cch_index_remove_direct(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset)
+{
+	int result = 0;
+	int root_offset = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+
+	root_offset = cch_index_entry_root_offset(entry);
+	mutex_lock(cch_index_subtree_mutex(index, root_offset));
+
+	/*
+	 * doesn't seem like we should leap to next entry
+	 * on offset overflow. Or should we?
+	 */
+	result = __cch_index_entry_remove_value(index, entry, offset);
+
+	mutex_unlock(cch_index_subtree_mutex(index, root_offset));
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_remove_direct);
+
+int cch_index_insert_direct(
+	struct cch_index *index,
+	struct cch_index_entry *entry,
+	int offset,
+	bool replace,
+	void *value,
+	struct cch_index_entry **new_index_entry,
+	int *new_value_offset)
+{
+	int result = 0;
+	int lowest_entry_size = 0;
+	struct cch_index_entry *right_entry = NULL, *subtree_root;
+	int digits[CCH_INDEX_MAX_LEVELS];
+	int root_offset = 0, sibling_root_offset = 0;
+	int delta = 0, level = 0;
+	uint64_t key = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	/* we can insert entry only to lowest entry */
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+
+#ifdef CCH_INDEX_DEBUG
+	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
+#endif
+
+	right_entry = entry;
+	lowest_entry_size = cch_index_entry_size(index, entry);
+
+	/* fast path: no new entries, value is published with cmpxchg() */
+	if (likely(offset >= 0 && offset < lowest_entry_size)) {
+		if (unlikely(index->flags & CCH_INDEX_COMPACT_LEAVES)) {
+			/* compact leaves tables are changed under the lock */
+			root_offset = cch_index_entry_root_offset(entry);
+			mutex_lock(cch_index_subtree_mutex(index, root_offset));
+			result = __cch_index_entry_insert_locked(index, entry,
+				offset, replace, value);
+			if (result == -EAGAIN)
+				key = cch_index_entry_first_key(index, entry,
+					index->levels - 1) + offset;
+			mutex_unlock(cch_index_subtree_mutex(index,
+				root_offset));
+		} else {
+			rcu_read_lock();
+			result = __cch_index_entry_insert_direct(index, entry,
+				offset, replace, value);
+			if (result == -EAGAIN)
+				key = cch_index_entry_first_key(index, entry,
+					index->levels - 1) + offset;
+			rcu_read_unlock();
+		}
+		/* entry is being freed or unloaded, record goes to the
+		 * one found or loaded by key under subtree lock */
+		if (result == -EAGAIN) {
+			result = cch_index_insert(index, key, value, replace,
+				new_index_entry, new_value_offset);
+			goto out;
+		}
+		if (result)
+			goto out;
+
+		if (new_value_offset)
+			*new_value_offset = offset;
+		if (new_index_entry)
+			*new_index_entry = entry;
+		goto out;
+	}
+
+	TRACE(TRACE_DEBUG, "insert_direct: offset: %d, size: %d\n",
 	      offset, lowest_entry_size);
 
-	/* offset overleaps to next index entry */
-	if (unlikely(offset >= lowest_entry_size)) {
-		/* forward traversing */
-		/* need to find next sibling */
-		/* but offset shouldn't leap over one index_entry
-		 * as we are searching for next sibling, not for the
-		 * arbitrary indexed sibling */
-		sBUG_ON(offset >= 2 * lowest_entry_size);
-		result = __cch_index_entry_create_next_sibling(
-			index, entry, &right_entry);
-		if (result)
-			goto out_unlock;
+	/* offset overleaps to other index entry, forward or backward.
+	 * Only the path below common parent with it is walked */
+	delta = cch_index_split_offset(&offset, lowest_entry_size);
+	rcu_read_lock();
+	key = cch_index_entry_first_key(index, entry, index->levels - 1);
+	do {
+		result = __cch_index_climb_to_first_capable_parent(
+			index, entry, delta, digits, &subtree_root, &level);
+	} while (result == -EAGAIN &&
+		 !(atomic_read(&entry->ref_cnt) &
+		   (CCH_INDEX_ENTRY_DEAD | CCH_INDEX_ENTRY_UNLOADING)));
+	rcu_read_unlock();
+	root_offset = EXTRACT_BIASED_VALUE(key, index->levels_desc, 0);
+	key += (int64_t) delta * lowest_entry_size + offset;
+	if (result == -EAGAIN)
+		goto out_by_key;
+	if (result)
+		goto out;
+
+	/* target may be in other root slot subtree */
+	sibling_root_offset = (level == 0) ? digits[0] : root_offset;
+	cch_index_subtree_lock_pair(index, root_offset, sibling_root_offset);
+
+	if (atomic_read(&entry->ref_cnt) &
+	    (CCH_INDEX_ENTRY_DEAD | CCH_INDEX_ENTRY_UNLOADING)) {
+		cch_index_subtree_unlock_pair(index, root_offset,
+			sibling_root_offset);
+		goto out_by_key;
+	}
+
+	/* parents found without the lock may be replaced or freed by
+	 * now, they are stable under it */
+	result = __cch_index_climb_to_first_capable_parent(
+		index, entry, delta, digits, &subtree_root, &level);
+	if (result)
+		goto out_unlock;
+
+	result = __cch_index_descend(index, subtree_root, level, digits,
+		true, &right_entry);
+	if (result)
+		goto out_unlock;
+
+	/* we should be sure the search wasn't in vain */
+	sBUG_ON(right_entry == entry);
+
+	/* we can insert right in this entry */
+	result = __cch_index_entry_insert_locked(index, right_entry, offset,
+		replace, value);
+	if (result) {
+		if (result == -EEXIST)
+			PRINT_INFO("attempt to replace entry");
+		goto out_unlock;
+	}
+
+	if (new_value_offset)
+		*new_value_offset = offset;
+	if (new_index_entry)
+		*new_index_entry = right_entry;
+
+out_unlock:
+	cch_index_subtree_unlock_pair(index, root_offset, sibling_root_offset);
+	goto out;
+
+out_by_key:
+	/* entry is being freed or unloaded, record goes to the one
+	 * found or loaded by key under subtree lock */
+	result = cch_index_insert(index, key, value, replace,
+		new_index_entry, new_value_offset);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_insert_direct);
+
+int cch_index_find_direct(
+	struct cch_index *index,
+	struct cch_index_entry *entry, int offset,
+	void **out_value,
+	struct cch_index_entry **next_index_entry,
+	int *value_offset)
+{
+	int result = 0;
+	int lowest_entry_size = 0;
+	int entry_offset = offset;
+	struct cch_index_entry *right_entry = NULL;
+	uint64_t key;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	/* starting point is lowest entry */
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
+	sBUG_ON(out_value == NULL);
+	sBUG_ON(*out_value == NULL);
+#ifdef CCH_INDEX_DEBUG
+	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
+#endif
+
+again:
+	rcu_read_lock();
+
+	/* logic is same as in insert_direct, but we must not create
+	 * any siblings as we do in insert_direct:
+	 *
+	 * 1. check if we can't find given offset in current entry */
+
+	/* 2. if not, climb to common parent with index_entry that holds
+	 *    the offset and go down to it */
+
+	/* 3. with known entry check if it holds value and return it */
+
+	right_entry = entry;
+	lowest_entry_size = cch_index_entry_size(index, entry);
+	TRACE(TRACE_DEBUG, "reading entry %p sized %d with offset %d",
+	      entry, lowest_entry_size, offset);
+
+	/* offset overleaps to other index entry, forward or backward */
+	if (unlikely(offset < 0 || offset >= lowest_entry_size)) {
+		result = __cch_index_entry_find_sibling(index, entry,
+			&right_entry,
+			cch_index_split_offset(&offset, lowest_entry_size));
+		if (result == -EAGAIN) {
+			/* path was changing under us */
+			rcu_read_unlock();
+			offset = entry_offset;
+			goto again;
+		}
+		if (result == -EREMOTE) {
+			/* keys of lowest level entries follow each other */
+			key = cch_index_entry_first_key(index, entry,
+				index->levels - 1) + entry_offset;
+			rcu_read_unlock();
+
+			result = __cch_index_fault_in(index, key);
+			if (result)
+				goto out;
+			offset = entry_offset;
+			goto again;
+		}
+		if (result)
+			goto out_unlock;
+
+		/* we should be sure the search wasn't in vain */
+		sBUG_ON(right_entry == entry);
+	}
+
+	/* now, find */
+
+	*out_value = cch_index_entry_value(index, right_entry, offset);
+
+	if (*out_value) {
+		cch_index_value_lock(*out_value);
+
+		if (value_offset)
+			*value_offset = offset;
+		if (next_index_entry)
+			*next_index_entry = right_entry;
+	} else
+		result = -ENOENT;
+
+	cch_index_entry_lru_update(index, right_entry);
+
+out_unlock:
+	rcu_read_unlock();
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_find_direct);
+
+
+int cch_index_destroy(struct cch_index *index)
+{
+	int result = 0;
+	int i = 0, size = 0;
+	struct cch_index_entry *entry;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+
+	mutex_lock(&index->cch_index_value_mutex);
+
+	list_for_each_entry(entry, &index->index_lru_list,
+			    index_lru_list_entry) {
+		if (!cch_index_entry_is_lowest_level(entry))
+			continue;
+		/* check if any value is locked */
+		size = cch_index_entry_size(index, entry);
+		for (i = cch_index_entry_next_offset(index, entry, 0);
+		     i < size;
+		     i = cch_index_entry_next_offset(index, entry, i + 1)) {
+			if (cch_index_check_lock(cch_index_entry_value(
+					index, entry, i))) {
+				/* can't free index */
+				result = -EBUSY;
+				goto out_spin_unlock;
+			}
+		}
+	}
+
+	/* FIXME check usage */
+	/* FIXME locking */
+	cch_index_destroy_root_entry(index);
+	/* wait for entries still queued by call_rcu() */
+	rcu_barrier();
+	kmem_cache_destroy(index->lowest_level_kmem);
+	kmem_cache_destroy(index->mid_level_kmem);
+	if (index->flags & CCH_INDEX_COMPACT_MID)
+		kmem_cache_destroy(index->compact_mid_kmem);
+	if (index->flags & CCH_INDEX_COMPACT_LEAVES) {
+		kmem_cache_destroy(index->compact_leaf_kmem);
+		kmem_cache_destroy(index->dense_leaf_kmem);
+	}
+	if (index->backend_cluster_kmem)
+		kmem_cache_destroy(index->backend_cluster_kmem);
+	percpu_counter_destroy(&index->total_bytes);
+	free_percpu(index->lru_pvecs);
+	kfree(index->levels_desc);
+	kfree(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+
+out_spin_unlock:
+	mutex_unlock(&index->cch_index_value_mutex);
+	goto out;
+}
+EXPORT_SYMBOL(cch_index_destroy);
+
+/**
+ * Same as __cch_index_walk_path(), but start from the deepest
+ * entry that @arg finger path shares with @arg key, unless some
+ * entry was freed since the finger was taken. Finger is updated
+ * with the new path.
+ *
+ * Called under rcu_read_lock().
+ */
+static int __cch_index_walk_path_finger(
+	struct cch_index *index,
+	struct cch_index_finger *finger,
+	uint64_t key,
+	struct cch_index_entry **found_entry)
+{
+	struct cch_index_entry *current_entry;
+	unsigned long generation;
+	int result = 0;
+	int level = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(finger->index != index);
+
+	/* read before the walk, frees after it make finger stale */
+	generation = atomic_long_read(&index->free_generation);
+
+	if (finger->depth > 0 && finger->generation == generation) {
+		/* path[level] is shared while all slots above it match */
+		while (level < finger->depth - 1 &&
+		       EXTRACT_BIASED_VALUE(key, index->levels_desc, level) ==
+		       EXTRACT_BIASED_VALUE(finger->key,
+			       index->levels_desc, level))
+			level++;
+	}
+	current_entry = finger->path[level];
+
+	finger->key = key;
+	finger->generation = generation;
+
+	/* all levels except last one */
+	for (; level < index->levels - 1; level++) {
+		finger->path[level] = current_entry;
+		current_entry = cch_index_entry_child(index, current_entry,
+			EXTRACT_BIASED_VALUE(key, index->levels_desc, level));
+		if (current_entry == NULL) {
+			finger->depth = level + 1;
+			result = -ENOENT;
+			goto out;
+		}
+	}
+
+	if (cch_index_entry_is_unloaded(current_entry)) {
+		finger->depth = level;
+		result = -EREMOTE;
+		goto out;
+	}
+
+	finger->path[level] = current_entry;
+	finger->depth = index->levels;
+	*found_entry = current_entry;
+
+	sBUG_ON(!cch_index_entry_is_lowest_level(*found_entry));
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+void cch_index_finger_init(struct cch_index *index,
+			   struct cch_index_finger *finger)
+{
+	sBUG_ON(index == NULL);
+	sBUG_ON(finger == NULL);
+
+	finger->index = index;
+	finger->depth = 1;
+	finger->path[0] = &index->head;
+	finger->key = 0;
+	finger->generation = atomic_long_read(&index->free_generation);
+}
+EXPORT_SYMBOL(cch_index_finger_init);
+
+static int __cch_index_find(struct cch_index *index,
+	struct cch_index_finger *finger, uint64_t key,
+	void **out_value, struct cch_index_entry **index_entry,
+	int *value_offset)
+{
+	struct cch_index_entry *current_entry;
+	int result = 0;
+	int lowest_offset = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	/* we need to dump the result somewhere */
+	sBUG_ON(out_value == NULL);
+
+again:
+	rcu_read_lock();
+
+	if (finger)
+		result = __cch_index_walk_path_finger(index, finger, key,
+			&current_entry);
+	else
+		result = __cch_index_walk_path(index, key, &current_entry);
+	if (result == -EREMOTE) {
+		/* unloaded, it's loaded under subtree lock */
+		rcu_read_unlock();
+		result = __cch_index_fault_in(index, key);
+		if (!result)
+			goto again;
+		rcu_read_lock();
+	}
+	if (result) {
+		*out_value = 0;
+		if (index_entry)
+			*index_entry = NULL;
+		if (value_offset)
+			*value_offset = 0;
+		goto out_unlock;
+	}
+
+	sBUG_ON(current_entry == NULL);
+
+	lowest_offset = EXTRACT_LOWEST_OFFSET(index, key);
+	PRINT_INFO("offset is 0x%x", lowest_offset);
+	*out_value = cch_index_entry_value(index, current_entry,
+					   lowest_offset);
+
+	cch_index_entry_lru_update(index, current_entry);
+
+	if (*out_value != NULL) {
+		result = 0;
+
+		if (index_entry)
+			*index_entry = current_entry;
+		if (value_offset)
+			*value_offset = lowest_offset;
+
+		PRINT_INFO("found 0x%lx", (long int) *out_value);
+
+		cch_index_value_lock(*out_value);
+	} else {
+		result = -ENOENT;
+	}
+
+out_unlock:
+	rcu_read_unlock();
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+int cch_index_find(struct cch_index *index, uint64_t key,
+		   void **out_value, struct cch_index_entry **index_entry,
+		   int *value_offset)
+{
+	return __cch_index_find(index, NULL, key, out_value,
+		index_entry, value_offset);
+}
+EXPORT_SYMBOL(cch_index_find);
+
+int cch_index_find_finger(struct cch_index_finger *finger, uint64_t key,
+			  void **out_value,
+			  struct cch_index_entry **index_entry,
+			  int *value_offset)
+{
+	sBUG_ON(finger == NULL);
+
+	return __cch_index_find(finger->index, finger, key, out_value,
+		index_entry, value_offset);
+}
+EXPORT_SYMBOL(cch_index_find_finger);
+
+/**
+ * Walk up to CCH_INDEX_FIND_BATCH keys from root to lowest level
+ * at once. v[] slots of current level are prefetched for every key
+ * before any of them is dereferenced. Keys of unloaded entries are
+ * set in @arg unloaded and left to caller.
+ *
+ * Called under rcu_read_lock().
+ */
+static int __cch_index_find_batch(struct cch_index *index,
+	const uint64_t *keys, int n, void **values, unsigned long *unloaded)
+{
+	struct cch_index_entry *entries[CCH_INDEX_FIND_BATCH];
+	struct cch_index_entry *last_entry = NULL;
+	bool compact;
+	int found = 0;
+	int i = 0, level = 0, offset = 0;
+
+	sBUG_ON(n > CCH_INDEX_FIND_BATCH);
+
+	for (i = 0; i < n; i++)
+		entries[i] = &index->head;
+
+	/* all levels except last one */
+	for (level = 0; level < index->levels - 1; level++) {
+		for (i = 0; i < n; i++) {
+			if (entries[i] == NULL)
+				continue;
+			offset = EXTRACT_BIASED_VALUE(keys[i],
+				index->levels_desc, level);
+			prefetch(&entries[i]->v[offset]);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (entries[i] == NULL)
+				continue;
+			offset = EXTRACT_BIASED_VALUE(keys[i],
+				index->levels_desc, level);
+			entries[i] = cch_index_entry_child(index, entries[i],
+				offset);
+			if (cch_index_entry_is_unloaded(entries[i])) {
+				__set_bit(i, unloaded);
+				entries[i] = NULL;
+			}
+		}
+	}
+
+	/* compact leaves have just the pointer to records table */
+	compact = index->flags & CCH_INDEX_COMPACT_LEAVES;
+	for (i = 0; i < n; i++) {
+		if (entries[i] != NULL)
+			prefetch(&entries[i]->v[compact ? 0 :
+				EXTRACT_LOWEST_OFFSET(index, keys[i])]);
+	}
+
+	for (i = 0; i < n; i++) {
+		values[i] = NULL;
+		if (entries[i] == NULL)
+			continue;
+
+		values[i] = cch_index_entry_value(index, entries[i],
+			EXTRACT_LOWEST_OFFSET(index, keys[i]));
+		if (values[i] != NULL) {
+			cch_index_value_lock(values[i]);
+			found++;
+		}
+
+		/* neighbour keys usually share lowest level entry */
+		if (entries[i] != last_entry) {
+			cch_index_entry_lru_update(index, entries[i]);
+			last_entry = entries[i];
+		}
+	}
+
+	return found;
+}
+
+int cch_index_find_batch(struct cch_index *index, const uint64_t *keys,
+			 int n, void **values)
+{
+	unsigned long unloaded;
+	int result = 0;
+	int i = 0, j = 0, nr = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(n < 0);
+	sBUG_ON(n > 0 && (keys == NULL || values == NULL));
+	BUILD_BUG_ON(CCH_INDEX_FIND_BATCH > BITS_PER_LONG);
+
+	for (i = 0; i < n; i += CCH_INDEX_FIND_BATCH) {
+		nr = min(n - i, CCH_INDEX_FIND_BATCH);
+		unloaded = 0;
+
+		rcu_read_lock();
+		result += __cch_index_find_batch(index, &keys[i], nr,
+			&values[i], &unloaded);
+		rcu_read_unlock();
+
+		/* these are loaded and found one by one */
+		for_each_set_bit(j, &unloaded, nr) {
+			if (!__cch_index_find(index, NULL, keys[i + j],
+					&values[i + j], NULL, NULL))
+				result++;
+		}
+	}
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_find_batch);
+
+int cch_index_insert(struct cch_index *index,
+		     uint64_t key,  /* key of new record */
+		     void *value,   /* value of new record */
+		     bool replace,  /* should replace record under same key
+				     * If not -- -EEXIST
+				     */
+
+		     /* created record */
+		     struct cch_index_entry **new_index_entry,
+		     /* created offset */
+		     int *new_value_offset)
+{
+#ifdef CCH_INDEX_DEBUG
+	int i = 0;
+#endif
+	int result = 0;
+	struct cch_index_entry *current_entry = NULL;
+	int record_offset = 0;
+	struct mutex *subtree_mutex;
+
+	TRACE_ENTRY();
+	sBUG_ON(index == NULL);
+
+#ifdef CCH_INDEX_DEBUG
+	PRINT_INFO("key is 0x%.8llx", key);
+	for (i = 0; i < index->levels; i++) {
+		PRINT_INFO("part %d is 0x%.2llx", i,
+			   EXTRACT_BIASED_VALUE(key, index->levels_desc, i));
+	}
+#endif
+
+	record_offset = EXTRACT_LOWEST_OFFSET(index, key);
+	PRINT_INFO("computed offset is %d", record_offset);
+
+	/* fast path: lowest level entry exists, no subtree lock needed.
+	 * Compact leaves tables are changed under the lock only */
+	if (likely(!(index->flags & CCH_INDEX_COMPACT_LEAVES))) {
+		rcu_read_lock();
+		result = __cch_index_walk_path(index, key, &current_entry);
+		if (!result)
+			result = __cch_index_entry_insert_direct(index,
+				current_entry, record_offset, replace, value);
+		rcu_read_unlock();
+		if (result != -ENOENT && result != -EAGAIN &&
+		    result != -EREMOTE)
+			goto out;
+	}
+
+	subtree_mutex = cch_index_subtree_mutex(index,
+		EXTRACT_BIASED_VALUE(key, index->levels_desc, 0));
+	mutex_lock(subtree_mutex);
+
+	result = __cch_index_create_path(index, key, &current_entry);
+
+	if (result)
+		goto out_unlock;
+
+	sBUG_ON(current_entry == NULL);
+
+	/* save value to index */
+	result = __cch_index_entry_insert_locked(
+		index, current_entry, record_offset, replace, value);
+
+out_unlock:
+	mutex_unlock(subtree_mutex);
+
+out:
+	if (!result) {
+		if (new_value_offset)
+			*new_value_offset = record_offset;
+		if (new_index_entry)
+			*new_index_entry = current_entry;
+	}
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_insert);
+
+int cch_index_insert_batch(struct cch_index *index,
+			   const uint64_t *keys, void **values, int n,
+			   bool replace, int *inserted)
+{
+	int result = 0;
+	int i = 0, level = 0;
+	struct cch_index_entry *leaf = NULL;
+	struct mutex *subtree_mutex = NULL, *key_mutex;
+	uint64_t upper_mask = 0, leaf_key = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(n < 0);
+	sBUG_ON(n > 0 && (keys == NULL || values == NULL));
+
+	/* keys with same bits above lowest level share lowest level entry */
+	for (level = 0; level < index->levels - 1; level++) {
+		upper_mask |= ((1ULL << index->levels_desc[level].bits) - 1) <<
+			index->levels_desc[level].offset;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (leaf == NULL || ((keys[i] ^ leaf_key) & upper_mask)) {
+			if (leaf != NULL)
+				cch_index_entry_lru_update(index, leaf);
+			leaf = NULL;
+
+			/* sorted keys change root slot rarely */
+			key_mutex = cch_index_subtree_mutex(index,
+				EXTRACT_BIASED_VALUE(keys[i],
+					index->levels_desc, 0));
+			if (key_mutex != subtree_mutex) {
+				if (subtree_mutex != NULL)
+					mutex_unlock(subtree_mutex);
+				subtree_mutex = key_mutex;
+				mutex_lock(subtree_mutex);
+			}
+
+			result = __cch_index_create_path(index, keys[i], &leaf);
+			if (result)
+				goto out_unlock;
+			leaf_key = keys[i];
+		}
+
+		result = __cch_index_entry_publish_locked(index, leaf,
+			EXTRACT_LOWEST_OFFSET(index, keys[i]), replace,
+			values[i]);
+		if (result)
+			goto out_unlock;
+		cch_index_entry_mark_dirty(leaf);
+	}
+
+out_unlock:
+	if (leaf != NULL)
+		cch_index_entry_lru_update(index, leaf);
+	if (subtree_mutex != NULL)
+		mutex_unlock(subtree_mutex);
+
+	if (inserted)
+		*inserted = i;
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_insert_batch);
+
+int cch_index_remove(struct cch_index *index, uint64_t key)
+{
+	struct cch_index_entry *current_entry;
+	int result = 0;
+	int lowest_offset = 0;
+	struct mutex *subtree_mutex;
+
+	TRACE_ENTRY();
+	sBUG_ON(index == NULL);
+
+	subtree_mutex = cch_index_subtree_mutex(index,
+		EXTRACT_BIASED_VALUE(key, index->levels_desc, 0));
+	mutex_lock(subtree_mutex);
+
+	result = __cch_index_walk_path(index, key, &current_entry);
+	if (result == -EREMOTE) {
+		/* key may be there, so entry comes back to remove it */
+		result = __cch_index_load_path(index, key);
+		if (!result)
+			result = __cch_index_walk_path(index, key,
+				&current_entry);
+	}
+	if (result)
+		goto out_unlock;
+
+	lowest_offset = EXTRACT_LOWEST_OFFSET(index, key);
+
+	result = __cch_index_entry_remove_value(index, current_entry,
+		lowest_offset);
+	if (result)
+		goto out_unlock;
+
+	/* we don't want this entry get unloaded while we're touching it */
+	cch_index_entry_lru_update(index, current_entry);
+
+	/* and now we check if some entries should be cleaned up */
+	__cch_index_entry_cleanup(index, current_entry);
+
+out_unlock:
+	mutex_unlock(subtree_mutex);
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_remove);
+
+static int __cch_index_remove_range(struct cch_index *index,
+	struct cch_index_entry *entry, int level,
+	uint64_t first, uint64_t last, bool mark);
+
+/**
+ * Mark all lowest level entries of subtree dead, returns their number
+ */
+static int __cch_index_subtree_set_dead(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	struct cch_index_entry *child;
+	int current_size = 0, i = 0;
+	int marked = 0;
+
+	if (cch_index_entry_is_lowest_level(entry)) {
+		cch_index_entry_set_dead(entry);
+		return 1;
+	}
+
+	current_size = cch_index_entry_size(index, entry);
+	for (i = cch_index_entry_next_child(index, entry, 0);
+	     i < current_size;
+	     i = cch_index_entry_next_child(index, entry, i + 1)) {
+		child = cch_index_entry_child(index, entry, i);
+		if (child != NULL && !cch_index_entry_is_unloaded(child))
+			marked += __cch_index_subtree_set_dead(index, child);
+	}
+
+	return marked;
+}
+
+/**
+ * Remove keys [first, last] from subtree at entry->v[offset], entry
+ * being at given level. Fully covered subtree is freed at once,
+ * otherwise we go down and free child if it becomes empty.
+ *
+ * With @arg mark nothing is removed, lowest level entries that are
+ * going to be freed with values are marked dead, returns number
+ * of marked entries.
+ *
+ * Called under subtree lock.
+ */
+static int __cch_index_remove_range_child(struct cch_index *index,
+	struct cch_index_entry *entry, int level, int offset,
+	uint64_t first, uint64_t last, bool mark)
+{
+	struct cch_index_entry *child;
+	struct cch_level_desc_entry *desc = &index->levels_desc[level];
+	uint64_t child_first, child_last;
+	int marked = 0;
+
+	child = cch_index_entry_child(index, entry, offset);
+	if (child == NULL)
+		goto out;
+
+	/* keys of child differ only in bits below this level */
+	child_first = (first & ~cch_index_level_span_mask(index, level)) |
+		((uint64_t) offset << desc->offset);
+	child_last = child_first | ((1ULL << desc->offset) - 1);
+
+	if (child_first >= first && child_last <= last) {
+		if (cch_index_entry_is_unloaded(child)) {
+			/* no lockless inserters there, it's just dropped */
+			if (!mark) {
+				cch_index_entry_unlink(index, entry, offset);
+				atomic_dec(&index->nr_unloaded);
+			}
+			goto out;
+		}
+		/* pinned entries may be anywhere below, they are kept */
+		if (*cch_index_subtree_pins(index, EXTRACT_BIASED_VALUE(
+				child_first, index->levels_desc, 0)))
+			goto descend;
+		if (mark) {
+			marked = __cch_index_subtree_set_dead(index, child);
+			goto out;
+		}
+		cch_index_entry_unlink(index, entry, offset);
+		cch_index_destroy_entry(index, child);
+		goto out;
+	}
+
+descend:
+	/* boundary entries are loaded by cch_index_remove_range() */
+	sBUG_ON(cch_index_entry_is_unloaded(child));
+
+	marked = __cch_index_remove_range(index, child, level + 1,
+		max(first, child_first), min(last, child_last), mark);
+
+	if (!mark && !(cch_index_entry_is_lowest_level(child) &&
+		       child->pinned) &&
+	    atomic_cmpxchg(&child->ref_cnt, 0, CCH_INDEX_ENTRY_DEAD) == 0) {
+		cch_index_entry_unlink(index, entry, offset);
+		cch_index_destroy_entry(index, child);
+	}
+
+out:
+	return marked;
+}
+
+/**
+ * Remove keys [first, last] from entry at given level, all the keys
+ * are inside of this entry. See __cch_index_remove_range_child().
+ */
+static int __cch_index_remove_range(struct cch_index *index,
+	struct cch_index_entry *entry, int level,
+	uint64_t first, uint64_t last, bool mark)
+{
+	int lo = EXTRACT_BIASED_VALUE(first, index->levels_desc, level);
+	int hi = EXTRACT_BIASED_VALUE(last, index->levels_desc, level);
+	int marked = 0;
+	int i = 0;
+
+	if (level == index->levels - 1) {
+		if (mark)
+			goto out;
+		for (i = cch_index_entry_next_offset(index, entry, lo);
+		     i <= hi;
+		     i = cch_index_entry_next_offset(index, entry, i + 1))
+			__cch_index_entry_remove_value(index, entry, i);
+		cch_index_entry_lru_update(index, entry);
+		goto out;
+	}
+
+	for (i = cch_index_entry_next_child(index, entry, lo); i <= hi;
+	     i = cch_index_entry_next_child(index, entry, i + 1)) {
+		marked += __cch_index_remove_range_child(index, entry, level,
+			i, first, last, mark);
+	}
+
+out:
+	return marked;
+}
+
+int cch_index_remove_range(struct cch_index *index,
+			   uint64_t first, uint64_t last)
+{
+	int result = 0;
+	struct mutex *subtree_mutex;
+	uint64_t max_key;
+	int lo = 0, hi = 0, i = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+
+	if (first > last) {
+		result = -EINVAL;
+		goto out;
+	}
+
+	max_key = cch_index_max_key(index);
+	if (first > max_key)
+		goto out;
+	last = min(last, max_key);
+
+	lo = EXTRACT_BIASED_VALUE(first, index->levels_desc, 0);
+	hi = EXTRACT_BIASED_VALUE(last, index->levels_desc, 0);
+
+	/* one root slot subtree at a time */
+	for (i = lo; i <= hi; i++) {
+		subtree_mutex = cch_index_subtree_mutex(index, i);
+		mutex_lock(subtree_mutex);
+
+		/* entries holding first and last keys are trimmed key
+		 * by key, so they have to be in memory */
+		if (i == lo)
+			result = __cch_index_load_path(index, first);
+		if (i == hi && (!result || result == -ENOENT))
+			result = __cch_index_load_path(index, last);
+		if (result && result != -ENOENT) {
+			mutex_unlock(subtree_mutex);
+			goto out;
+		}
+		result = 0;
+
+		/* wait for lockless inserters into entries we'll free */
+		if (__cch_index_remove_range_child(index, &index->head, 0, i,
+				first, last, true))
+			synchronize_rcu();
+
+		__cch_index_remove_range_child(index, &index->head, 0, i,
+			first, last, false);
+
+		mutex_unlock(subtree_mutex);
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_remove_range);
+
+/* grow vmalloc'ed array of @arg size byte elements to hold nr + 1 */
+static int cch_index_array_grow(void **array, int *max, int nr,
+				size_t size)
+{
+	void *bigger;
+	int new_max;
+
+	if (nr < *max)
+		return 0;
+
+	new_max = *max ? *max * 2 : 64;
+	bigger = vmalloc(new_max * size);
+	if (bigger == NULL)
+		return -ENOMEM;
+
+	if (*array != NULL) {
+		memcpy(bigger, *array, nr * size);
+		vfree(*array);
+	}
+	*array = bigger;
+	*max = new_max;
+
+	return 0;
+}
+
+/* unloaded entry copied by full save, its parent slot gets new offs */
+struct cch_index_save_moved {
+	uint64_t key;
+	/* device offsets of old and new copy */
+	uint64_t from, to;
+	/* new copy in buf */
+	int buf_pos;
+};
+
+/*
+ * State of cch_index_full_save(). Root is saved at device offset 0,
+ * subtrees of root slots one after another. Levels of a subtree go
+ * one after another, entries of every level in key order are packed
+ * into clusters of level kind. Clusters are filled right in buf and
+ * written by max_clusters at once, full save takes whole subtree.
+ */
+struct cch_index_save {
+	struct cch_index *index;
+	uint8_t *buf;
+	/* clusters in buf, last one is being filled */
+	int buf_clusters, max_clusters;
+	/* device offset of buf */
+	uint64_t buf_offset;
+	/* signature of level being saved */
+	uint64_t kind;
+	/* entries in last cluster, -1 if it's finished */
+	int next;
+	/* entries of level saved so far */
+	int nr;
+	/* device offsets of next level entries */
+	struct cch_backend_level_cursor children;
+	/* cluster of last copied unloaded entry */
+	struct cch_index_fault *fault;
+	/* unloaded entries to copy, parents refer to old copies until
+	 * new ones are written */
+	struct cch_index_save_moved *moved;
+	int nr_moved, max_moved;
+};
+
+static inline struct cch_backend_cluster *cch_index_save_cluster(
+	struct cch_index_save *save, int i)
+{
+	return (struct cch_backend_cluster *)
+		&save->buf[i * save->index->backend_cluster_size];
+}
+
+static int __cch_index_save_flush(struct cch_index_save *save)
+{
+	struct cch_index *index = save->index;
+	int len = save->buf_clusters * index->backend_cluster_size;
+	int result = 0;
+
+	if (len == 0)
+		goto out;
+
+	result = index->write_cluster_data_fn(index, save->buf_offset,
+		save->buf, len);
+	if (result) {
+		PRINT_ERROR("write of %d bytes at %llu failed, result %d",
+			    len, (unsigned long long) save->buf_offset,
+			    result);
+		goto out;
+	}
+
+	save->buf_offset += len;
+	save->buf_clusters = 0;
+
+out:
+	return result;
+}
+
+/* finish last cluster, next entry goes to a new one */
+static void __cch_index_save_cluster_finish(struct cch_index_save *save)
+{
+	if (save->next < 0)
+		return;
+
+	cch_index_backend_cluster_fill_finish(save->index,
+		cch_index_save_cluster(save, save->buf_clusters - 1));
+	save->next = -1;
+}
+
+/*
+ * Children of entries saved level by level are put to the next level
+ * in cursor order, otherwise they are saved already.
+ */
+static inline struct cch_backend_level_cursor *cch_index_save_children(
+	struct cch_index_save *save)
+{
+	return save->children.per_cluster ? &save->children : NULL;
+}
+
+/* finish last cluster and start a new one, flushing full buf */
+static int __cch_index_save_cluster_start(struct cch_index_save *save)
+{
+	struct cch_backend_cluster *cluster;
+	int result = 0;
+
+	__cch_index_save_cluster_finish(save);
+
+	if (save->buf_clusters == save->max_clusters) {
+		result = __cch_index_save_flush(save);
+		if (result)
+			goto out;
+	}
+
+	cluster = cch_index_save_cluster(save, save->buf_clusters++);
+	cluster->signature = save->kind;
+	cch_index_backend_cluster_fill_start(save->index, cluster);
+	save->next = 0;
+
+out:
+	return result;
+}
+
+/* device offset of last record put, of @arg entry_bytes size */
+static inline uint64_t cch_index_save_last_offs(struct cch_index_save *save,
+	int entry_bytes)
+{
+	return save->buf_offset +
+		(uint64_t) (save->buf_clusters - 1) *
+		save->index->backend_cluster_size +
+		offsetof(struct cch_backend_cluster, data) +
+		(save->next - 1) * entry_bytes;
+}
+
+static int __cch_index_save_put(struct cch_index_save *save,
+	struct cch_index_entry *entry, uint64_t key)
+{
+	struct cch_backend_cluster *cluster;
+	int result = 0;
+
+	/* changes after the bit is set make entry dirty again, pairs
+	 * with cch_index_entry_mark_dirty() of lockless inserters */
+	if (!cch_index_entry_is_root(entry)) {
+		cch_index_entry_set_saved(entry);
+		smp_mb__after_atomic();
+	}
+
+	if (save->next >= 0) {
+		cluster = cch_index_save_cluster(save, save->buf_clusters - 1);
+		result = cch_index_backend_cluster_fill_put(save->index,
+			cluster, entry, key, cch_index_save_children(save),
+			&save->next);
+		if (result != -ENOSPC)
+			goto out;
+	}
+
+	result = __cch_index_save_cluster_start(save);
+	if (result)
+		goto out;
+
+	/* empty cluster fits any entry of its kind */
+	cluster = cch_index_save_cluster(save, save->buf_clusters - 1);
+	result = cch_index_backend_cluster_fill_put(save->index, cluster,
+		entry, key, cch_index_save_children(save), &save->next);
+	sBUG_ON(result);
+
+out:
+	if (!result) {
+		entry->backend_offs = cch_index_save_last_offs(save,
+			cch_backend_index_entry_bytes(
+				cch_index_entry_size(save->index, entry)));
+		save->nr++;
+	}
+	return result;
+}
+
+/*
+ * Reserve place for record of lowest level entry unloaded by
+ * cch_index_shrink(), the record is copied from its cluster by
+ * __cch_index_save_copy_moved() out of subtree lock.
+ */
+static int __cch_index_save_put_unloaded(struct cch_index_save *save,
+	uint64_t offs, uint64_t key)
+{
+	struct cch_index *index = save->index;
+	struct cch_backend_cluster *cluster;
+	struct cch_index_save_moved *moved;
+	int entry_bytes;
+	int result = 0;
+
+	result = cch_index_array_grow((void **) &save->moved,
+		&save->max_moved, save->nr_moved, sizeof(*save->moved));
+	if (result)
+		goto out;
+
+	if (save->next < 0 ||
+	    save->next >= cch_backend_cluster_capacity(index,
+			cch_index_save_cluster(save, save->buf_clusters - 1))) {
+		result = __cch_index_save_cluster_start(save);
+		if (result)
+			goto out;
+	}
+
+	cluster = cch_index_save_cluster(save, save->buf_clusters - 1);
+	entry_bytes = cch_backend_index_entry_bytes(
+		cch_backend_cluster_entry_size(index, cluster));
+	cluster->num_entries++;
+	save->next++;
+
+	moved = &save->moved[save->nr_moved++];
+	moved->key = key;
+	moved->from = offs;
+	moved->to = cch_index_save_last_offs(save, entry_bytes);
+	moved->buf_pos = &cluster->data[entry_bytes * (save->next - 1)] -
+		save->buf;
+	save->nr++;
+
+out:
+	return result;
+}
+
+/*
+ * Copy records put by __cch_index_save_put_unloaded() from @arg first
+ * on. Records don't refer to anything, so they are copied as is, and
+ * full save doesn't write over old copies, see
+ * cch_index_save_relocated_base().
+ */
+static int __cch_index_save_copy_moved(struct cch_index_save *save,
+	int first)
+{
+	struct cch_index *index = save->index;
+	struct cch_backend_index_entry *backend_entry;
+	struct cch_backend_cluster *cluster;
+	struct cch_index_save_moved *moved;
+	uint64_t cluster_offset;
+	int i, nr;
+	int result = 0;
+
+	for (i = first; i < save->nr_moved; i++) {
+		moved = &save->moved[i];
+		cluster_offset = moved->from &
+			~((uint64_t) index->backend_cluster_size - 1);
+
+		/* unloaded neighbours usually share their cluster */
+		if (save->fault != NULL &&
+		    save->fault->offset != cluster_offset) {
+			cch_index_fault_put(index, save->fault);
+			save->fault = NULL;
+		}
+		if (save->fault == NULL) {
+			result = cch_index_fault_get(index, cluster_offset,
+				index->save_generation, &save->fault);
+			if (result)
+				goto out;
+		}
+
+		result = cch_index_fault_record(index, save->fault,
+			moved->from, moved->key, &backend_entry);
+		if (result)
+			goto out;
+
+		nr = moved->buf_pos / index->backend_cluster_size;
+		cluster = cch_index_save_cluster(save, nr);
+		if (backend_entry->len != cch_backend_cluster_entry_size(index,
+								 cluster)) {
+			PRINT_ERROR("record of size %d at %llu",
+				    backend_entry->len,
+				    (unsigned long long) moved->from);
+			result = -EIO;
+			goto out;
+		}
+
+		memcpy(&save->buf[moved->buf_pos], backend_entry,
+		       cch_backend_index_entry_bytes(backend_entry->len));
+
+		/* crc goes after last record copied to cluster */
+		if (i + 1 == save->nr_moved ||
+		    save->moved[i + 1].buf_pos / index->backend_cluster_size !=
+		    nr)
+			cch_index_backend_cluster_fill_finish(index, cluster);
+	}
+
+out:
+	return result;
+}
+
+/*
+ * Parent slot of lowest level entry holding @arg key, NULL if there
+ * is no such slot. Called under subtree lock of the key.
+ */
+static struct cch_index_entry **__cch_index_leaf_slot(
+	struct cch_index *index, uint64_t key)
+{
+	struct cch_index_entry *entry = &index->head;
+	int level;
+
+	for (level = 0; level < index->lowest_level - 1; level++) {
+		entry = cch_index_entry_child(index, entry,
+			EXTRACT_BIASED_VALUE(key, index->levels_desc, level));
+		if (entry == NULL)
+			return NULL;
+	}
+
+	return cch_index_entry_child_slot(index, entry,
+		EXTRACT_BIASED_VALUE(key, index->levels_desc, level));
+}
+
+/*
+ * Parents refer to new copies of unloaded entries once they are
+ * written, ones loaded from old copies meanwhile are saved at new
+ * ones too. Old copies stay in place till next save, so lookups are
+ * fine with either.
+ */
+static void __cch_index_save_moved_done(struct cch_index_save *save)
+{
+	struct cch_index *index = save->index;
+	struct cch_index_save_moved *moved;
+	struct cch_index_entry **slot, *child;
+	struct mutex *subtree_mutex = NULL, *next_mutex;
+	int i;
+
+	for (i = 0; i < save->nr_moved; i++) {
+		moved = &save->moved[i];
+
+		/* they go in key order */
+		next_mutex = cch_index_subtree_mutex(index,
+			EXTRACT_BIASED_VALUE(moved->key, index->levels_desc,
+					     0));
+		if (next_mutex != subtree_mutex) {
+			if (subtree_mutex != NULL)
+				mutex_unlock(subtree_mutex);
+			subtree_mutex = next_mutex;
+			mutex_lock(subtree_mutex);
+		}
+
+		slot = __cch_index_leaf_slot(index, moved->key);
+		child = slot != NULL ? *slot : NULL;
+		if (child == NULL)
+			continue;
+
+		if (child == cch_index_entry_unloaded(moved->from))
+			rcu_assign_pointer(*slot,
+				cch_index_entry_unloaded(moved->to));
+		else if (!cch_index_entry_is_unloaded(child) &&
+			 child->backend_offs == moved->from)
+			child->backend_offs = moved->to;
+	}
+
+	if (subtree_mutex != NULL)
+		mutex_unlock(subtree_mutex);
+}
+
+/*
+ * Save entries of @arg level found under @arg entry of given depth,
+ * in key order. @arg key is the first key of entry.
+ */
+static int __cch_index_save_level(struct cch_index_save *save,
+	struct cch_index_entry *entry, uint64_t key, int depth, int level)
+{
+	struct cch_index *index = save->index;
+	struct cch_index_entry *child;
+	int size, offset;
+	int result = 0;
+
+	if (depth == level)
+		return __cch_index_save_put(save, entry, key);
+
+	size = cch_index_entry_size(index, entry);
+	for (offset = cch_index_entry_next_child(index, entry, 0);
+	     offset < size;
+	     offset = cch_index_entry_next_child(index, entry, offset + 1)) {
+		child = cch_index_entry_child(index, entry, offset);
+		if (child == NULL)
+			continue;
+
+		if (cch_index_entry_is_unloaded(child)) {
+			sBUG_ON(depth + 1 != level);
+			result = __cch_index_save_put_unloaded(save,
+				cch_index_entry_unloaded_offs(child),
+				key | ((uint64_t) offset <<
+				       index->levels_desc[depth].offset));
+		} else
+			result = __cch_index_save_level(save, child, key |
+				((uint64_t) offset <<
+				 index->levels_desc[depth].offset),
+				depth + 1, level);
+		if (result)
+			break;
+	}
+
+	return result;
+}
+
+/*
+ * Freeze the index structure for save, all levels must agree on it.
+ * Lockless inserts to existing entries may get to the saved data or
+ * not, they leave entries dirty anyway.
+ */
+static void cch_index_save_lock(struct cch_index *index)
+{
+	int i;
+
+	mutex_lock(&index->cch_index_value_mutex);
+	for (i = 0; i < CCH_INDEX_SUBTREE_LOCKS; i++)
+		mutex_lock_nest_lock(&index->subtree_locks[i].mutex,
+				     &index->cch_index_value_mutex);
+}
+
+static void cch_index_save_unlock(struct cch_index *index)
+{
+	int i;
+
+	for (i = CCH_INDEX_SUBTREE_LOCKS - 1; i >= 0; i--)
+		mutex_unlock(&index->subtree_locks[i].mutex);
+	mutex_unlock(&index->cch_index_value_mutex);
+}
+
+/*
+ * Count entries of every level below @arg entry of given depth to
+ * @arg nr[], clusters of unloaded ones are within [*lo, *hi).
+ */
+static void __cch_index_save_count(struct cch_index *index,
+	struct cch_index_entry *entry, int depth, int *nr,
+	uint64_t *lo, uint64_t *hi)
+{
+	struct cch_index_entry *child;
+	uint64_t offs;
+	int size, offset;
+
+	size = cch_index_entry_size(index, entry);
+	for (offset = cch_index_entry_next_child(index, entry, 0);
+	     offset < size;
+	     offset = cch_index_entry_next_child(index, entry, offset + 1)) {
+		child = cch_index_entry_child(index, entry, offset);
+		if (child == NULL)
+			continue;
+
+		nr[depth + 1]++;
+		if (cch_index_entry_is_unloaded(child)) {
+			offs = cch_index_entry_unloaded_offs(child) &
+				~((uint64_t) index->backend_cluster_size - 1);
+			*lo = min(*lo, offs);
+			*hi = max(*hi, offs + index->backend_cluster_size);
+		} else if (depth + 1 < index->lowest_level)
+			__cch_index_save_count(index, child, depth + 1, nr,
+					       lo, hi);
+	}
+}
+
+/* signature of clusters holding entries of @arg level */
+static inline uint64_t cch_index_save_level_kind(struct cch_index *index,
+	int level)
+{
+	if (level == 0)
+		return CCH_INDEX_BACKEND_CLUSTER_ROOT;
+	return level == index->lowest_level ? CCH_INDEX_BACKEND_CLUSTER_LOW :
+		CCH_INDEX_BACKEND_CLUSTER_MID;
+}
+
+/* clusters taken by @arg nr entries of @arg level */
+static int cch_index_save_level_clusters(struct cch_index *index,
+	int level, int nr)
+{
+	struct cch_backend_cluster kind_cluster;
+
+	kind_cluster.signature = cch_index_save_level_kind(index, level);
+	return DIV_ROUND_UP(nr, cch_backend_cluster_capacity(index,
+							    &kind_cluster));
+}
+
+/*
+ * Device offset for levels below root when saved data can't be
+ * truncated: in front of clusters of unloaded entries if it fits
+ * there, right after them otherwise. So saves alternate between two
+ * places and space behind is reused. Clusters of unloaded entries
+ * are within [*lo, *hi).
+ */
+static uint64_t cch_index_save_relocated_base(struct cch_index *index,
+	uint64_t *lo, uint64_t *hi)
+{
+	int nr[CCH_INDEX_MAX_LEVELS];
+	uint64_t base, size = 0;
+	int level;
+
+	memset(nr, 0, sizeof(nr));
+	__cch_index_save_count(index, &index->head, 0, nr, lo, hi);
+
+	for (level = 1; level < index->levels; level++)
+		size += (uint64_t) cch_index_save_level_clusters(index, level,
+			nr[level]) * index->backend_cluster_size;
+
+	/* root cluster stays at 0 */
+	base = index->backend_cluster_size;
+	if (*hi != 0 && base + size > *lo)
+		base = *hi;
+
+	TRACE(TRACE_DEBUG, "%llu bytes at %llu, unloaded entries "
+	      "within [%llu, %llu)", (unsigned long long) size,
+	      (unsigned long long) base, (unsigned long long) *lo,
+	      (unsigned long long) *hi);
+
+	return base;
+}
+
+/*
+ * Save subtree of root slot @arg offset at *@arg base, or right after
+ * [lo, hi) if it grew too big to fit in front of it, and advance
+ * *@arg base. Subtree is put to buf under its lock, records of
+ * unloaded entries are copied and buf is written out of it. Root
+ * record gets device offset of the subtree.
+ */
+static int __cch_index_save_subtree(struct cch_index_save *save,
+	int offset, uint64_t *base, uint64_t lo, uint64_t hi,
+	struct cch_backend_index_entry *root_record)
+{
+	struct cch_index *index = save->index;
+	struct cch_backend_cluster kind_cluster;
+	struct cch_index_entry *child;
+	struct mutex *subtree_mutex;
+	int nr[CCH_INDEX_MAX_LEVELS];
+	uint64_t key, level_base, unused_lo = ~0ULL, unused_hi = 0;
+	int level, clusters = 0, first_moved = save->nr_moved;
+	int result = 0;
+
+	key = (uint64_t) offset << index->levels_desc[0].offset;
+	subtree_mutex = cch_index_subtree_mutex(index, offset);
+	mutex_lock(subtree_mutex);
+
+	child = cch_index_entry_child(index, &index->head, offset);
+	if (child == NULL)
+		goto out_unlock;
+
+	memset(nr, 0, sizeof(nr));
+	nr[1] = 1;
+	if (!cch_index_entry_is_unloaded(child))
+		__cch_index_save_count(index, child, 1, nr, &unused_lo,
+				       &unused_hi);
+	for (level = 1; level < index->levels; level++)
+		clusters += cch_index_save_level_clusters(index, level,
+							  nr[level]);
+
+	/* clusters of unloaded entries are copied from, not over */
+	if (*base < hi && *base + (uint64_t) clusters *
+	    index->backend_cluster_size > lo)
+		*base = hi;
+
+	if (clusters > save->max_clusters) {
+		vfree(save->buf);
+		save->max_clusters = 0;
+		save->buf = vmalloc((size_t) clusters *
+				    index->backend_cluster_size);
+		if (save->buf == NULL) {
+			result = -ENOMEM;
+			goto out_unlock;
+		}
+		save->max_clusters = clusters;
+	}
+	save->buf_offset = *base;
+	save->buf_clusters = 0;
+	level_base = *base;
+
+	for (level = 1; level < index->levels && nr[level] > 0; level++) {
+		save->kind = cch_index_save_level_kind(index, level);
+		save->next = -1;
+		save->nr = 0;
+
+		/* next level starts right after clusters of this one */
+		memset(&save->children, 0, sizeof(save->children));
+		save->children.base = level_base + (uint64_t)
+			cch_index_save_level_clusters(index, level,
+				nr[level]) * index->backend_cluster_size;
+		if (level + 1 < index->levels) {
+			kind_cluster.signature =
+				cch_index_save_level_kind(index, level + 1);
+			save->children.entry_bytes =
+				cch_backend_index_entry_bytes(
+					cch_backend_cluster_entry_size(index,
+						&kind_cluster));
+			save->children.per_cluster =
+				cch_backend_cluster_capacity(index,
+							     &kind_cluster);
+		}
+
+		if (cch_index_entry_is_unloaded(child))
+			result = __cch_index_save_put_unloaded(save,
+				cch_index_entry_unloaded_offs(child), key);
+		else
+			result = __cch_index_save_level(save, child, key, 1,
+							level);
+		if (result)
+			goto out_unlock;
+		__cch_index_save_cluster_finish(save);
+
+		sBUG_ON(save->nr != nr[level]);
+		sBUG_ON(save->buf_offset + (uint64_t) save->buf_clusters *
+			index->backend_cluster_size != save->children.base);
+
+		level_base = save->children.base;
+	}
+
+	/* top entry of subtree is its first record */
+	root_record->v[offset].backend_dev_offs = *base +
+		offsetof(struct cch_backend_cluster, data);
+
+out_unlock:
+	mutex_unlock(subtree_mutex);
+	if (result || child == NULL)
+		goto out;
+
+	result = __cch_index_save_copy_moved(save, first_moved);
+	if (result)
+		goto out;
 
-		/* we should be sure the search wasn't in vain */
-		sBUG_ON(right_entry == entry);
-		offset -= lowest_entry_size;
-
-		/* offset overleaps to previous index entry */
-	} else if (unlikely(offset < 0)) {
-		/* we support backwards traversing */
-		/* need to find previous sibling */
-		sBUG(); /* not implemented yet */
-		result = __cch_index_entry_find_prev_sibling(
-			index, entry, &right_entry);
+	result = __cch_index_save_flush(save);
+	if (result)
+		goto out;
+
+	TRACE(TRACE_DEBUG, "root slot %d: %d clusters at %llu", offset,
+	      clusters, (unsigned long long) *base);
+
+	*base = save->buf_offset;
+
+out:
+	return result;
+}
+
+/**
+ * Save whole index with write_cluster_data_fn, see struct
+ * cch_index_save for layout. Subtrees are put to memory one by one
+ * under their locks and written out of them, root refers to them and
+ * is written last. Saves don't run in parallel and nothing is
+ * unloaded meanwhile, so saved data is changed only here.
+ *
+ * Records of entries unloaded by cch_index_shrink() are only on
+ * backend, so saved data isn't truncated then. They are copied from
+ * their clusters, levels below root are written apart from them in a
+ * transaction.
+ */
+int cch_index_full_save(struct cch_index *index)
+{
+	struct cch_index_save save;
+	struct cch_backend_cluster *root_cluster = NULL;
+	struct cch_backend_index_entry *root_record;
+	uint64_t base, lo = ~0ULL, hi = 0;
+	int result = 0, finish_result = 0;
+	int offset;
+	bool relocate;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+
+	if (index->backend_cluster_size == 0) {
+		PRINT_ERROR("entries don't fit backend clusters");
+		result = -EINVAL;
+		goto out;
+	}
+
+	memset(&save, 0, sizeof(save));
+	save.index = index;
+
+	result = cch_index_backend_cluster_alloc(index,
+		CCH_INDEX_BACKEND_CLUSTER_ROOT, &root_cluster);
+	if (result)
+		goto out;
+	cch_index_backend_cluster_fill_start(index, root_cluster);
+	root_record = (struct cch_backend_index_entry *) root_cluster->data;
+	root_record->start_offs_key = 0;
+	root_record->len = cch_backend_cluster_entry_size(index,
+							  root_cluster);
+	root_cluster->num_entries = 1;
+
+	mutex_lock(&index->save_mutex);
+
+	/* shrink doesn't unload anything while saved data is
+	 * overwritten, unloads being done are waited for */
+	cch_index_save_lock(index);
+	atomic_inc(&index->full_saves);
+	relocate = atomic_read(&index->nr_unloaded) != 0;
+	if (relocate)
+		base = cch_index_save_relocated_base(index, &lo, &hi);
+	else
+		base = index->backend_cluster_size;
+	/* clusters read before are rewritten now */
+	WRITE_ONCE(index->save_generation, index->save_generation + 1);
+	cch_index_save_unlock(index);
+
+	if (relocate) {
+		if (index->start_transaction_fn != NULL)
+			result = index->start_transaction_fn(index);
+	} else
+		result = index->start_full_save_fn(index);
+	if (result)
+		goto out_unlock;
+
+	for (offset = 0; offset < index->levels_desc[0].size; offset++) {
+		result = __cch_index_save_subtree(&save, offset, &base, lo,
+						  hi, root_record);
 		if (result)
-			goto out_unlock;
+			goto out_finish;
 	}
-	/* we can insert right in this entry */
-	result = __cch_index_entry_insert_direct(index, right_entry, offset,
-		replace, value);
+
+	/* root refers to subtrees saved above */
+	cch_index_backend_cluster_fill_finish(index, root_cluster);
+	result = index->write_cluster_data_fn(index, 0,
+		(uint8_t *) root_cluster, index->backend_cluster_size);
 	if (result) {
-		if (result == -EEXIST)
-			PRINT_INFO("attempt to replace entry");
-		goto out_unlock;
+		PRINT_ERROR("write of root cluster failed, result %d",
+			    result);
+		goto out_finish;
 	}
+	index->head.backend_offs = offsetof(struct cch_backend_cluster, data);
 
-	if (new_value_offset)
-		*new_value_offset = offset;
-	if (new_index_entry)
-		*new_index_entry = right_entry;
+	__cch_index_save_moved_done(&save);
+	/* incremental saves may rewrite old copies now, reads of them
+	 * aren't shared with later ones, see __cch_index_fault_in() */
+	smp_wmb();
+	WRITE_ONCE(index->save_generation, index->save_generation + 1);
+
+out_finish:
+	if (save.fault != NULL)
+		cch_index_fault_put(index, save.fault);
 
-	cch_index_entry_lru_update(index, entry);
+	if (!relocate)
+		finish_result = index->finish_full_save_fn(index);
+	else if (index->finish_transaction_fn != NULL)
+		finish_result = index->finish_transaction_fn(index);
+	if (!result)
+		result = finish_result;
+
+	/* saved bits may be set for entries that didn't get written */
+	index->backend_end = result ? 0 : base;
 
 out_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
+	atomic_dec(&index->full_saves);
+	mutex_unlock(&index->save_mutex);
 
+	vfree(save.moved);
+	vfree(save.buf);
+	kmem_cache_free(index->backend_cluster_kmem, root_cluster);
+
+out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(cch_index_insert_direct);
+EXPORT_SYMBOL(cch_index_full_save);
 
-int cch_index_find_direct(
-	struct cch_index *index,
-	struct cch_index_entry *entry, int offset,
-	void **out_value,
-	struct cch_index_entry **next_index_entry,
-	int *value_offset)
+/*
+ * Entries changed since last save, found by
+ * cch_index_incremental_save() with their first keys. Children go
+ * before parents, so parents refer to where children were just saved.
+ */
+struct cch_index_dirty {
+	struct cch_index_dirty_entry {
+		struct cch_index_entry *entry;
+		uint64_t key;
+	} *entries;
+	int nr;
+	int max;
+	/* lowest level ones */
+	int nr_lowest;
+};
+
+static int __cch_index_collect_dirty(struct cch_index *index,
+	struct cch_index_dirty *dirty, struct cch_index_entry *entry,
+	uint64_t key, int level)
 {
+	struct cch_index_entry *child;
+	int size, offset;
 	int result = 0;
-	int lowest_entry_size = 0;
-	struct cch_index_entry *right_entry = NULL;
+
+	if (!cch_index_entry_is_lowest_level(entry)) {
+		size = cch_index_entry_size(index, entry);
+		for (offset = cch_index_entry_next_child(index, entry, 0);
+		     offset < size;
+		     offset = cch_index_entry_next_child(index, entry,
+							 offset + 1)) {
+			child = cch_index_entry_child(index, entry, offset);
+			/* unloaded ones are saved too */
+			if (child == NULL || cch_index_entry_is_unloaded(child) ||
+			    cch_index_entry_is_saved(child))
+				continue;
+
+			result = __cch_index_collect_dirty(index, dirty, child,
+				key | ((uint64_t) offset <<
+				       index->levels_desc[level].offset),
+				level + 1);
+			if (result)
+				goto out;
+		}
+	}
+
+	/* root is saved every time */
+	if (cch_index_entry_is_root(entry))
+		goto out;
+
+	result = cch_index_array_grow((void **) &dirty->entries, &dirty->max,
+				      dirty->nr, sizeof(*dirty->entries));
+	if (result)
+		goto out;
+
+	dirty->entries[dirty->nr].entry = entry;
+	dirty->entries[dirty->nr].key = key;
+	dirty->nr++;
+	if (cch_index_entry_is_lowest_level(entry))
+		dirty->nr_lowest++;
+
+out:
+	return result;
+}
+
+/**
+ * Append dirty entries after saved data, lowest level ones first,
+ * mid level ones after them, each kind packed into its own clusters.
+ * Root cluster is rewritten last, so until then saved index is the
+ * previous one. Without saved index it's a full save, which isn't
+ * done inside of transaction of this one.
+ */
+int cch_index_incremental_save(struct cch_index *index)
+{
+	struct cch_index_dirty dirty;
+	struct cch_index_save low, mid, root;
+	struct cch_index_save *save;
+	struct cch_backend_cluster kind_cluster;
+	uint64_t mid_base;
+	int result = 0, finish_result;
+	bool full = false;
+	int i;
 
 	TRACE_ENTRY();
 
 	sBUG_ON(index == NULL);
-	sBUG_ON(entry == NULL);
-	/* starting point is lowest entry */
-	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
-	sBUG_ON(out_value == NULL);
-	sBUG_ON(*out_value == NULL);
-#ifdef CCH_INDEX_DEBUG
-	sBUG_ON(entry->magic != CCH_INDEX_ENTRY_MAGIC);
-#endif
 
-	mutex_lock(&index->cch_index_value_mutex);
+	if (index->backend_cluster_size == 0) {
+		PRINT_ERROR("entries don't fit backend clusters");
+		result = -EINVAL;
+		goto out;
+	}
 
-	/* logic is same as in insert_direct, but we must not create
-	 * any siblings as we do in insert_direct:
-	 *
-	 * 1. check if we can't find given offset in current entry */
+again:
+	/* nothing saved to refer to */
+	if (READ_ONCE(index->backend_end) == 0) {
+		result = cch_index_full_save(index);
+		goto out;
+	}
 
-	/* 2. if not, seek for index_entry that can hold remainder of offset */
+	memset(&dirty, 0, sizeof(dirty));
+	memset(&low, 0, sizeof(low));
+	memset(&mid, 0, sizeof(mid));
+	memset(&root, 0, sizeof(root));
+	low.index = mid.index = root.index = index;
+	low.kind = CCH_INDEX_BACKEND_CLUSTER_LOW;
+	mid.kind = CCH_INDEX_BACKEND_CLUSTER_MID;
+	root.kind = CCH_INDEX_BACKEND_CLUSTER_ROOT;
+	low.next = mid.next = root.next = -1;
+	low.max_clusters = mid.max_clusters = CCH_INDEX_SAVE_CLUSTERS;
+	root.max_clusters = 1;
+
+	low.buf = vmalloc(CCH_INDEX_SAVE_CLUSTERS *
+			  index->backend_cluster_size);
+	mid.buf = vmalloc(CCH_INDEX_SAVE_CLUSTERS *
+			  index->backend_cluster_size);
+	root.buf = vmalloc(index->backend_cluster_size);
+	if (low.buf == NULL || mid.buf == NULL || root.buf == NULL) {
+		result = -ENOMEM;
+		goto out_free_bufs;
+	}
 
-	/* 3. with known entry check if it holds value and return it */
+	mutex_lock(&index->save_mutex);
 
-	right_entry = entry;
-	lowest_entry_size = cch_index_entry_size(index, entry);
-	TRACE(TRACE_DEBUG, "reading entry %p sized %d with offset %d",
-	      entry, lowest_entry_size, offset);
+	if (index->start_transaction_fn != NULL) {
+		result = index->start_transaction_fn(index);
+		if (result)
+			goto out_save_unlock;
+	}
 
-	/* offset overleaps to next index entry */
-	if (unlikely(offset >= lowest_entry_size)) {
-		/* forward traversing */
-		/* need to find next sibling */
-		/* but offset shouldn't leap over one index_entry
-		 * as we are searching for next sibling, not for the
-		 * arbitrary indexed sibling */
-		sBUG_ON(offset >= 2 * lowest_entry_size);
-		result = __cch_index_entry_find_next_sibling(
-			index, entry, &right_entry);
+	cch_index_save_lock(index);
+
+	/* failed full save got in before us */
+	if (index->backend_end == 0) {
+		full = true;
+		goto out_unlock;
+	}
+
+	result = __cch_index_collect_dirty(index, &dirty, &index->head, 0, 0);
+	if (result)
+		goto out_unlock;
+
+	kind_cluster.signature = CCH_INDEX_BACKEND_CLUSTER_LOW;
+	low.buf_offset = index->backend_end;
+	mid_base = low.buf_offset + (uint64_t) DIV_ROUND_UP(
+		dirty.nr_lowest, cch_backend_cluster_capacity(index,
+							      &kind_cluster)) *
+		index->backend_cluster_size;
+	mid.buf_offset = mid_base;
+
+	for (i = 0; i < dirty.nr; i++) {
+		save = cch_index_entry_is_lowest_level(dirty.entries[i].entry) ?
+			&low : &mid;
+		result = __cch_index_save_put(save, dirty.entries[i].entry,
+					      dirty.entries[i].key);
 		if (result)
 			goto out_unlock;
+	}
+	__cch_index_save_cluster_finish(&low);
+	__cch_index_save_cluster_finish(&mid);
 
-		/* we should be sure the search wasn't in vain */
-		sBUG_ON(right_entry == entry);
-		offset -= lowest_entry_size;
-
-		/* offset overleaps to previous index entry */
-	} else if (unlikely(offset < 0)) {
-		/* we support backwards traversing */
-		/* need to find previous sibling */
-		sBUG(); /* not implemented yet */
-		result = __cch_index_entry_find_prev_sibling(
-			index, entry, &right_entry);
+	result = __cch_index_save_flush(&low);
+	if (result)
+		goto out_unlock;
+	sBUG_ON(low.nr != dirty.nr_lowest);
+	sBUG_ON(low.buf_offset != mid_base);
+
+	result = __cch_index_save_flush(&mid);
+	if (result)
+		goto out_unlock;
+
+	/* root refers to everything written above */
+	result = __cch_index_save_put(&root, &index->head, 0);
+	if (result)
+		goto out_unlock;
+	__cch_index_save_cluster_finish(&root);
+	result = __cch_index_save_flush(&root);
+	if (result)
+		goto out_unlock;
+
+	TRACE(TRACE_DEBUG, "%d dirty entries, %d of lowest level, "
+	      "saved data ends at %llu", dirty.nr, dirty.nr_lowest,
+	      (unsigned long long) mid.buf_offset);
+
+	index->backend_end = mid.buf_offset;
+
+out_unlock:
+	/* saved bits may be set for entries that didn't get written,
+	 * saved data they replace is still there for unloaded ones */
+	if (result) {
+		for (i = 0; i < dirty.nr; i++)
+			cch_index_entry_mark_dirty(dirty.entries[i].entry);
+	}
+	cch_index_save_unlock(index);
+
+	if (index->finish_transaction_fn != NULL) {
+		finish_result = index->finish_transaction_fn(index);
+		if (!result)
+			result = finish_result;
+	}
+
+out_save_unlock:
+	mutex_unlock(&index->save_mutex);
+
+out_free_bufs:
+	vfree(dirty.entries);
+	vfree(low.buf);
+	vfree(mid.buf);
+	vfree(root.buf);
+
+	if (full && !result) {
+		full = false;
+		goto again;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_incremental_save);
+
+/* saved entry to restore: where it is and first key it must hold */
+struct cch_index_restore_ref {
+	uint64_t offs;
+	uint64_t key;
+};
+
+/*
+ * Entries of one level lying in up to CCH_INDEX_SAVE_CLUSTERS
+ * consecutive clusters, read with one call and parsed by a worker of
+ * cch_index_full_restore(). Lowest level records are inserted right
+ * away, mid level ones give next level entries.
+ */
+struct cch_index_restore_work {
+	struct work_struct work;
+	struct completion done;
+	struct cch_index *index;
+	/* signature expected from clusters */
+	uint64_t kind;
+	int level;
+	/* entries to parse sorted by device offset */
+	const struct cch_index_restore_ref *refs;
+	int nr;
+	/* device offset of buf */
+	uint64_t offset;
+	int clusters;
+	uint8_t *buf;
+	/* a record refers to one child at most, so it's of buf records */
+	struct cch_index_restore_ref *children;
+	int nr_children;
+	/* lowest level records of one entry for cch_index_insert_batch() */
+	uint64_t *keys;
+	void **values;
+	int result;
+	bool busy;
+};
+
+static int __cch_index_restore_entry(struct cch_index_restore_work *rw,
+	const struct cch_index_restore_ref *ref,
+	struct cch_backend_index_entry *backend_entry)
+{
+	struct cch_index *index = rw->index;
+	struct cch_level_desc_entry *desc = &index->levels_desc[rw->level];
+	struct cch_index_restore_ref *child;
+	int i, n = 0;
+	int result = 0;
+
+	if (rw->level != 0 && ((backend_entry->start_offs_key ^ ref->key) &
+			       ~cch_index_level_span_mask(index, rw->level))) {
+		PRINT_ERROR("entry at %llu doesn't hold key 0x%llx",
+			    (unsigned long long) ref->offs,
+			    (unsigned long long) ref->key);
+		result = -EIO;
+		goto out;
+	}
+
+	if (rw->kind != CCH_INDEX_BACKEND_CLUSTER_LOW) {
+		for (i = 0; i < backend_entry->len; i++) {
+			if (backend_entry->v[i].backend_dev_offs == 0)
+				continue;
+			child = &rw->children[rw->nr_children++];
+			child->offs = backend_entry->v[i].backend_dev_offs;
+			child->key = ref->key | ((uint64_t) i << desc->offset);
+		}
+		goto out;
+	}
+
+	for (i = 0; i < backend_entry->len; i++) {
+		if (backend_entry->v[i].value == NULL)
+			continue;
+		rw->keys[n] = ref->key | ((uint64_t) i << desc->offset);
+		rw->values[n] = backend_entry->v[i].value;
+		n++;
+	}
+
+	/* only pinned entries are saved empty */
+	if (n == 0)
+		goto out;
+
+	result = cch_index_insert_batch(index, rw->keys, rw->values, n,
+					true, NULL);
+
+out:
+	return result;
+}
+
+static void cch_index_restore_work_fn(struct work_struct *work)
+{
+	struct cch_index_restore_work *rw = container_of(work,
+		struct cch_index_restore_work, work);
+	struct cch_index *index = rw->index;
+	struct cch_backend_cluster *cluster = NULL;
+	struct cch_backend_index_entry *backend_entry;
+	uint64_t cluster_offset, checked = 0;
+	int result = 0;
+	int i, pos, next, entry_bytes = 0;
+
+	TRACE_ENTRY();
+
+	result = index->read_cluster_data_fn(index, rw->offset, rw->buf,
+		rw->clusters * index->backend_cluster_size);
+	if (result < 0) {
+		PRINT_ERROR("read of %d clusters at %llu failed, result %d",
+			    rw->clusters, (unsigned long long) rw->offset,
+			    result);
+		goto out;
+	}
+	result = 0;
+
+	for (i = 0; i < rw->nr; i++) {
+		cluster_offset = rw->refs[i].offs &
+			~((uint64_t) index->backend_cluster_size - 1);
+		cluster = (struct cch_backend_cluster *)
+			&rw->buf[cluster_offset - rw->offset];
+
+		/* offsets are sorted, cluster is checked once */
+		if (i == 0 || cluster_offset != checked) {
+			result = cch_index_backend_cluster_parse_start(index,
+				cluster);
+			if (result)
+				goto out;
+			if (cluster->signature != rw->kind) {
+				PRINT_ERROR("cluster at %llu of wrong kind",
+					    (unsigned long long)
+					    cluster_offset);
+				result = -EIO;
+				goto out;
+			}
+			entry_bytes = cch_backend_index_entry_bytes(
+				cch_backend_cluster_entry_size(index,
+							       cluster));
+			checked = cluster_offset;
+		}
+
+		pos = rw->refs[i].offs - cluster_offset -
+			offsetof(struct cch_backend_cluster, data);
+		if (pos < 0 || pos % entry_bytes != 0) {
+			PRINT_ERROR("no entry at %llu",
+				    (unsigned long long) rw->refs[i].offs);
+			result = -EIO;
+			goto out;
+		}
+
+		next = pos / entry_bytes;
+		result = cch_index_backend_cluster_parse_get(index, cluster,
+			&backend_entry, &next);
+		if (result == -ENOENT)
+			result = -EIO;
 		if (result)
-			goto out_unlock;
+			goto out;
+
+		result = __cch_index_restore_entry(rw, &rw->refs[i],
+			backend_entry);
+		if (result)
+			goto out;
 	}
 
-	/* now, find */
+out:
+	rw->result = result;
+	complete(&rw->done);
 
-	*out_value = right_entry->v[offset].value;
+	TRACE_EXIT_RES(result);
+	return;
+}
 
-	if (*out_value) {
-		cch_index_value_lock(*out_value);
+/* wait for batch in flight and take next level entries it found */
+static int cch_index_restore_wait(struct cch_index_restore_work *rw,
+	struct cch_index_restore_ref **children, int *nr_children,
+	int *max_children)
+{
+	int result = 0;
+	int i;
 
-		if (value_offset)
-			*value_offset = offset;
-		if (next_index_entry)
-			*next_index_entry = right_entry;
-	} else
-		result = -ENOENT;
+	if (!rw->busy)
+		goto out;
+
+	wait_for_completion(&rw->done);
+	rw->busy = false;
+	result = rw->result;
+	if (result)
+		goto out;
+
+	for (i = 0; i < rw->nr_children; i++) {
+		result = cch_index_array_grow((void **) children,
+			max_children, *nr_children, sizeof(**children));
+		if (result)
+			goto out;
+		(*children)[(*nr_children)++] = rw->children[i];
+	}
+
+out:
+	return result;
+}
+
+static int cch_index_restore_ref_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const struct cch_index_restore_ref *) a)->offs;
+	uint64_t y = ((const struct cch_index_restore_ref *) b)->offs;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Restored entries are the same as saved ones, so they get their
+ * device offsets and saved bits, and incremental saves append after
+ * the restored layout.
+ */
+static void cch_index_restore_mark_saved(struct cch_index *index,
+	struct cch_index_restore_ref **refs, const int *nr)
+{
+	struct cch_index_entry *entry;
+	uint64_t end = index->backend_cluster_size;
+	uint64_t cluster_mask;
+	int level, i, l;
+
+	cluster_mask = ~((uint64_t) index->backend_cluster_size - 1);
+
+	mutex_lock(&index->save_mutex);
+	cch_index_save_lock(index);
+
+	for (level = 1; level < index->levels; level++) {
+		for (i = 0; i < nr[level]; i++) {
+			entry = &index->head;
+			for (l = 0; l < level && entry != NULL; l++)
+				entry = cch_index_entry_child(index, entry,
+					EXTRACT_BIASED_VALUE(refs[level][i].key,
+						index->levels_desc, l));
+			/* entries saved empty aren't restored */
+			if (entry == NULL)
+				continue;
+
+			entry->backend_offs = refs[level][i].offs;
+			cch_index_entry_set_saved(entry);
+			end = max(end, (refs[level][i].offs & cluster_mask) +
+				  index->backend_cluster_size);
+		}
+	}
+
+	index->head.backend_offs = offsetof(struct cch_backend_cluster, data);
+	index->backend_end = end;
+
+	cch_index_save_unlock(index);
+	mutex_unlock(&index->save_mutex);
+}
+
+/**
+ * Restore index saved by cch_index_full_save() and
+ * cch_index_incremental_save() into empty index. Levels go one after
+ * another starting from root at offset 0, entries of a level are
+ * known from the previous one. They are sorted by device offset and
+ * read by CCH_INDEX_SAVE_CLUSTERS at once, up to
+ * CCH_INDEX_RESTORE_WORKS batches are read, checked and inserted in
+ * parallel.
+ */
+int cch_index_full_restore(struct cch_index *index)
+{
+	struct cch_index_restore_work *works, *rw;
+	struct workqueue_struct *wq;
+	struct cch_backend_cluster kind_cluster;
+	struct cch_index_restore_ref *refs[CCH_INDEX_MAX_LEVELS] = { NULL };
+	struct cch_index_restore_ref *children = NULL;
+	int nr[CCH_INDEX_MAX_LEVELS] = { 0 };
+	uint64_t cluster_mask, batch_bytes;
+	int result = 0, wait_result;
+	int level, nr_children, max_children = 0;
+	int i, w, first;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+
+	if (index->backend_cluster_size == 0) {
+		PRINT_ERROR("entries don't fit backend clusters");
+		result = -EINVAL;
+		goto out;
+	}
+
+	/* restored entries are marked saved, so there must be no others */
+	if (atomic_read(&index->head.ref_cnt) != 0) {
+		PRINT_ERROR("restore into non-empty index");
+		result = -EBUSY;
+		goto out;
+	}
 
-	cch_index_entry_lru_update(index, entry);
+	cluster_mask = ~((uint64_t) index->backend_cluster_size - 1);
+	batch_bytes = (uint64_t) CCH_INDEX_SAVE_CLUSTERS *
+		index->backend_cluster_size;
 
-out_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
+	works = kzalloc(CCH_INDEX_RESTORE_WORKS * sizeof(*works), GFP_KERNEL);
+	if (works == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
 
-	TRACE_EXIT_RES(result);
-	return result;
-}
-EXPORT_SYMBOL(cch_index_find_direct);
+	for (i = 0; i < CCH_INDEX_RESTORE_WORKS; i++) {
+		rw = &works[i];
+		rw->index = index;
+		INIT_WORK(&rw->work, cch_index_restore_work_fn);
+		init_completion(&rw->done);
+		rw->buf = vmalloc(batch_bytes);
+		rw->children = vmalloc(batch_bytes / sizeof(uint64_t) *
+				       sizeof(*rw->children));
+		rw->keys = kmalloc(index->levels_desc[index->lowest_level].size *
+				   sizeof(*rw->keys), GFP_KERNEL);
+		rw->values = kmalloc(
+			index->levels_desc[index->lowest_level].size *
+			sizeof(*rw->values), GFP_KERNEL);
+		if (rw->buf == NULL || rw->children == NULL ||
+		    rw->keys == NULL || rw->values == NULL) {
+			result = -ENOMEM;
+			goto out_free_works;
+		}
+	}
 
+	refs[0] = vmalloc(sizeof(*refs[0]));
+	if (refs[0] == NULL) {
+		result = -ENOMEM;
+		goto out_free_works;
+	}
+	refs[0]->offs = offsetof(struct cch_backend_cluster, data);
+	refs[0]->key = 0;
+	nr[0] = 1;
 
-int cch_index_destroy(struct cch_index *index)
-{
-	int result = 0;
-	int i = 0;
-	struct cch_index_entry *entry;
+	wq = alloc_workqueue("cch_index_restore", WQ_UNBOUND,
+			     CCH_INDEX_RESTORE_WORKS);
+	if (wq == NULL) {
+		result = -ENOMEM;
+		goto out_free_refs;
+	}
 
-	TRACE_ENTRY();
+	for (level = 0; level < index->levels && nr[level] > 0; level++) {
+		if (level == 0)
+			kind_cluster.signature = CCH_INDEX_BACKEND_CLUSTER_ROOT;
+		else if (level == index->lowest_level)
+			kind_cluster.signature = CCH_INDEX_BACKEND_CLUSTER_LOW;
+		else
+			kind_cluster.signature = CCH_INDEX_BACKEND_CLUSTER_MID;
+		children = NULL;
+		nr_children = 0;
+		max_children = 0;
+
+		/* entries of batch lie in consecutive clusters */
+		for (i = 0, w = 0; i < nr[level]; w++) {
+			rw = &works[w % CCH_INDEX_RESTORE_WORKS];
+			result = cch_index_restore_wait(rw, &children,
+				&nr_children, &max_children);
+			if (result)
+				break;
+
+			first = i;
+			while (i < nr[level] &&
+			       (refs[level][i].offs & cluster_mask) -
+			       (refs[level][first].offs & cluster_mask) <
+			       batch_bytes)
+				i++;
+
+			rw->kind = kind_cluster.signature;
+			rw->level = level;
+			rw->refs = &refs[level][first];
+			rw->nr = i - first;
+			rw->offset = refs[level][first].offs & cluster_mask;
+			rw->clusters = ((refs[level][i - 1].offs &
+					 cluster_mask) - rw->offset) /
+				index->backend_cluster_size + 1;
+			rw->nr_children = 0;
+			rw->busy = true;
+			reinit_completion(&rw->done);
+			queue_work(wq, &rw->work);
+		}
 
-	sBUG_ON(index == NULL);
+		for (w = 0; w < CCH_INDEX_RESTORE_WORKS; w++) {
+			wait_result = cch_index_restore_wait(&works[w],
+				&children, &nr_children, &max_children);
+			if (!result)
+				result = wait_result;
+		}
 
-	mutex_lock(&index->cch_index_value_mutex);
+		TRACE(TRACE_DEBUG, "level %d: %d entries from %llu", level,
+		      nr[level], (unsigned long long) refs[level][0].offs);
 
-	list_for_each_entry(entry, &index->index_lru_list,
-			    index_lru_list_entry) {
-		if (!cch_index_entry_is_lowest_level(entry))
-			continue;
-		/* check if any value is locked */
-		for (i = 0; i < cch_index_entry_size(index, entry); i++) {
-			if (cch_index_check_lock(entry->v[i].value)) {
-				/* can't free index */
-				result = -EBUSY;
-				goto out_spin_unlock;
+		if (level + 1 < index->levels) {
+			refs[level + 1] = children;
+			nr[level + 1] = nr_children;
+		} else {
+			sBUG_ON(nr_children != 0);
+			vfree(children);
+		}
+		if (result)
+			goto out_free_wq;
+
+		if (level + 1 == index->levels)
+			break;
+
+		/* batches of a level go in device order */
+		sort(refs[level + 1], nr[level + 1], sizeof(*refs[level + 1]),
+		     cch_index_restore_ref_cmp, NULL);
+		for (i = 1; i < nr[level + 1]; i++) {
+			if (refs[level + 1][i].offs ==
+			    refs[level + 1][i - 1].offs) {
+				PRINT_ERROR("entry at %llu is referred twice",
+					    (unsigned long long)
+					    refs[level + 1][i].offs);
+				result = -EIO;
+				goto out_free_wq;
 			}
 		}
 	}
 
-	/* FIXME check usage */
-	/* FIXME locking */
-	cch_index_destroy_root_entry(index);
-	kmem_cache_destroy(index->lowest_level_kmem);
-	kmem_cache_destroy(index->mid_level_kmem);
-	kfree(index->levels_desc);
-	kfree(index);
+	cch_index_restore_mark_saved(index, refs, nr);
+
+out_free_wq:
+	destroy_workqueue(wq);
+
+out_free_refs:
+	for (level = 0; level < index->levels; level++)
+		vfree(refs[level]);
+
+out_free_works:
+	for (i = 0; i < CCH_INDEX_RESTORE_WORKS; i++) {
+		vfree(works[i].buf);
+		vfree(works[i].children);
+		kfree(works[i].keys);
+		kfree(works[i].values);
+	}
+	kfree(works);
 
 out:
 	TRACE_EXIT_RES(result);
 	return result;
-
-out_spin_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
-	goto out;
 }
-EXPORT_SYMBOL(cch_index_destroy);
+EXPORT_SYMBOL(cch_index_full_restore);
 
-int cch_index_find(struct cch_index *index, uint64_t key,
-		   void **out_value, struct cch_index_entry **index_entry,
-		   int *value_offset)
-{
-	struct cch_index_entry *current_entry;
-	int result = 0;
-	int lowest_offset = 0;
 
-	TRACE_ENTRY();
+/**
+ * Free saved lowest level entry, parent keeps device offset of it
+ * instead, see cch_index_entry_unloaded(). Parent ref_cnt and bitmap
+ * still count it, so parent is neither freed nor dirty.
+ *
+ * Called under subtree lock once entry is CCH_INDEX_ENTRY_UNLOADING
+ * and lockless inserters are done with it.
+ */
+static void __cch_index_entry_unload(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	struct cch_index_entry *parent = cch_index_entry_get_parent(entry);
+	struct cch_index_entry **slot;
 
-	sBUG_ON(index == NULL);
-	/* we need to dump the result somewhere */
-	sBUG_ON(out_value == NULL);
+	slot = cch_index_entry_child_slot(index, parent, entry->parent_offset);
+	sBUG_ON(slot == NULL || *slot != entry);
+	sBUG_ON(entry->backend_offs == 0);
 
-	mutex_lock(&index->cch_index_value_mutex);
+	/* lookups already in it are done before it's freed */
+	cch_index_skip_clear(index, parent);
+	rcu_assign_pointer(*slot,
+		cch_index_entry_unloaded(entry->backend_offs));
+	atomic_inc(&index->nr_unloaded);
 
-	result = __cch_index_walk_path(index, key, &current_entry);
-	if (result) {
-		*out_value = 0;
-		if (index_entry)
-			*index_entry = NULL;
-		if (value_offset)
-			*value_offset = 0;
-		result = -ENOENT;
-		goto out_unlock;
-	}
+	cch_index_entry_lru_remove(index, entry);
 
-	sBUG_ON(current_entry == NULL);
+	if (index->flags & CCH_INDEX_COMPACT_LEAVES)
+		cch_index_leaf_free(index, entry->v[0].leaf);
+	cch_index_entry_free(index, entry);
 
-	lowest_offset = EXTRACT_LOWEST_OFFSET(index, key);
-	PRINT_INFO("offset is 0x%x", lowest_offset);
-	*out_value = current_entry->v[lowest_offset].value;
+	index->on_entry_free_fn(index, index->lowest_level_entry_size,
+		cch_index_total_bytes_add(index,
+			-index->lowest_level_entry_size));
+}
 
-	cch_index_entry_lru_update(index, current_entry);
+/*
+ * Move up to CCH_INDEX_SHRINK_BATCH saved lowest level entries from
+ * LRU head to @arg picked, about enough to free @arg excess bytes,
+ * and mark them CCH_INDEX_ENTRY_UNLOADING. Entries changed since save
+ * and pinned ones are kept, they go to LRU tail. Subtree locks of
+ * picked entries are set in @arg stripes.
+ *
+ * Picked entry is freed by writers only after they take it off the
+ * list, see cch_index_entry_lru_remove().
+ */
+static int cch_index_shrink_pick(struct cch_index *index,
+	struct list_head *picked, unsigned long *stripes, s64 excess)
+{
+	struct cch_index_entry *entry;
+	LIST_HEAD(changed);
+	unsigned long flags;
+	int nr = 0;
+
+	spin_lock_irqsave(&index->index_lru_list_lock, flags);
+	while (nr < CCH_INDEX_SHRINK_BATCH &&
+	       (s64) nr * index->lowest_level_entry_size < excess) {
+		entry = __cch_index_lru_pick_victim(index);
+		if (entry == NULL)
+			break;
+		if (!cch_index_entry_is_saved(entry) ||
+		    READ_ONCE(entry->pinned)) {
+			list_move_tail(&entry->index_lru_list_entry, &changed);
+			continue;
+		}
+		atomic_add(CCH_INDEX_ENTRY_UNLOADING, &entry->ref_cnt);
+		list_move_tail(&entry->index_lru_list_entry, picked);
+		set_bit(cch_index_entry_root_offset(entry) &
+			(CCH_INDEX_SUBTREE_LOCKS - 1), stripes);
+		nr++;
+	}
+	list_splice_tail(&changed, &index->index_lru_list);
+	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
 
-	if (*out_value != NULL) {
-		result = 0;
+	return nr;
+}
 
-		if (index_entry)
-			*index_entry = current_entry;
-		if (value_offset)
-			*value_offset = lowest_offset;
+/*
+ * Unload entries left in @arg picked by cch_index_shrink_pick().
+ * Entries changed or pinned meanwhile go back to LRU, ones emptied
+ * meanwhile are freed.
+ *
+ * Called under subtree locks of all picked entries.
+ */
+static int __cch_index_shrink_unload(struct cch_index *index,
+	struct list_head *picked)
+{
+	struct cch_index_entry *entry;
+	unsigned long flags;
+	int result = 0;
 
-		PRINT_INFO("found 0x%lx", (long int) *out_value);
+	/* full save may be writing over their clusters */
+	if (atomic_read(&index->full_saves))
+		result = -EBUSY;
+
+	spin_lock_irqsave(&index->index_lru_list_lock, flags);
+	while (!list_empty(picked)) {
+		entry = list_first_entry(picked, struct cch_index_entry,
+			index_lru_list_entry);
+		list_del_init(&entry->index_lru_list_entry);
+		spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
+
+		if (!(atomic_read(&entry->ref_cnt) &
+		      CCH_INDEX_ENTRY_UNLOADING)) {
+			/* kept by writer under the lock */
+			cch_index_entry_lru_add(index, entry);
+		} else if (!result && cch_index_entry_is_saved(entry) &&
+			   !entry->pinned) {
+			__cch_index_entry_unload(index, entry);
+		} else {
+			atomic_sub(CCH_INDEX_ENTRY_UNLOADING, &entry->ref_cnt);
+			cch_index_entry_lru_add(index, entry);
+			/* removers couldn't free it while it was unloading */
+			__cch_index_entry_cleanup(index, entry);
+		}
 
-		cch_index_value_lock(*out_value);
-	} else {
-		result = -ENOENT;
+		spin_lock_irqsave(&index->index_lru_list_lock, flags);
 	}
+	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
 
-out_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
-
-	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(cch_index_find);
-
-int cch_index_insert(struct cch_index *index,
-		     uint64_t key,  /* key of new record */
-		     void *value,   /* value of new record */
-		     bool replace,  /* should replace record under same key
-				     * If not -- -EEXIST
-				     */
 
-		     /* created record */
-		     struct cch_index_entry **new_index_entry,
-		     /* created offset */
-		     int *new_value_offset)
+int cch_index_shrink(struct cch_index *index, int max_mem_kb)
 {
-#ifdef CCH_INDEX_DEBUG
-	int i = 0;
-#endif
+	DECLARE_BITMAP(stripes, CCH_INDEX_SUBTREE_LOCKS);
+	LIST_HEAD(picked);
+	s64 budget, excess;
 	int result = 0;
-	struct cch_index_entry *current_entry = NULL;
-	int record_offset = 0;
+	int i;
 
 	TRACE_ENTRY();
+
 	sBUG_ON(index == NULL);
 
-	mutex_lock(&index->cch_index_value_mutex);
+	budget = (s64) max_mem_kb * 1024;
+	if (cch_index_total_bytes(index) <= budget)
+		goto out;
 
-#ifdef CCH_INDEX_DEBUG
-	PRINT_INFO("key is 0x%.8llx", key);
-	for (i = 0; i < index->levels; i++) {
-		PRINT_INFO("part %d is 0x%.2llx", i,
-			   EXTRACT_BIASED_VALUE(key, index->levels_desc, i));
-	}
-#endif
+	/* only what is on backend already can be dropped */
+	result = cch_index_incremental_save(index);
+	if (result)
+		goto out;
 
-	result = __cch_index_create_path(index, key, &current_entry);
+	cch_index_lru_drain(index);
 
-	if (result)
-		goto out_unlock;
+	for (;;) {
+		excess = cch_index_total_bytes(index) - budget;
+		if (excess <= 0)
+			break;
 
-	sBUG_ON(current_entry == NULL);
+		bitmap_zero(stripes, CCH_INDEX_SUBTREE_LOCKS);
+		if (cch_index_shrink_pick(index, &picked, stripes,
+					  excess) == 0) {
+			/* the rest are mid level entries or changed ones */
+			result = -ENOSPC;
+			break;
+		}
 
-	record_offset = EXTRACT_LOWEST_OFFSET(index, key);
-	PRINT_INFO("computed offset is %d", record_offset);
+		/* lockless inserters that got in before leave entry
+		 * dirty, later ones take subtree lock */
+		synchronize_rcu();
 
-	/* save value to index */
-	result = __cch_index_entry_insert_direct(
-		index, current_entry, record_offset, replace, value);
-	if (result)
-		goto out_unlock;
+		mutex_lock(&index->cch_index_value_mutex);
+		for_each_set_bit(i, stripes, CCH_INDEX_SUBTREE_LOCKS)
+			mutex_lock_nest_lock(&index->subtree_locks[i].mutex,
+					     &index->cch_index_value_mutex);
 
-	if (new_value_offset)
-		*new_value_offset = record_offset;
-	if (new_index_entry)
-		*new_index_entry = current_entry;
+		result = __cch_index_shrink_unload(index, &picked);
 
-	cch_index_entry_lru_update(index, current_entry);
+		for_each_set_bit(i, stripes, CCH_INDEX_SUBTREE_LOCKS)
+			mutex_unlock(&index->subtree_locks[i].mutex);
+		mutex_unlock(&index->cch_index_value_mutex);
 
-out_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
+		if (result)
+			break;
+	}
 
+	TRACE(TRACE_DEBUG, "%d entries unloaded, %lld bytes left",
+	      atomic_read(&index->nr_unloaded),
+	      (long long) cch_index_total_bytes(index));
+
+out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(cch_index_insert);
+EXPORT_SYMBOL(cch_index_shrink);
 
-int cch_index_remove(struct cch_index *index, uint64_t key)
+int cch_index_pin(struct cch_index *index, uint64_t key,
+	struct cch_index_entry **entry)
 {
-	struct cch_index_entry *current_entry;
+	struct mutex *subtree_mutex;
+	int root_offset;
 	int result = 0;
-	int lowest_offset = 0;
 
 	TRACE_ENTRY();
+
 	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
 
-	mutex_lock(&index->cch_index_value_mutex);
+	root_offset = EXTRACT_BIASED_VALUE(key, index->levels_desc, 0);
+	subtree_mutex = cch_index_subtree_mutex(index, root_offset);
+	mutex_lock(subtree_mutex);
 
-	result = __cch_index_walk_path(index, key, &current_entry);
+	result = __cch_index_walk_path(index, key, entry);
+	if (result == -EREMOTE) {
+		result = __cch_index_load_path(index, key);
+		if (!result)
+			result = __cch_index_walk_path(index, key, entry);
+	}
 	if (result)
 		goto out_unlock;
 
-	lowest_offset = EXTRACT_LOWEST_OFFSET(index, key);
-
-	__cch_index_entry_remove_value(index, current_entry, lowest_offset);
-
-	/* we don't want this entry get unloaded while we're touching it */
-	cch_index_entry_lru_update(index, current_entry);
-
-	/* and now we check if some entries should be cleaned up */
-	__cch_index_entry_cleanup(index, current_entry);
+	/* shrink checks it under the lock before unloading */
+	(*entry)->pinned++;
+	(*cch_index_subtree_pins(index, root_offset))++;
 
 out_unlock:
-	mutex_unlock(&index->cch_index_value_mutex);
+	mutex_unlock(subtree_mutex);
 
 	TRACE_EXIT_RES(result);
 	return result;
 }
-EXPORT_SYMBOL(cch_index_remove);
+EXPORT_SYMBOL(cch_index_pin);
 
-int cch_index_full_save(struct cch_index *index)
+void cch_index_unpin(struct cch_index *index, struct cch_index_entry *entry)
 {
-	TRACE_ENTRY();
-
-	sBUG_ON(index == NULL);
-
-	TRACE_EXIT();
-	return -ENOMEM;
-}
-EXPORT_SYMBOL(cch_index_full_save);
+	struct mutex *subtree_mutex;
+	int root_offset;
 
-int cch_index_full_restore(struct cch_index *index)
-{
 	TRACE_ENTRY();
 
 	sBUG_ON(index == NULL);
+	sBUG_ON(entry == NULL);
+	sBUG_ON(!cch_index_entry_is_lowest_level(entry));
 
-	TRACE_EXIT();
-	return -ENOMEM;
-}
-EXPORT_SYMBOL(cch_index_full_restore);
+	root_offset = cch_index_entry_root_offset(entry);
+	subtree_mutex = cch_index_subtree_mutex(index, root_offset);
+	mutex_lock(subtree_mutex);
 
+	sBUG_ON(entry->pinned <= 0);
+	entry->pinned--;
+	(*cch_index_subtree_pins(index, root_offset))--;
 
-int cch_index_shrink(struct cch_index_entry *index, int max_mem_kb)
-{
-	TRACE_ENTRY();
+	/* frees it if records were removed while it was pinned */
+	__cch_index_entry_cleanup(index, entry);
 
-	sBUG_ON(index == 0);
+	mutex_unlock(subtree_mutex);
 
 	TRACE_EXIT();
-	return -ENOMEM;
 }
-EXPORT_SYMBOL(cch_index_shrink);
+EXPORT_SYMBOL(cch_index_unpin);
 
 
 int cch_index_backend_cluster_alloc(struct cch_index *index,
@@ -1604,13 +5539,30 @@ int cch_index_backend_cluster_fill_start(
 
 	TRACE_ENTRY();
 
-	/* zero any current crc32 */
-	memset(cluster->data[index->backend_cluster_size - 4], 0, 4);
+	/* zero entries and any current crc32 */
+	new_cluster->num_entries = 0;
+	memset(new_cluster->data, 0, index->backend_cluster_size -
+	       sizeof(struct cch_backend_cluster));
 
 	TRACE_EXIT_RES(result);
 	return result;
 }
 
+/* device offset of next backend entry of cursor level */
+static uint64_t cch_index_backend_cursor_next(struct cch_index *index,
+	struct cch_backend_level_cursor *cursor)
+{
+	int cluster = cursor->nr / cursor->per_cluster;
+	int slot = cursor->nr % cursor->per_cluster;
+
+	cursor->nr++;
+
+	return cursor->base +
+		(uint64_t) cluster * index->backend_cluster_size +
+		offsetof(struct cch_backend_cluster, data) +
+		slot * cursor->entry_bytes;
+}
+
 /* let's enumerate entries hold by ordinal number.
  * User of this function should not put entries
  * of not the same type as the previous entries were
@@ -1620,41 +5572,94 @@ int cch_index_backend_cluster_fill_put(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster,
 	struct cch_index_entry *entry,
+	uint64_t key,
+	struct cch_backend_level_cursor *children,
 	int *next /* how many records could be fit */)
 {
 	int result = 0;
-	int cch_backend_index_entry *backend_entry;
-	int entry_size = 0;
+	struct cch_backend_index_entry *backend_entry;
+	struct cch_index_entry *child;
+	int entry_size = 0, entry_bytes = 0;
+	int i = 0;
 
 	TRACE_ENTRY();
 
-	entry_size = cch_index_entry_size(entry);
+	entry_size = cch_backend_cluster_entry_size(index, cluster);
+	entry_bytes = cch_backend_index_entry_bytes(entry_size);
+	if (*next >= cch_backend_cluster_capacity(index, cluster)) {
+		result = -ENOSPC;
+		goto out;
+	}
+
+	sBUG_ON(cch_index_entry_size(index, entry) != entry_size);
+
 	backend_entry = (struct cch_backend_index_entry *)
-		cluster->data[entry_size * (*next)];
+		&cluster->data[entry_bytes * (*next)];
 
-	backend_entry->start_offs_key = 0;
+	backend_entry->start_offs_key = key;
 	backend_entry->len = entry_size;
 
-	memcpy(backend_entry->v[0], entry->v[0], entry_size * sizeof(uint64_t));
+	/* records of compact entries are spread to their offsets,
+	 * cluster is zeroed by fill_start */
+	if (cch_index_entry_is_lowest_level(entry)) {
+		for (i = cch_index_entry_next_offset(index, entry, 0);
+		     i < entry_size;
+		     i = cch_index_entry_next_offset(index, entry, i + 1))
+			backend_entry->v[i].value =
+				cch_index_entry_value(index, entry, i);
+	} else {
+		for (i = cch_index_entry_next_child(index, entry, 0);
+		     i < entry_size;
+		     i = cch_index_entry_next_child(index, entry, i + 1)) {
+			child = cch_index_entry_child(index, entry, i);
+			if (child == NULL)
+				continue;
+			if (children != NULL) {
+				backend_entry->v[i].backend_dev_offs =
+					cch_index_backend_cursor_next(index,
+								      children);
+				continue;
+			}
+			/* child is saved already, root is at 0 only */
+			if (cch_index_entry_is_unloaded(child)) {
+				backend_entry->v[i].backend_dev_offs =
+					cch_index_entry_unloaded_offs(child);
+				continue;
+			}
+			sBUG_ON(child->backend_offs == 0);
+			backend_entry->v[i].backend_dev_offs =
+				child->backend_offs;
+		}
+	}
 
 	cluster->num_entries++;
 	*next = *next + 1;
 
+out:
 	TRACE_EXIT_RES(result);
 	return result;
 }
 
+/* crc32 of the rest of cluster lies in its last bytes */
+static inline uint8_t *cch_index_backend_cluster_crc(
+	struct cch_index *index,
+	struct cch_backend_cluster *cluster)
+{
+	return (uint8_t *) cluster + index->backend_cluster_size -
+		sizeof(uint32_t);
+}
+
 int cch_index_backend_cluster_fill_finish(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster)
 {
 	int result = 0;
-	uint32 crc;
+	uint32_t crc;
 
 	TRACE_ENTRY();
 
 	crc = crc32(0, cluster, index->backend_cluster_size - 4);
-	memcpy(&cluster->data[index->backend_cluster_size - 4], &crc, 4);
+	memcpy(cch_index_backend_cluster_crc(index, cluster), &crc, 4);
 
 	TRACE_EXIT_RES(result);
 	return result;
@@ -1665,12 +5670,12 @@ int cch_index_backend_cluster_parse_start(
 	struct cch_backend_cluster *cluster)
 {
 	int result = 0;
-	uint32 crc_computed, crc_read;
+	uint32_t crc_computed, crc_read;
 
 	TRACE_ENTRY();
 
 	crc_computed = crc32(0, cluster, index->backend_cluster_size - 4);
-	memcpy(&crc_read, &cluster->data[index->backend_cluster_size - 4], 4);
+	memcpy(&crc_read, cch_index_backend_cluster_crc(index, cluster), 4);
 
 	if ((crc_computed != crc_read) ||
 	    (cch_backend_cluster_entry_size(index, cluster) == -1)) {
@@ -1679,10 +5684,10 @@ int cch_index_backend_cluster_parse_start(
 		goto out;
 	}
 
-	PRINT_INFO("%d records of size %d in cluster %p",
-		   cluster->num_entries,
-		   cluster,
-		   cch_backend_cluster_entry_size(index, cluster));
+	TRACE(TRACE_DEBUG, "%d records of size %d in cluster %p",
+	      cluster->num_entries,
+	      cch_backend_cluster_entry_size(index, cluster),
+	      cluster);
 
 out:
 	TRACE_EXIT_RES(result);
@@ -1692,51 +5697,38 @@ out:
 int cch_index_backend_cluster_parse_get(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster,
-	struct cch_index_entry *new_entry,
+	struct cch_backend_index_entry **backend_entry,
 	int *next)
 {
 	int result = 0;
-	struct cch_backend_index_entry *backend_entry;
-	struct cch_index_entry *entry;
 	int entry_size = 0;
 
 	TRACE_ENTRY();
 
-	entry_size = cch_backend_cluster_entry_size(index, cluster);
-	backend_entry = (struct cch_backend_index_entry *)
-		cluster->data[entry_size * (*next)];
-
-	if (cch_backend_cluster_is_mid(cluster)) {
-		result = cch_index_create_mid_entry(index,
-			/* parent */,
-			&entry,
-			/* offset */
-			);
-		if (!result)
-			goto out;
-
-		/* hardcheck for operation sanity */
-		sBUG_ON(cch_index_entry_size(index, entry) !=
-			backend_entry->len);
-
-		memcpy(&entry->v[0].value, &backend_entry, backend_entry->len);
-	} else if (cch_backend_cluster_is_lowest(cluster)) {
-		result = cch_index_create_lowest_entry(index,
-			/* parent */,
-			&entry,
-			/* offset */
-			);
-		if (!result)
-			goto out;
+	if (*next >= cluster->num_entries) {
+		result = -ENOENT;
+		goto out;
+	}
 
-		sBUG_ON(cch_index_entry_size(index, entry) !=
-			backend_entry->len);
+	entry_size = cch_backend_cluster_entry_size(index, cluster);
+	if (cluster->num_entries > cch_backend_cluster_capacity(index,
+								cluster)) {
+		PRINT_ERROR("%d records don't fit cluster %p",
+			    cluster->num_entries, cluster);
+		result = -EIO;
+		goto out;
+	}
 
-		memcpy(&entry->v[0].value, &backend_entry, backend_entry->len);
-	} else if (cch_backend_cluster_is_root(cluster)) {
-		/* a very special case, actually */
+	*backend_entry = (struct cch_backend_index_entry *)
+		&cluster->data[cch_backend_index_entry_bytes(entry_size) *
+			       (*next)];
 
-		/* it's time to create an index or something */
+	/* hardcheck for operation sanity */
+	if ((*backend_entry)->len != entry_size) {
+		PRINT_ERROR("record of size %d in cluster %p of size %d",
+			    (*backend_entry)->len, cluster, entry_size);
+		result = -EIO;
+		goto out;
 	}
 
 	*next = *next + 1;
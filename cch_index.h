@@ -5,10 +5,74 @@
 #include <linux/spinlock.h>
 #include <linux/list.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
 
-/* alignment for kmem_cache */
-#define CCH_INDEX_LOW_LEVEL_ALIGN 8
-#define CCH_INDEX_MID_LEVEL_ALIGN 8
+/* alignment for kmem_cache, entry v[] starts at cache line */
+#define CCH_INDEX_LOW_LEVEL_ALIGN L1_CACHE_BYTES
+#define CCH_INDEX_MID_LEVEL_ALIGN L1_CACHE_BYTES
+
+/* number of writer locks, root level entry slots are striped over them.
+ * Should be power of 2 */
+#define CCH_INDEX_SUBTREE_LOCKS 64
+
+/* LRU touches buffered per cpu before being applied to index_lru_list */
+#define CCH_INDEX_LRU_BATCH 15
+
+/* root, mid and lowest levels together */
+#define CCH_INDEX_MAX_LEVELS 16
+
+/* keys walked side by side by cch_index_find_batch() */
+#define CCH_INDEX_FIND_BATCH 16
+
+/* clusters passed to one write_cluster_data_fn call by full save
+ * and to one read_cluster_data_fn call by full restore */
+#define CCH_INDEX_SAVE_CLUSTERS 16
+
+/* batches of clusters read and parsed at once by full restore */
+#define CCH_INDEX_RESTORE_WORKS 8
+
+/* lowest level entries unloaded after one RCU grace period by shrink */
+#define CCH_INDEX_SHRINK_BATCH 64
+
+/*
+ * Geometries which get lookup walk with constant shifts and unrolled
+ * descent, see __cch_index_walk_path(). g(number, levels, bits,
+ * root_bits, low_bits) per cch_index_create() arguments, number
+ * starts from 1. Other geometries use generic walk.
+ */
+#define CCH_INDEX_GEOMETRIES(g)			\
+	g(1, 6, 64, 8, 8)			\
+	g(2, 2, 32, 8, 8)
+
+/* cch_index_create() flags */
+
+/* keep index_lru_list in CLOCK order instead of strict LRU one */
+#define CCH_INDEX_CLOCK_EVICTION (1UL << 0)
+/* entry alloc/free callbacks get exact total summed over all CPUs
+ * instead of approximate one, see cch_index_total_bytes() */
+#define CCH_INDEX_EXACT_ACCOUNTING (1UL << 1)
+/* keep sparse lowest level entries in compact tables, see
+ * struct cch_index_leaf. Inserts always take subtree lock then */
+#define CCH_INDEX_COMPACT_LEAVES (1UL << 2)
+
+/* keep mid level entries with few children in compact form and skip
+ * chains of single child ones on lookup, see struct cch_index_skip */
+#define CCH_INDEX_COMPACT_MID (1UL << 3)
+/* lowest level entries start as runs of values growing by the same
+ * step, see struct cch_index_leaf_run. Implies CCH_INDEX_COMPACT_LEAVES */
+#define CCH_INDEX_EXTENT_LEAVES (1UL << 4)
+
+/* records in compact lowest level entry table, back to compact
+ * table when dense one has half of it */
+#define CCH_INDEX_COMPACT_LEAF_SIZE 16
+/* children of compact mid level entry */
+#define CCH_INDEX_COMPACT_MID_SIZE 16
+/* runs of extent table, it takes place of compact one */
+#define CCH_INDEX_EXTENT_RUNS 4
 
 /*
 1. cch_index_start_full_save_fn(struct cch_index *index) - this function would
@@ -50,6 +114,7 @@ typedef int (*cch_index_read_cluster_data_fn_t)(
 typedef int (*cch_index_start_transaction_fn_t)(struct cch_index *index);
 typedef int (*cch_index_finish_transaction_fn_t)(struct cch_index *index);
 
+/* new_size is approximate total unless CCH_INDEX_EXACT_ACCOUNTING */
 typedef void (*cch_index_on_new_entry_alloc_fn_t)(struct cch_index *index,
 	int inc_size, int new_size);
 typedef void (*cch_index_on_entry_free_fn_t)(struct cch_index *index,
@@ -85,29 +150,108 @@ extern int cch_index_value_unlock(void *value);
 
 #endif
 
+/* set in ref_cnt of entry being freed, values can't be added anymore */
+#define CCH_INDEX_ENTRY_DEAD (1 << 30)
+/* same for entry being unloaded by cch_index_shrink(), which still
+ * has its values and stays if writer under subtree lock clears it */
+#define CCH_INDEX_ENTRY_UNLOADING (1 << 29)
+
+struct cch_index_leaf;
+
+/*
+ * Header fits one cache line on 64 bit, fields used by lookups and
+ * inserts go first. v[] starts at the next cache line, entries are
+ * allocated cache line aligned.
+ */
 struct cch_index_entry {
-	#ifdef CCH_INDEX_DEBUG
-	int magic;
-	#endif
-	/* how many entries inside / how many children entries */
-	int ref_cnt;
+	/* how many entries inside / how many children entries,
+	 * CCH_INDEX_ENTRY_DEAD once entry is being freed */
+	atomic_t ref_cnt;
+	/* children of compact mid level entry, -1 for full one and root */
+	int nr;
 	/* NULL for root,
 	   bit "0" for lowest_entry
 	   bit "1" for locked flag
 	   bit "2" for saved flag
 	 */
 	struct cch_index_entry *parent;
-	struct list_head index_lru_list_entry;
-
+	/* owner of kmem_cache this entry is freed to */
+	struct cch_index *index;
 	/* index of this entry in parent->v[] table for
 	 * leaf-to-root traversal */
 	int parent_offset;
+	union {
+		/* accessed since last pass of clock hand,
+		 * CCH_INDEX_CLOCK_EVICTION */
+		int referenced;
+		/* times it's in per-cpu LRU buffers otherwise */
+		atomic_t lru_buffered;
+	};
+	/* cch_index_pin() count of lowest level entry, under subtree lock */
+	int pinned;
+	/* device offset of backend entry it was last saved to,
+	 * 0 if never saved, see ENTRY_SAVED_BIT */
+	uint64_t backend_offs;
+	#ifdef CCH_INDEX_DEBUG
+	int magic;
+	#endif
+
+	union {
+		/* lowest level entries only, till they are removed */
+		struct list_head index_lru_list_entry;
+		/* entries are freed after RCU grace period as lookups
+		 * walk the index without any lock */
+		struct rcu_head rcu_head;
+	};
 
 	union {
 		uint64_t backend_dev_offs;
 		struct cch_index_entry *entry;
 		void *value;
-	} v[];
+		/* the only record of lowest level entry
+		 * with CCH_INDEX_COMPACT_LEAVES */
+		struct cch_index_leaf *leaf;
+	} v[] ____cacheline_aligned;
+};
+
+/* struct cch_index_leaf formats */
+#define CCH_INDEX_LEAF_COMPACT 0
+#define CCH_INDEX_LEAF_DENSE 1
+#define CCH_INDEX_LEAF_EXTENT 2
+
+/*
+ * Records of lowest level entry with CCH_INDEX_COMPACT_LEAVES.
+ * Mostly empty entry keeps few records in compact table and is
+ * switched to dense one when they don't fit. Table is replaced
+ * as a whole under subtree lock and freed after RCU grace period,
+ * so entry itself keeps its address for *_direct calls.
+ */
+struct cch_index_leaf {
+	struct rcu_head rcu_head;
+	struct cch_index *index;
+	/* CCH_INDEX_LEAF_* */
+	int format;
+	/* used keys[] of compact table, runs of extent one */
+	int nr;
+	/* compact: sorted offsets of values[], value may be NULL */
+	uint16_t keys[CCH_INDEX_COMPACT_LEAF_SIZE];
+	/* compact: CCH_INDEX_COMPACT_LEAF_SIZE records, dense: offset
+	 * addressed records followed by occupancy bitmap, extent:
+	 * struct cch_index_leaf_run array */
+	void *values[];
+};
+
+/*
+ * Values base, base + stride, base + 2 * stride, ... at offsets
+ * starting from start. Extent table keeps sorted runs with gaps
+ * between them, last run and the runs count only grow in place.
+ * Other changes turn the table into compact or dense one.
+ */
+struct cch_index_leaf_run {
+	int start;
+	int len;
+	unsigned long base;
+	long stride;
 };
 
 /*
@@ -124,11 +268,47 @@ struct cch_level_desc_entry {
 	int offset;
 };
 
+/*
+ * Writer lock for all subtrees hanging off root level slots
+ * that are equal modulo CCH_INDEX_SUBTREE_LOCKS.
+ */
+struct cch_index_subtree_lock {
+	struct mutex mutex;
+	/* cch_index_pin() count of entries under it */
+	int nr_pinned;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Per-cpu buffer of recently touched lowest level entries, so that
+ * lookup hit doesn't write shared LRU list. Entries are moved
+ * to LRU tail in batches by cch_index_lru_pvec_drain().
+ */
+struct cch_index_lru_pvec {
+	spinlock_t lock;
+	int nr;
+	struct cch_index_entry *entries[CCH_INDEX_LRU_BATCH];
+};
+
 struct cch_index {
+	/* taken by cch_index_destroy(). Readers walk the index
+	 * under rcu_read_lock() */
 	struct mutex cch_index_value_mutex;
 
+	/* writers take lock of subtree they modify */
+	struct cch_index_subtree_lock subtree_locks[CCH_INDEX_SUBTREE_LOCKS];
+
 	spinlock_t index_lru_list_lock;
 	struct list_head index_lru_list;
+	struct cch_index_lru_pvec __percpu *lru_pvecs;
+
+	/* CCH_INDEX_* flags given to cch_index_create() */
+	unsigned long flags;
+
+	/* number in CCH_INDEX_GEOMETRIES, 0 for generic walk */
+	int geometry;
+
+	/* changed on every entry free, see struct cch_index_finger */
+	atomic_long_t free_generation;
 
 	/* total number of levels -- levels + 1 for root + 1 for lowest */
 	int levels;
@@ -142,18 +322,41 @@ struct cch_index {
 	/* size of each kmem_cache_zalloc */
 	int lowest_level_entry_size;
 	int mid_level_entry_size;
+	int compact_mid_entry_size;
+	/* struct cch_index_leaf, CCH_INDEX_COMPACT_LEAVES */
+	int compact_leaf_size;
+	int dense_leaf_size;
 
 	/* array, describing each level of index */
 	struct cch_level_desc_entry *levels_desc;
 
 	struct kmem_cache *mid_level_kmem;
+	struct kmem_cache *compact_mid_kmem;
 	struct kmem_cache *lowest_level_kmem;
+	struct kmem_cache *compact_leaf_kmem;
+	struct kmem_cache *dense_leaf_kmem;
 
-	/* backend stuff */
+	/* backend stuff, cluster size is power of 2 or 0 when
+	 * entries don't fit any cluster */
 	int backend_cluster_size;
+	/* end of saved data, 0 before first full save */
+	uint64_t backend_end;
+	/* lowest level entries left on backend by cch_index_shrink() */
+	atomic_t nr_unloaded;
+	/* one save at a time, they write outside of subtree locks */
+	struct mutex save_mutex;
+	/* full saves overwriting saved data, nothing is unloaded meanwhile */
+	atomic_t full_saves;
+	/* changed by full save, which may rewrite any cluster */
+	unsigned long save_generation;
+	/* clusters being read for unloaded entries, see
+	 * cch_index_fault_get() */
+	spinlock_t fault_lock;
+	struct list_head faults;
 	struct kmem_cache *backend_cluster_kmem;
 
-	atomic_t total_bytes;
+	/* memory taken by index entries, see cch_index_total_bytes() */
+	struct percpu_counter total_bytes;
 
 	cch_index_on_new_entry_alloc_fn_t on_new_entry_alloc_fn;
 	cch_index_on_entry_free_fn_t on_entry_free_fn;
@@ -199,28 +402,56 @@ struct cch_backend_cluster {
 	 * signature are here in this cluster */
 	int num_entries;
 
-	uint8_t data[];
+	uint8_t data[] __aligned(8);
 
 	/* some padding */
 
 	/* 4 bytes of crc32 */
 };
 
+/* cluster bytes that can't hold backend entries */
+#define CCH_INDEX_BACKEND_CLUSTER_OVERHEAD \
+	(sizeof(struct cch_backend_cluster) + sizeof(uint32_t))
+
+/*
+ * Device offsets of consecutive backend entries of one level,
+ * packed by per_cluster into clusters starting from base. Backend
+ * entry is referred by its own device offset, not its cluster one.
+ */
+struct cch_backend_level_cursor {
+	uint64_t base;
+	int entry_bytes;
+	int per_cluster;
+	/* entries taken so far */
+	int nr;
+};
+
 /* alloc a new empty cluster usable for reading and writing */
 int cch_index_backend_cluster_alloc(
 	struct cch_index *index,
 	uint64_t kind, /* kind is a signature */
 	struct cch_backend_cluster **new_cluster);
 
+/* empty cluster of kind given by signature, for cluster_alloc()
+ * ones or clusters inside of bigger write buffer */
 int cch_index_backend_cluster_fill_start(
 	struct cch_index *index,
 	struct cch_backend_cluster *new_cluster);
 
-/* -ENOSPC when full */
+/*
+ * Put entry with first key @arg key to cluster at position *next.
+ * Children of mid level entry are referred by device offsets taken
+ * from @arg children or, when it's NULL, by backend_offs they were
+ * saved to.
+ *
+ * -ENOSPC when full
+ */
 int cch_index_backend_cluster_fill_put(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster,
 	struct cch_index_entry *entry,
+	uint64_t key,
+	struct cch_backend_level_cursor *children,
 	int *next /* how many records could be fit */);
 
 /* finalize cluster after all entries are added */
@@ -240,16 +471,18 @@ int cch_index_backend_cluster_parse_start(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster);
 
-/* 
+/*
  * -ENOENT when there is no next entry thus
- * cluster is parsed fully
- * 
- * Inserts the read entry to index, returning a pointer to it.
+ * cluster is parsed fully, -EIO when entry doesn't
+ * match index geometry.
+ *
+ * Returns backend entry at position *next in place,
+ * records of lowest level ones are inserted by caller.
  */
 int cch_index_backend_cluster_parse_get(
 	struct cch_index *index,
 	struct cch_backend_cluster *cluster,
-	struct cch_index_entry *new_entry,
+	struct cch_backend_index_entry **backend_entry,
 	int *next);
 
 /* nothing to do here yet */
@@ -290,12 +523,30 @@ static inline int cch_backend_cluster_entry_size(
 	} else if (cluster->signature == CCH_INDEX_BACKEND_CLUSTER_LOW) {
 		size = index->levels_desc[index->lowest_level].size;
 	} else if (cluster->signature == CCH_INDEX_BACKEND_CLUSTER_ROOT) {
-		size = index->evels_desc[index->root_level].size;	
+		size = index->levels_desc[index->root_level].size;
 	} else
 		size = -1;
 	return size;
 }
 
+/* bytes taken by backend entry with given number of records */
+static inline int cch_backend_index_entry_bytes(int size)
+{
+	return sizeof(struct cch_backend_index_entry) +
+		size * sizeof(uint64_t);
+}
+
+/* how many backend entries of cluster kind fit one cluster */
+static inline int cch_backend_cluster_capacity(
+	struct cch_index *index,
+	struct cch_backend_cluster *cluster)
+{
+	return (index->backend_cluster_size -
+		CCH_INDEX_BACKEND_CLUSTER_OVERHEAD) /
+		cch_backend_index_entry_bytes(
+			cch_backend_cluster_entry_size(index, cluster));
+}
+
 /**
  * extract part of key that describes i-th level of index,
  * it can be used as offset of v[] table of index entry
@@ -309,32 +560,22 @@ static inline int cch_backend_cluster_entry_size(
 
 #define ENTRY_LOWEST_ENTRY_BIT (1UL << 0)
 #define ENTRY_LOCKED_BIT (1UL << 1)
-#define ENTRY_SAVED_BIT (1UL << 2)
+#define ENTRY_SAVED_BIT_NR 2
+#define ENTRY_SAVED_BIT (1UL << ENTRY_SAVED_BIT_NR)
 
-static inline void cch_index_entry_lru_update(
-	struct cch_index *index,
-	struct cch_index_entry *entry)
-{
-	unsigned long flags;
 
-	/* update LRU */
-	spin_lock_irqsave(&(index->index_lru_list_lock), flags);
-	list_move_tail(&(entry->index_lru_list_entry),
-		       &(index->index_lru_list));
-	spin_unlock_irqrestore(&(index->index_lru_list_lock), flags);
-}
+/* apply all buffered LRU touches, for those who need exact LRU order */
+void cch_index_lru_drain(struct cch_index *index);
 
-/* remove entry from LRU list. Required on entry removal */
-static inline void cch_index_entry_lru_remove(
-	struct cch_index *index,
-	struct cch_index_entry *entry)
-{
-	unsigned long flags;
+/* least recently used lowest level entry, under index_lru_list_lock */
+struct cch_index_entry *__cch_index_lru_pick_victim(struct cch_index *index);
 
-	spin_lock_irqsave(&(index->index_lru_list_lock), flags);
-	list_del(&(entry->index_lru_list_entry));
-	spin_unlock_irqrestore(&(index->index_lru_list_lock), flags);
-}
+/*
+ * Load unloaded lowest level entry of @arg key back, for lookups
+ * that walked into it. -ENOENT if there is no such entry anymore.
+ * Concurrent callers for entries of one cluster share its read.
+ */
+int __cch_index_fault_in(struct cch_index *index, uint64_t key);
 
 static inline int cch_index_entry_is_root(struct cch_index_entry *entry)
 {
@@ -370,10 +611,10 @@ static inline void cch_index_entry_set_locked(struct cch_index_entry *entry)
 		(((unsigned long) entry->parent) | ENTRY_LOCKED_BIT);
 }
 
+/* saved bit is cleared by lockless inserters, so it's changed atomically */
 static inline void cch_index_entry_set_saved(struct cch_index_entry *entry)
 {
-	entry->parent = (struct cch_index_entry *)
-		(((unsigned long) entry->parent) | ENTRY_SAVED_BIT);
+	set_bit(ENTRY_SAVED_BIT_NR, (unsigned long *) &entry->parent);
 }
 
 static inline void cch_index_entry_clear_locked(struct cch_index_entry *entry)
@@ -384,8 +625,7 @@ static inline void cch_index_entry_clear_locked(struct cch_index_entry *entry)
 
 static inline void cch_index_entry_clear_saved(struct cch_index_entry *entry)
 {
-	entry->parent = (struct cch_index_entry *)
-		(((unsigned long) entry->parent) & ~ENTRY_SAVED_BIT);
+	clear_bit(ENTRY_SAVED_BIT_NR, (unsigned long *) &entry->parent);
 }
 
 static inline struct cch_index_entry
@@ -393,7 +633,36 @@ static inline struct cch_index_entry
 {
 	/* ENTRY_SAVED_BIT is last in order */
 	return (struct cch_index_entry *)
-		(((unsigned long) entry->parent) & ~(ENTRY_SAVED_BIT - 1));
+		(((unsigned long) entry->parent) &
+		 ~((ENTRY_SAVED_BIT << 1) - 1));
+}
+
+/* move entry to other parent, flag bits are kept */
+static inline void cch_index_entry_set_parent(struct cch_index_entry *entry,
+	struct cch_index_entry *parent)
+{
+	unsigned long old, new;
+
+	do {
+		old = (unsigned long) READ_ONCE(entry->parent);
+		new = ((unsigned long) parent) |
+			(old & ((ENTRY_SAVED_BIT << 1) - 1));
+	} while (cmpxchg((unsigned long *) &entry->parent, old, new) != old);
+}
+
+/*
+ * Entry and so its parents differ from what was saved, see
+ * cch_index_incremental_save(). Root entry is always saved.
+ */
+static inline void cch_index_entry_mark_dirty(struct cch_index_entry *entry)
+{
+	while (!cch_index_entry_is_root(entry)) {
+		/* upper entries are shared by all writers, their cache
+		 * lines aren't written when they are dirty already */
+		if (cch_index_entry_is_saved(entry))
+			cch_index_entry_clear_saved(entry);
+		entry = cch_index_entry_get_parent(entry);
+	}
 }
 
 /* is entry unloaded to backing store */
@@ -403,6 +672,18 @@ static inline int cch_index_entry_is_unloaded(struct cch_index_entry *entry)
 	return (int) (((unsigned long) entry) & 0x1);
 }
 
+/* parent v[] slot value of entry unloaded to given device offset */
+static inline struct cch_index_entry *cch_index_entry_unloaded(uint64_t offs)
+{
+	return (struct cch_index_entry *) (unsigned long) (offs | 0x1);
+}
+
+static inline uint64_t cch_index_entry_unloaded_offs(
+	struct cch_index_entry *entry)
+{
+	return ((unsigned long) entry) & ~0x1UL;
+}
+
 /* create and load */
 
 /*
@@ -422,11 +703,292 @@ static inline int cch_index_entry_size(struct cch_index *index,
 	return size;
 }
 
+/**
+ * Occupancy bitmap of entry v[] table, lies right after it. Bit is
+ * set for every non-NULL slot, it may also be set for an empty one
+ * for a moment, so scans check the slot itself.
+ */
+static inline unsigned long *cch_index_entry_bitmap(struct cch_index *index,
+	struct cch_index_entry *entry)
+{
+	return (unsigned long *) &entry->v[cch_index_entry_size(index, entry)];
+}
+
+static inline int cch_index_leaf_is_dense(struct cch_index_leaf *leaf)
+{
+	return leaf->format == CCH_INDEX_LEAF_DENSE;
+}
+
+static inline int cch_index_leaf_is_extent(struct cch_index_leaf *leaf)
+{
+	return leaf->format == CCH_INDEX_LEAF_EXTENT;
+}
+
+static inline struct cch_index_leaf_run *cch_index_leaf_runs(
+	struct cch_index_leaf *leaf)
+{
+	return (struct cch_index_leaf_run *) leaf->values;
+}
+
+/**
+ * Occupancy bitmap of lowest level entry records, NULL when they
+ * are in compact or extent table.
+ */
+static inline unsigned long *cch_index_entry_value_bitmap(
+	struct cch_index *index, struct cch_index_entry *entry)
+{
+	struct cch_index_leaf *leaf;
+
+	if (likely(!(index->flags & CCH_INDEX_COMPACT_LEAVES)))
+		return cch_index_entry_bitmap(index, entry);
+
+	leaf = rcu_dereference(entry->v[0].leaf);
+	if (!cch_index_leaf_is_dense(leaf))
+		return NULL;
+	return (unsigned long *)
+		&leaf->values[cch_index_entry_size(index, entry)];
+}
+
+/* position of offset in sorted keys of compact table or entry,
+ * or where it should be put */
+static inline int cch_index_keys_search(const uint16_t *keys, int nr,
+	int offset)
+{
+	int lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (keys[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* record slot of dense or compact table, NULL for extent one */
+static inline void **cch_index_leaf_value_slot(struct cch_index_leaf *leaf,
+	int offset)
+{
+	int i;
+
+	if (cch_index_leaf_is_dense(leaf))
+		return &leaf->values[offset];
+	if (cch_index_leaf_is_extent(leaf))
+		return NULL;
+
+	i = cch_index_keys_search(leaf->keys, leaf->nr, offset);
+	if (i == leaf->nr || leaf->keys[i] != offset)
+		return NULL;
+	return &leaf->values[i];
+}
+
+/**
+ * Place of record at given offset of lowest level entry, NULL when
+ * compact table has none for it or the table is extent one. Called
+ * under rcu_read_lock() or subtree lock, the slot is valid till they
+ * are released.
+ */
+static inline void **cch_index_entry_value_slot(struct cch_index *index,
+	struct cch_index_entry *entry, int offset)
+{
+	if (likely(!(index->flags & CCH_INDEX_COMPACT_LEAVES)))
+		return &entry->v[offset].value;
+
+	return cch_index_leaf_value_slot(rcu_dereference(entry->v[0].leaf),
+					 offset);
+}
+
+/* value computed by run of extent table, NULL if offset isn't in any */
+static inline void *cch_index_leaf_extent_value(struct cch_index_leaf *leaf,
+	int offset)
+{
+	struct cch_index_leaf_run *run = cch_index_leaf_runs(leaf);
+	int nr = leaf->nr;
+	int i, len;
+
+	/* runs and their lengths are grown after they are filled */
+	smp_rmb();
+	for (i = 0; i < nr && offset >= run[i].start; i++) {
+		len = run[i].len;
+		smp_rmb();
+		if (offset < run[i].start + len)
+			return (void *) (run[i].base + (unsigned long)
+				((offset - run[i].start) * run[i].stride));
+	}
+	return NULL;
+}
+
+/**
+ * Value at given offset of lowest level entry, NULL if there is none.
+ * Called under rcu_read_lock() or subtree lock.
+ */
+static inline void *cch_index_entry_value(struct cch_index *index,
+	struct cch_index_entry *entry, int offset)
+{
+	struct cch_index_leaf *leaf;
+	void **slot;
+
+	if (likely(!(index->flags & CCH_INDEX_COMPACT_LEAVES)))
+		return rcu_dereference(entry->v[offset].value);
+
+	leaf = rcu_dereference(entry->v[0].leaf);
+	if (cch_index_leaf_is_extent(leaf))
+		return cch_index_leaf_extent_value(leaf, offset);
+
+	slot = cch_index_leaf_value_slot(leaf, offset);
+	return slot ? rcu_dereference(*slot) : NULL;
+}
+
+/**
+ * First offset not less than given one that may hold a record of
+ * lowest level entry, entry size if there is none. Check the value.
+ */
+static inline int cch_index_entry_next_offset(struct cch_index *index,
+	struct cch_index_entry *entry, int offset)
+{
+	struct cch_index_leaf *leaf;
+	struct cch_index_leaf_run *run;
+	int size = cch_index_entry_size(index, entry);
+	int i, nr;
+
+	if (likely(!(index->flags & CCH_INDEX_COMPACT_LEAVES)))
+		return find_next_bit(cch_index_entry_bitmap(index, entry),
+				     size, offset);
+
+	leaf = rcu_dereference(entry->v[0].leaf);
+	if (cch_index_leaf_is_dense(leaf))
+		return find_next_bit((unsigned long *) &leaf->values[size],
+				     size, offset);
+
+	if (cch_index_leaf_is_extent(leaf)) {
+		run = cch_index_leaf_runs(leaf);
+		nr = leaf->nr;
+		smp_rmb();
+		for (i = 0; i < nr; i++) {
+			if (offset < run[i].start)
+				return run[i].start;
+			if (offset < run[i].start + run[i].len)
+				return offset;
+		}
+		return size;
+	}
+
+	i = cch_index_keys_search(leaf->keys, leaf->nr, offset);
+	return i < leaf->nr ? leaf->keys[i] : size;
+}
+
+/*
+ * Compact mid level entry holds up to CCH_INDEX_COMPACT_MID_SIZE
+ * children in v[], followed by sorted offsets they have in full one.
+ * It's replaced by a bigger copy under subtree lock when a child with
+ * new offset is added, so offsets never change while it's visible.
+ */
+static inline int cch_index_entry_is_compact(struct cch_index_entry *entry)
+{
+	return entry->nr >= 0;
+}
+
+static inline uint16_t *cch_index_entry_keys(struct cch_index_entry *entry)
+{
+	return (uint16_t *) &entry->v[CCH_INDEX_COMPACT_MID_SIZE];
+}
+
+/*
+ * Path compression of compact mid level entry, follows its offsets.
+ * Entry with single child, which leads by single child compact
+ * entries to @target at least two levels below, points to it, so
+ * lookups go there at once. Keys under @target have @key in @mask
+ * bits. Set and cleared under subtree lock, see cch_index_skip_set().
+ */
+struct cch_index_skip {
+	struct cch_index_entry *target;
+	uint64_t key;
+	uint64_t mask;
+	int level;
+};
+
+static inline struct cch_index_skip *cch_index_entry_skip(
+	struct cch_index_entry *entry)
+{
+	return (struct cch_index_skip *)
+		&cch_index_entry_keys(entry)[CCH_INDEX_COMPACT_MID_SIZE];
+}
+
+/**
+ * Place of child at given offset of mid level or root entry, NULL
+ * when compact entry has none for it. Called under rcu_read_lock()
+ * or subtree lock.
+ */
+static inline struct cch_index_entry **cch_index_entry_child_slot(
+	struct cch_index *index, struct cch_index_entry *entry, int offset)
+{
+	uint16_t *keys;
+	int i;
+
+	if (likely(!cch_index_entry_is_compact(entry)))
+		return &entry->v[offset].entry;
+
+	keys = cch_index_entry_keys(entry);
+	i = cch_index_keys_search(keys, entry->nr, offset);
+	if (i == entry->nr || keys[i] != offset)
+		return NULL;
+	return &entry->v[i].entry;
+}
+
+/* same as cch_index_entry_next_offset() for children */
+static inline int cch_index_entry_next_child(struct cch_index *index,
+	struct cch_index_entry *entry, int offset)
+{
+	int size = cch_index_entry_size(index, entry);
+	uint16_t *keys;
+	int i;
+
+	if (likely(!cch_index_entry_is_compact(entry)))
+		return find_next_bit(cch_index_entry_bitmap(index, entry),
+				     size, offset);
+
+	keys = cch_index_entry_keys(entry);
+	i = cch_index_keys_search(keys, entry->nr, offset);
+	return i < entry->nr ? keys[i] : size;
+}
+
+/* child at given offset, see cch_index_entry_child_slot() */
+static inline struct cch_index_entry *cch_index_entry_child(
+	struct cch_index *index, struct cch_index_entry *entry, int offset)
+{
+	struct cch_index_entry **slot;
+
+	slot = cch_index_entry_child_slot(index, entry, offset);
+	return slot ? rcu_dereference(*slot) : NULL;
+}
+
+/**
+ * Key bits addressed by given level and all levels below it,
+ * keys under one entry of that level differ only in these bits
+ */
+static inline uint64_t cch_index_level_span_mask(struct cch_index *index,
+	int level)
+{
+	struct cch_level_desc_entry *desc = &index->levels_desc[level];
+
+	if (desc->offset + desc->bits >= 64)
+		return ~0ULL;
+	return (1ULL << (desc->offset + desc->bits)) - 1;
+}
+
+/* largest key index can hold */
+static inline uint64_t cch_index_max_key(struct cch_index *index)
+{
+	return cch_index_level_span_mask(index, 0);
+}
+
 int cch_index_create(
 	int levels,
 	int bits,
 	int root_bits,
 	int low_bits,
+	unsigned long flags,
 
 	cch_index_on_new_entry_alloc_fn_t on_new_entry_alloc_fn,
 	cch_index_on_entry_free_fn_t on_entry_free_fn,
@@ -442,15 +1004,78 @@ int cch_index_create(
 
 	struct cch_index **out);
 
+/*
+ * Path of last lookup done with it, so next lookup of a near key
+ * starts from the deepest shared entry instead of root. Used by one
+ * caller at a time. Path is trusted only if no entry was freed since
+ * it was walked.
+ */
+struct cch_index_finger {
+	struct cch_index *index;
+	/* index->free_generation at the time of walk */
+	unsigned long generation;
+	uint64_t key;
+	/* path[0] is root entry, path[level] valid for level < depth */
+	int depth;
+	struct cch_index_entry *path[CCH_INDEX_MAX_LEVELS];
+};
+
+void cch_index_finger_init(struct cch_index *index,
+			   struct cch_index_finger *finger);
+
+/*
+ * Same as cch_index_find(), walking from the path saved
+ * in @arg finger and saving the new one there.
+ */
+int cch_index_find_finger(struct cch_index_finger *finger, uint64_t key,
+			  void **out_value,
+			  struct cch_index_entry **index_entry,
+			  int *value_offset);
+
+/*
+ * Cursor over index records in key order. Records of one lowest
+ * level entry are copied under rcu_read_lock() at a time, so writers
+ * aren't held off by long scans. Records changed after their
+ * entry was copied may or may not be seen.
+ */
+struct cch_index_iter {
+	struct cch_index *index;
+	/* next key to look for in the index */
+	uint64_t key;
+	/* there are no keys after buffered ones */
+	bool end;
+
+	/* buffered records, each value locked with cch_index_value_lock() */
+	int nr;
+	int pos;
+	uint64_t *keys;
+	void **values;
+};
+
+/* position iterator at first record with key not less than @arg key */
+int cch_index_iter_start(struct cch_index *index,
+			 struct cch_index_iter *iter, uint64_t key);
+/* next record, -ENOENT after the last one */
+int cch_index_iter_next(struct cch_index_iter *iter,
+			uint64_t *key, void **value);
+/* unlocks records that weren't returned by cch_index_iter_next() */
+void cch_index_iter_stop(struct cch_index_iter *iter);
+
 /* destroy, deallocate, don't allow used index*/
 int cch_index_destroy(struct cch_index *index);
 
+/* exact memory taken by index entries, sums all per-cpu deltas */
+s64 cch_index_total_bytes(struct cch_index *index);
+
 /* search */
 
 /*
  * Search on key. Found result to out_value,
  * save index entry for sibling access, value_offset of record
  * inside that index entry
+ *
+ * Lookups don't take any index lock, cch_index_value_lock()
+ * is called under rcu_read_lock() and must not sleep.
  */
 int cch_index_find(struct cch_index *index, uint64_t key,
 		   void **out_value, struct cch_index_entry **index_entry,
@@ -467,6 +1092,9 @@ int cch_index_find(struct cch_index *index, uint64_t key,
  * index entry into *value offset location. Those values can be used
  * later for subsequent calls to cch_index_find_direct(). Next index
  * entry and/or value offset can be NULL.
+ *
+ * Offset may point anywhere before or after given entry, only
+ * the path below common parent of both entries is walked.
  */
 int cch_index_find_direct(
 	struct cch_index *index,
@@ -475,6 +1103,17 @@ int cch_index_find_direct(
 	struct cch_index_entry **next_index_entry,
 	int *value_offset);
 
+/*
+ * Search on n keys at once. values[i] gets value for keys[i]
+ * or NULL if there is no such key. Keys are walked level by level
+ * together, so cache misses of each level overlap.
+ *
+ * Returns number of found values, each of them is locked with
+ * cch_index_value_lock() as in cch_index_find().
+ */
+int cch_index_find_batch(struct cch_index *index, const uint64_t *keys,
+			 int n, void **values);
+
 /* insertion */
 
 int cch_index_insert(struct cch_index *index,
@@ -487,8 +1126,21 @@ int cch_index_insert(struct cch_index *index,
 		     struct cch_index_entry **new_index_entry,
 		     int *new_value_offset);  /* created offset */
 
+/*
+ * Insert n records, keys should be sorted for speed. Path is created
+ * once per lowest level entry, subtree lock is switched only when
+ * root slot changes. Stops on first error, number of inserted
+ * records goes to *inserted, which can be NULL.
+ */
+int cch_index_insert_batch(struct cch_index *index,
+			   const uint64_t *keys, void **values, int n,
+			   bool replace, int *inserted);
+
 /* insert to given entry with given offset.
- * If offset too high, insert to sibling, update the offset and entry
+ * If offset too high (or negative), insert to following (preceding)
+ * entry, creating it if needed, update the offset and entry.
+ * If entry is being freed or unloaded meanwhile, it's cch_index_insert()
+ * of the key at offset, so entry may be a new one.
  */
 int cch_index_insert_direct(
 	struct cch_index *index,
@@ -507,19 +1159,129 @@ int cch_index_remove_direct(
 	struct cch_index_entry *entry,
 	int offset);
 
-/* push excessive data to block device, reach max_mem_kb memory usage */
-int cch_index_shrink(struct cch_index_entry *index, int max_mem_kb);
+/*
+ * Remove all keys in [first, last]. Subtrees completely inside
+ * the range are freed as a whole unless some entries are pinned,
+ * only boundary entries are trimmed key by key. May sleep.
+ */
+int cch_index_remove_range(struct cch_index *index,
+			   uint64_t first, uint64_t last);
+
+/*
+ * push excessive data to block device, reach max_mem_kb memory usage.
+ * Changes are saved incrementally first, then least recently used
+ * lowest level entries are freed and parents keep their device
+ * offsets. Lookups load them back on demand. -ENOSPC when there is
+ * nothing left to unload, -EBUSY while full save overwrites saved data.
+ * Entries kept for *_direct calls across it are to be pinned.
+ */
+int cch_index_shrink(struct cch_index *index, int max_mem_kb);
+
+/*
+ * Get lowest level entry holding @arg key for *_direct calls, loading
+ * it back if it's unloaded, and keep it till cch_index_unpin():
+ * cch_index_shrink() doesn't unload it and it isn't freed when its
+ * last record is removed. -ENOENT if there is no such entry.
+ */
+int cch_index_pin(struct cch_index *index, uint64_t key,
+		  struct cch_index_entry **entry);
+
+/* drop pin of cch_index_pin(), entry left empty is freed */
+void cch_index_unpin(struct cch_index *index, struct cch_index_entry *entry);
 
 
 /* save to disk, return offset */
 uint64_t cch_index_save(struct cch_index *index);
 
-/* save to device using callbacks provided at cch_index_create */
+/* save to device using callbacks provided at cch_index_create.
+ * Subtrees of root slots are saved one by one, writers of a subtree
+ * are blocked only while it's copied to memory.
+ * With entries unloaded by cch_index_shrink() saved data isn't
+ * truncated: it's done in transaction instead of full save one,
+ * their records are copied and written apart from the old ones */
 int cch_index_full_save(struct cch_index *index);
 
-/* load from device using same callbacks */
+/*
+ * save entries changed since last save only. They are appended after
+ * saved data together with their parents and root is rewritten, so
+ * space of replaced entries is reused by next full save only. Falls
+ * back to full save when there is no saved data yet.
+ */
+int cch_index_incremental_save(struct cch_index *index);
+
+/*
+ * load from device using same callbacks to empty index of the same
+ * geometry. Clusters are read and parsed by several workers, -EIO
+ * on corrupted data. Index is left partially filled on error.
+ */
 int cch_index_full_restore(struct cch_index *index);
 
+/*
+ * Sharded index: shards independent indexes, each with its own
+ * locks, LRU and kmem_caches. Key is routed to shard by its
+ * top bits and stored in that shard as is, so *_direct calls can be
+ * used on the shard returned by cch_index_sharded_get().
+ *
+ * Callbacks get shard as their index argument.
+ */
+struct cch_index_sharded {
+	/* power of 2 */
+	int shards;
+	/* shard is key >> shard_shift, masked by shards - 1 */
+	int shard_shift;
+
+	struct cch_index *shard[];
+};
+
+int cch_index_sharded_create(
+	int shards,
+	int levels,
+	int bits,
+	int root_bits,
+	int low_bits,
+	unsigned long flags,
+
+	cch_index_on_new_entry_alloc_fn_t on_new_entry_alloc_fn,
+	cch_index_on_entry_free_fn_t on_entry_free_fn,
+
+	cch_index_start_full_save_fn_t start_full_save_fn,
+	cch_index_finish_full_save_fn_t finish_full_save_fn,
+
+	cch_index_write_cluster_data_fn_t write_cluster_data_fn,
+	cch_index_read_cluster_data_fn_t read_cluster_data_fn,
+
+	cch_index_start_transaction_fn_t start_transaction_fn,
+	cch_index_finish_transaction_fn_t finish_transaction_fn,
+
+	struct cch_index_sharded **out);
+
+/* -EBUSY leaves not yet destroyed shards in place, call again later */
+int cch_index_sharded_destroy(struct cch_index_sharded *sharded);
+
+/* shard holding given key, higher bits than index has are
+ * ignored as they are by a single index */
+static inline struct cch_index *cch_index_sharded_get(
+	struct cch_index_sharded *sharded,
+	uint64_t key)
+{
+	if (sharded->shards == 1)
+		return sharded->shard[0];
+	return sharded->shard[(key >> sharded->shard_shift) &
+			      (sharded->shards - 1)];
+}
+
+/* calls below return -EINVAL for keys past index bits */
+int cch_index_sharded_find(struct cch_index_sharded *sharded, uint64_t key,
+	void **out_value, struct cch_index_entry **index_entry,
+	int *value_offset);
+
+int cch_index_sharded_insert(struct cch_index_sharded *sharded,
+	uint64_t key, void *value, bool replace,
+	struct cch_index_entry **new_index_entry,
+	int *new_value_offset);
+
+int cch_index_sharded_remove(struct cch_index_sharded *sharded, uint64_t key);
+
 /*
  * on-disk data structure assumes that loading occurs with
  * same index structure properties with root node at
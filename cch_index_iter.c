@@ -0,0 +1,226 @@
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+
+#define LOG_PREFIX "cch_index_iter"
+
+#include "cch_index.h"
+#include "cch_index_debug.h"
+
+/**
+ * Entry has records and isn't going to be freed
+ */
+static inline int cch_index_iter_entry_used(struct cch_index_entry *entry)
+{
+	int ref_cnt;
+
+	if (entry == NULL)
+		return 0;
+
+	ref_cnt = atomic_read(&entry->ref_cnt);
+	return ref_cnt != 0 && !(ref_cnt & CCH_INDEX_ENTRY_DEAD);
+}
+
+/**
+ * Find first lowest level entry that may hold keys not less than
+ * iter->key, copy its records starting from iter->key and move
+ * iter->key past this entry. Empty subtrees are skipped by occupancy
+ * bitmaps or compact entry offsets and ref_cnt.
+ *
+ * Doesn't touch LRU, sweeps shouldn't make everything recent.
+ *
+ * Called under rcu_read_lock(). Returns -EREMOTE with iter->key
+ * in unloaded entry, which is to be loaded without it.
+ */
+static int __cch_index_iter_fill(struct cch_index_iter *iter)
+{
+	struct cch_index *index = iter->index;
+	struct cch_index_entry *entry, *child = NULL;
+	struct cch_level_desc_entry *desc;
+	uint64_t key = iter->key;
+	uint64_t span_mask;
+	void *value;
+	int level = 0, offset = 0, size = 0;
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	iter->nr = 0;
+	iter->pos = 0;
+
+restart:
+	entry = &index->head;
+	for (level = 0; level < index->levels - 1; level++) {
+		desc = &index->levels_desc[level];
+		size = cch_index_entry_size(index, entry);
+
+		for (offset = cch_index_entry_next_child(index, entry,
+				EXTRACT_BIASED_VALUE(key, index->levels_desc,
+						     level));
+		     offset < size;
+		     offset = cch_index_entry_next_child(index, entry,
+				offset + 1)) {
+			child = cch_index_entry_child(index, entry, offset);
+			if (cch_index_entry_is_unloaded(child) ||
+			    cch_index_iter_entry_used(child))
+				break;
+		}
+
+		span_mask = cch_index_level_span_mask(index, level);
+		if (offset == size) {
+			/* nothing left in this entry, carry to next one */
+			if (level == 0 ||
+			    (key | span_mask) == cch_index_max_key(index)) {
+				iter->end = true;
+				goto out;
+			}
+			key = (key | span_mask) + 1;
+			goto restart;
+		}
+
+		if (offset != EXTRACT_BIASED_VALUE(key, index->levels_desc,
+				level)) {
+			/* skipped to later subtree, start from its first key */
+			key = (key & ~span_mask) |
+				((uint64_t) offset << desc->offset);
+		}
+
+		if (cch_index_entry_is_unloaded(child)) {
+			iter->key = key;
+			result = -EREMOTE;
+			goto out;
+		}
+
+		entry = child;
+	}
+
+	desc = &index->levels_desc[index->lowest_level];
+	size = cch_index_entry_size(index, entry);
+	span_mask = cch_index_level_span_mask(index, index->lowest_level);
+
+	for (offset = cch_index_entry_next_offset(index, entry,
+			EXTRACT_LOWEST_OFFSET(index, key));
+	     offset < size;
+	     offset = cch_index_entry_next_offset(index, entry, offset + 1)) {
+		/* compact table may be replaced meanwhile */
+		value = cch_index_entry_value(index, entry, offset);
+		if (value == NULL)
+			continue;
+
+		cch_index_value_lock(value);
+		iter->keys[iter->nr] = (key & ~span_mask) |
+			((uint64_t) offset << desc->offset);
+		iter->values[iter->nr] = value;
+		iter->nr++;
+	}
+
+	if ((key | span_mask) == cch_index_max_key(index))
+		iter->end = true;
+	else
+		iter->key = (key | span_mask) + 1;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+int cch_index_iter_start(struct cch_index *index,
+			 struct cch_index_iter *iter, uint64_t key)
+{
+	int result = 0;
+	int size = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(index == NULL);
+	sBUG_ON(iter == NULL);
+
+	memset(iter, 0, sizeof(*iter));
+	iter->index = index;
+	iter->key = key;
+	iter->end = key > cch_index_max_key(index);
+
+	size = index->levels_desc[index->lowest_level].size;
+	iter->keys = kmalloc(size * sizeof(*iter->keys), GFP_KERNEL);
+	if (iter->keys == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	iter->values = kmalloc(size * sizeof(*iter->values), GFP_KERNEL);
+	if (iter->values == NULL) {
+		result = -ENOMEM;
+		goto out_free_keys;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+
+out_free_keys:
+	kfree(iter->keys);
+	iter->keys = NULL;
+	goto out;
+}
+EXPORT_SYMBOL(cch_index_iter_start);
+
+int cch_index_iter_next(struct cch_index_iter *iter,
+			uint64_t *key, void **value)
+{
+	int result = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(iter == NULL);
+	sBUG_ON(key == NULL);
+	sBUG_ON(value == NULL);
+
+	while (iter->pos == iter->nr) {
+		if (iter->end) {
+			result = -ENOENT;
+			goto out;
+		}
+
+		rcu_read_lock();
+		result = __cch_index_iter_fill(iter);
+		rcu_read_unlock();
+
+		if (result == -EREMOTE) {
+			/* entry removed meanwhile is skipped by next fill */
+			result = __cch_index_fault_in(iter->index, iter->key);
+			if (result == -ENOENT)
+				result = 0;
+			if (result)
+				goto out;
+		}
+	}
+
+	*key = iter->keys[iter->pos];
+	*value = iter->values[iter->pos];
+	iter->pos++;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_iter_next);
+
+void cch_index_iter_stop(struct cch_index_iter *iter)
+{
+	TRACE_ENTRY();
+
+	sBUG_ON(iter == NULL);
+
+	for (; iter->pos < iter->nr; iter->pos++)
+		cch_index_value_unlock(iter->values[iter->pos]);
+
+	kfree(iter->keys);
+	kfree(iter->values);
+	iter->keys = NULL;
+	iter->values = NULL;
+
+	TRACE_EXIT();
+	return;
+}
+EXPORT_SYMBOL(cch_index_iter_stop);
@@ -0,0 +1,167 @@
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+
+#define LOG_PREFIX "cch_index_shard"
+
+#include "cch_index.h"
+#include "cch_index_debug.h"
+
+/**
+ * Create sharded index of @arg shards sub-indexes. Rest of arguments
+ * are given to cch_index_create() for every shard.
+ *
+ * @arg shards number of shards, power of 2, usually number of queues
+ */
+int cch_index_sharded_create(
+	int shards,
+	int levels,
+	int bits,
+	int root_bits,
+	int low_bits,
+	unsigned long flags,
+
+	cch_index_on_new_entry_alloc_fn_t on_new_entry_alloc_fn,
+	cch_index_on_entry_free_fn_t on_entry_free_fn,
+
+	cch_index_start_full_save_fn_t start_full_save_fn,
+	cch_index_finish_full_save_fn_t finish_full_save_fn,
+
+	cch_index_write_cluster_data_fn_t write_cluster_data_fn,
+	cch_index_read_cluster_data_fn_t read_cluster_data_fn,
+
+	cch_index_start_transaction_fn_t start_transaction_fn,
+	cch_index_finish_transaction_fn_t finish_transaction_fn,
+
+	struct cch_index_sharded **out)
+{
+	int result = 0;
+	struct cch_index_sharded *sharded;
+	int i = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(out == NULL);
+
+	/* shard is selected by top bits of key, it can't take
+	 * more bits than root level addresses */
+	if (shards <= 0 || !is_power_of_2(shards) ||
+	    ilog2(shards) > root_bits) {
+		PRINT_ERROR("bad number of shards %d", shards);
+		result = -EINVAL;
+		goto out;
+	}
+
+	sharded = kzalloc(sizeof(struct cch_index_sharded) +
+			  shards * sizeof(struct cch_index *),
+			  GFP_KERNEL);
+	if (sharded == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	sharded->shards = shards;
+	sharded->shard_shift = bits - ilog2(shards);
+
+	for (i = 0; i < shards; i++) {
+		result = cch_index_create(levels, bits, root_bits, low_bits,
+			flags,
+			on_new_entry_alloc_fn, on_entry_free_fn,
+			start_full_save_fn, finish_full_save_fn,
+			write_cluster_data_fn, read_cluster_data_fn,
+			start_transaction_fn, finish_transaction_fn,
+			&sharded->shard[i]);
+		if (result) {
+			PRINT_ERROR("shard %d creation failure, result %d",
+				    i, result);
+			goto out_destroy_shards;
+		}
+	}
+
+	PRINT_INFO("%d shards, shift %d", shards, sharded->shard_shift);
+
+	*out = sharded;
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+
+out_destroy_shards:
+	/* shards are empty, nothing can make destroy fail */
+	while (--i >= 0)
+		cch_index_destroy(sharded->shard[i]);
+	kfree(sharded);
+	goto out;
+}
+EXPORT_SYMBOL(cch_index_sharded_create);
+
+int cch_index_sharded_destroy(struct cch_index_sharded *sharded)
+{
+	int result = 0;
+	int i = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(sharded == NULL);
+
+	for (i = 0; i < sharded->shards; i++) {
+		if (sharded->shard[i] == NULL)
+			continue;
+
+		result = cch_index_destroy(sharded->shard[i]);
+		if (result) {
+			PRINT_ERROR("shard %d destroy failure, result %d",
+				    i, result);
+			goto out;
+		}
+		sharded->shard[i] = NULL;
+	}
+
+	kfree(sharded);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+EXPORT_SYMBOL(cch_index_sharded_destroy);
+
+int cch_index_sharded_find(struct cch_index_sharded *sharded, uint64_t key,
+	void **out_value, struct cch_index_entry **index_entry,
+	int *value_offset)
+{
+	sBUG_ON(sharded == NULL);
+
+	if (key > cch_index_max_key(sharded->shard[0]))
+		return -EINVAL;
+
+	return cch_index_find(cch_index_sharded_get(sharded, key), key,
+		out_value, index_entry, value_offset);
+}
+EXPORT_SYMBOL(cch_index_sharded_find);
+
+int cch_index_sharded_insert(struct cch_index_sharded *sharded,
+	uint64_t key, void *value, bool replace,
+	struct cch_index_entry **new_index_entry,
+	int *new_value_offset)
+{
+	sBUG_ON(sharded == NULL);
+
+	if (key > cch_index_max_key(sharded->shard[0]))
+		return -EINVAL;
+
+	return cch_index_insert(cch_index_sharded_get(sharded, key), key,
+		value, replace, new_index_entry, new_value_offset);
+}
+EXPORT_SYMBOL(cch_index_sharded_insert);
+
+int cch_index_sharded_remove(struct cch_index_sharded *sharded, uint64_t key)
+{
+	sBUG_ON(sharded == NULL);
+
+	if (key > cch_index_max_key(sharded->shard[0]))
+		return -EINVAL;
+
+	return cch_index_remove(cch_index_sharded_get(sharded, key), key);
+}
+EXPORT_SYMBOL(cch_index_sharded_remove);
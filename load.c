@@ -1,5 +1,6 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
 
 #define LOG_PREFIX "load"
 
@@ -166,6 +167,7 @@ static int smoke_test(void)
 		/* total bits */     64,
 		/* root_bits */ 8,
 		/* low_bits */  8, /* 46 total */
+		/* flags */     0,
 		cch_index_on_new_entry_alloc,
 		cch_index_on_entry_free,
 		cch_index_start_full_save,
@@ -238,6 +240,7 @@ static int direct_test(void)
 				  /* total bits */      64,
 				  /* root_bits */ 8,
 				  /* low_bits */  8,
+				  /* flags */     0,
 		cch_index_on_new_entry_alloc,
 		cch_index_on_entry_free,
 		cch_index_start_full_save,
@@ -363,6 +366,7 @@ static int remove_cleanup_test(void)
 				  /* total bits */      64,
 				  /* root_bits */ 8,
 				  /* low_bits */  8,
+				  /* flags */     0,
 		cch_index_on_new_entry_alloc,
 		cch_index_on_entry_free,
 		cch_index_start_full_save,
@@ -411,7 +415,7 @@ static int remove_cleanup_test(void)
 		goto out_free_index;
 	}
 
-	if (index->head.ref_cnt != 1) {
+	if (atomic_read(&index->head.ref_cnt) != 1) {
 		PRINT_ERROR("ref_cnt is prematurely zero");
 		goto out_free_index;
 	}
@@ -422,7 +426,7 @@ static int remove_cleanup_test(void)
 		goto out_free_index;
 	}
 
-	if (index->head.ref_cnt != 0) {
+	if (atomic_read(&index->head.ref_cnt) != 0) {
 		PRINT_ERROR("after removal root head ref_cnt non-zero");
 		goto out_free_index;
 	}
@@ -442,6 +446,2023 @@ out:
 	return result;
 }
 
+/* index with stub callbacks of stubs.c */
+static int test_index_create(int levels, int bits, int root_bits,
+	int low_bits, unsigned long flags, struct cch_index **index)
+{
+	return cch_index_create(levels, bits, root_bits, low_bits, flags,
+		cch_index_on_new_entry_alloc,
+		cch_index_on_entry_free,
+		cch_index_start_full_save,
+		cch_index_finish_full_save,
+		cch_index_write_cluster_data,
+		cch_index_read_cluster_data,
+		cch_index_start_transaction,
+		cch_index_finish_transaction,
+		index);
+}
+
+/*
+ * Lookup marks entry as referenced, clock hand gives it second chance
+ * and picks first unreferenced one.
+ */
+static int clock_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_entry *entries[3], *victim;
+	void *found_value;
+	unsigned long flags;
+	int i;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8,
+		CCH_INDEX_CLOCK_EVICTION, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* one value in each of three lowest level entries */
+	for (i = 0; i < 3; i++) {
+		result = insert_to_index(index, i << 8,
+			(void *) (0xBEEF0000UL + i), &entries[i], NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	/* everything is referenced by insertion, so the hand goes
+	 * full circle and returns to the first entry */
+	spin_lock_irqsave(&index->index_lru_list_lock, flags);
+	victim = __cch_index_lru_pick_victim(index);
+	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
+	if (victim != entries[0]) {
+		PRINT_ERROR("first victim is %p instead of %p",
+			    victim, entries[0]);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = search_index(index, 0, &found_value, NULL, NULL, NULL);
+	if (result)
+		goto out_free_index;
+
+	spin_lock_irqsave(&index->index_lru_list_lock, flags);
+	victim = __cch_index_lru_pick_victim(index);
+	spin_unlock_irqrestore(&index->index_lru_list_lock, flags);
+	if (victim != entries[1]) {
+		PRINT_ERROR("referenced entry %p was not spared", entries[0]);
+		result = 1;
+		goto out_free_index;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Sharded index routes keys by top bits, each shard holds only its keys
+ */
+static int sharded_test(void)
+{
+	int result;
+	struct cch_index_sharded *sharded;
+	struct cch_index *shard;
+	void *found_value;
+	int i;
+
+	TRACE_ENTRY();
+
+	result = cch_index_sharded_create(/* shards */ 4,
+					  /* levels */    6,
+					  /* total bits */      64,
+					  /* root_bits */ 8,
+					  /* low_bits */  8,
+					  /* flags */     0,
+		cch_index_on_new_entry_alloc,
+		cch_index_on_entry_free,
+		cch_index_start_full_save,
+		cch_index_finish_full_save,
+		cch_index_write_cluster_data,
+		cch_index_read_cluster_data,
+		cch_index_start_transaction,
+		cch_index_finish_transaction,
+		&sharded);
+	if (result != 0) {
+		PRINT_ERROR("sharded index creation failure, result %d",
+			    result);
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_values); i++) {
+		result = cch_index_sharded_insert(sharded, test_values[i].key,
+			test_values[i].value, false, NULL, NULL);
+		if (result) {
+			PRINT_ERROR("sharded insert failure, result %d",
+				    result);
+			goto out_free_index;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_values); i++) {
+		result = cch_index_sharded_find(sharded, test_values[i].key,
+			&found_value, NULL, NULL);
+		if (result || found_value != test_values[i].value) {
+			PRINT_ERROR("sharded find failure, result %d", result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* key is stored in shard chosen by its two top bits */
+		shard = sharded->shard[test_values[i].key >> 62];
+		if (cch_index_sharded_get(sharded, test_values[i].key) !=
+		    shard) {
+			PRINT_ERROR("key 0x%llx routed to wrong shard",
+				    test_values[i].key);
+			result = 1;
+			goto out_free_index;
+		}
+		result = search_index(shard, test_values[i].key,
+			&found_value, NULL, NULL, test_values[i].value);
+		if (result)
+			goto out_free_index;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_values); i++) {
+		result = cch_index_sharded_remove(sharded,
+			test_values[i].key);
+		if (result) {
+			PRINT_ERROR("sharded remove failure, result %d",
+				    result);
+			goto out_free_index;
+		}
+	}
+
+out_free_index:
+	cch_index_sharded_destroy(sharded);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Walk backwards with negative offsets through lowest level entries
+ * and root slots, nothing is before key 0
+ */
+static int direct_backward_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_entry *entry, *first_entry, *new_entry;
+	int offset, first_offset, new_offset;
+	uint64_t first_key = 0x0100000000000100ULL;
+	void *found_value;
+	int i;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	result = cch_index_insert(index, first_key, (void *) first_key,
+		false, &first_entry, &first_offset);
+	if (result)
+		goto out_free_index;
+
+	entry = first_entry;
+	offset = first_offset;
+	for (i = 1; i <= 600; i++) {
+		result = cch_index_insert_direct(index, entry, offset - 1,
+			false, (void *) (first_key - i), &entry, &offset);
+		if (result) {
+			PRINT_ERROR("backward insert_direct failure, "
+				    "result %d", result);
+			goto out_free_index;
+		}
+	}
+
+	entry = first_entry;
+	offset = first_offset;
+	for (i = 1; i <= 600; i++) {
+		found_value = (void *) 1;
+		result = cch_index_find_direct(index, entry, offset - 1,
+			&found_value, &entry, &offset);
+		if (result || found_value != (void *) (first_key - i)) {
+			PRINT_ERROR("backward find_direct failure at %d, "
+				    "result %d", i, result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		result = cch_index_find(index, first_key - i, &found_value,
+			NULL, NULL);
+		if (result || found_value != (void *) (first_key - i)) {
+			PRINT_ERROR("key 0x%llx not found", first_key - i);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	result = cch_index_insert(index, 0, (void *) 1, false,
+		&entry, &offset);
+	if (result)
+		goto out_free_index;
+	result = cch_index_insert_direct(index, entry, offset - 1, false,
+		(void *) 1, NULL, NULL);
+	if (result != -ENOENT) {
+		PRINT_ERROR("inserted before key 0, result %d", result);
+		result = 1;
+		goto out_free_index;
+	}
+	result = 0;
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Strided walks over many lowest level entries at once, forward
+ * to insert and backward to find
+ */
+static int direct_stride_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_entry *entry;
+	int offset;
+	uint64_t key = 0x00FFFFFFFFF00000ULL;
+	int strides[] = {1000, 70000};
+	void *found_value;
+	int i, j;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	for (j = 0; j < ARRAY_SIZE(strides); j++) {
+		result = cch_index_insert(index, key, (void *) key, true,
+			&entry, &offset);
+		if (result)
+			goto out_free_index;
+
+		/* last strides go over to next root slot */
+		for (i = 1; i <= 20; i++) {
+			result = cch_index_insert_direct(index, entry,
+				offset + strides[j], true,
+				(void *) (key + i * strides[j]),
+				&entry, &offset);
+			if (result)
+				goto out_free_index;
+
+			result = cch_index_find(index, key + i * strides[j],
+				&found_value, NULL, NULL);
+			if (result ||
+			    found_value != (void *) (key + i * strides[j])) {
+				PRINT_ERROR("stride %d, key 0x%llx not found",
+					    strides[j], key + i * strides[j]);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+		for (i = 19; i >= 0; i--) {
+			found_value = (void *) 1;
+			result = cch_index_find_direct(index, entry,
+				offset - strides[j], &found_value,
+				&entry, &offset);
+			if (result ||
+			    found_value != (void *) (key + i * strides[j])) {
+				PRINT_ERROR("stride %d, backward find failure "
+					    "at %d", strides[j], i);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Finger lookups resume from the shared part of previous path
+ * and don't trust it after entries are freed
+ */
+static int finger_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_finger finger;
+	uint64_t keys[] = {0x1000, 0x1001, 0x10FF, 0x1100, 0x0100000000001000ULL};
+	void *found_value;
+	int i;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		result = cch_index_insert(index, keys[i], (void *) keys[i],
+			false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	cch_index_finger_init(index, &finger);
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		result = cch_index_find_finger(&finger, keys[i],
+			&found_value, NULL, NULL);
+		if (result || found_value != (void *) keys[i]) {
+			PRINT_ERROR("finger lookup of 0x%llx failed", keys[i]);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	/* frees lowest level entry of 0x1100, finger points there */
+	result = cch_index_remove(index, 0x1100);
+	if (result)
+		goto out_free_index;
+
+	result = cch_index_find_finger(&finger, 0x1100, &found_value,
+		NULL, NULL);
+	if (result != -ENOENT) {
+		PRINT_ERROR("removed key found by finger, result %d", result);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_find_finger(&finger, 0x10FF, &found_value,
+		NULL, NULL);
+	if (result || found_value != (void *) 0x10FF) {
+		PRINT_ERROR("finger lookup after free failed");
+		result = 1;
+		goto out_free_index;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Batched lookup returns same values as one by one search,
+ * NULL for absent keys, across more than one batch of keys
+ */
+static int find_batch_test(void)
+{
+	int result;
+	struct cch_index *index;
+	uint64_t keys[CCH_INDEX_FIND_BATCH + 4];
+	void *values[CCH_INDEX_FIND_BATCH + 4];
+	int i, found;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* every other key is present, spread over root slots */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		keys[i] = ((uint64_t) i << 56) | (i * 0x10001);
+		if (i % 2)
+			continue;
+		result = cch_index_insert(index, keys[i],
+			(void *) (0xF00D0000UL + i), false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	found = cch_index_find_batch(index, keys, ARRAY_SIZE(keys), values);
+	if (found != ARRAY_SIZE(keys) / 2) {
+		PRINT_ERROR("batch found %d values", found);
+		result = 1;
+		goto out_free_index;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		if (values[i] != ((i % 2) ? NULL :
+				  (void *) (0xF00D0000UL + i))) {
+			PRINT_ERROR("batch value %d is %p", i, values[i]);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Sorted bulk insert crossing lowest level entries and root slots,
+ * stops on existing key when not replacing
+ */
+static int insert_batch_test(void)
+{
+	int result;
+	struct cch_index *index;
+	static uint64_t keys[600];
+	static void *values[600];
+	void *found_value;
+	int i, inserted;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* last keys go to next root slot */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		keys[i] = (i < 500) ? 0x00FFFFFFFFFFFF00ULL + i :
+			0x0100000000000000ULL + i;
+		values[i] = (void *) (0xCAFE0000UL + i);
+	}
+
+	result = cch_index_insert_batch(index, keys, values,
+		ARRAY_SIZE(keys), false, &inserted);
+	if (result || inserted != ARRAY_SIZE(keys)) {
+		PRINT_ERROR("batch insert failure, result %d, inserted %d",
+			    result, inserted);
+		result = result ? result : 1;
+		goto out_free_index;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		result = cch_index_find(index, keys[i], &found_value,
+			NULL, NULL);
+		if (result || found_value != values[i]) {
+			PRINT_ERROR("key 0x%llx not found after batch insert",
+				    keys[i]);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	/* keys[10] is already there */
+	result = cch_index_insert_batch(index, &keys[10], values, 5,
+		false, &inserted);
+	if (result != -EEXIST || inserted != 0) {
+		PRINT_ERROR("batch insert over existing key, result %d, "
+			    "inserted %d", result, inserted);
+		result = 1;
+		goto out_free_index;
+	}
+	result = 0;
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Range remove frees covered entries, trims boundary ones and
+ * leaves keys outside of the range alone
+ */
+static int remove_range_test(void)
+{
+	int result;
+	struct cch_index *index;
+	static uint64_t keys[1024];
+	static void *values[1024];
+	void *found_value;
+	uint64_t first, last;
+	int i;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* four lowest level entries, two of them in next root slot */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		keys[i] = 0x00FFFFFFFFFFFE00ULL + i;
+		values[i] = (void *) (0xD00D0000UL + i);
+	}
+	result = cch_index_insert_batch(index, keys, values,
+		ARRAY_SIZE(keys), false, NULL);
+	if (result)
+		goto out_free_index;
+
+	/* half of first entry, whole second and third, some of fourth */
+	first = keys[128];
+	last = keys[800];
+	result = cch_index_remove_range(index, first, last);
+	if (result) {
+		PRINT_ERROR("range remove failure, result %d", result);
+		goto out_free_index;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		result = cch_index_find(index, keys[i], &found_value,
+			NULL, NULL);
+		if ((keys[i] >= first && keys[i] <= last) != (result != 0)) {
+			PRINT_ERROR("key 0x%llx is wrong after range remove, "
+				    "result %d", keys[i], result);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	/* everything left is freed too */
+	result = cch_index_remove_range(index, 0, ~0ULL);
+	if (result)
+		goto out_free_index;
+
+	if (atomic_read(&index->head.ref_cnt) != 0 ||
+	    cch_index_total_bytes(index) != 0) {
+		PRINT_ERROR("entries left after removing everything");
+		result = 1;
+		goto out_free_index;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Iterator returns all records in key order, skipping empty
+ * subtrees, and can start in the middle
+ */
+static int iter_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_iter iter;
+	uint64_t key, prev_key = 0;
+	void *value;
+	int i, count = 0;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_values); i++) {
+		result = cch_index_insert(index, test_values[i].key,
+			test_values[i].value, false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+	/* empty lowest level entry is skipped */
+	result = cch_index_insert(index, 0x7700, (void *) 0x7700, false,
+		NULL, NULL);
+	if (result)
+		goto out_free_index;
+	result = cch_index_remove(index, 0x7700);
+	if (result)
+		goto out_free_index;
+
+	result = cch_index_iter_start(index, &iter, 0);
+	if (result)
+		goto out_free_index;
+
+	while (cch_index_iter_next(&iter, &key, &value) == 0) {
+		if (count && key <= prev_key) {
+			PRINT_ERROR("key 0x%llx after 0x%llx", key, prev_key);
+			result = 1;
+		}
+		for (i = 0; i < ARRAY_SIZE(test_values); i++) {
+			if (test_values[i].key == key)
+				break;
+		}
+		if (i == ARRAY_SIZE(test_values) ||
+		    test_values[i].value != value) {
+			PRINT_ERROR("unexpected record 0x%llx", key);
+			result = 1;
+		}
+		prev_key = key;
+		count++;
+	}
+	cch_index_iter_stop(&iter);
+
+	if (result || count != ARRAY_SIZE(test_values)) {
+		PRINT_ERROR("iterated over %d records", count);
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* 0x0102030401020305 is the only key after this one */
+	result = cch_index_iter_start(index, &iter, 0x0102030401020305ULL);
+	if (result)
+		goto out_free_index;
+	result = cch_index_iter_next(&iter, &key, &value);
+	if (result || key != 0x0102030401020305ULL) {
+		PRINT_ERROR("iterator started at wrong key, result %d",
+			    result);
+		result = 1;
+	}
+	cch_index_iter_stop(&iter);
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Sparse lowest level entries take compact tables, grow to dense ones
+ * in place and shrink back when records are removed
+ */
+static int compact_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_entry *entry, *new_entry;
+	struct cch_index_iter iter;
+	uint64_t key;
+	void *value;
+	int offset, new_offset;
+	int i, count = 0;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8,
+		CCH_INDEX_COMPACT_LEAVES, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* one record per lowest level entry */
+	for (i = 0; i < 64; i++) {
+		result = cch_index_insert(index, (i << 8) | i,
+			(void *) (0xC0DE0000UL + i), false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+	if (cch_index_total_bytes(index) > 64 * 1024) {
+		PRINT_ERROR("sparse index takes %lld bytes",
+			    cch_index_total_bytes(index));
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* entry keeps its address while growing to dense table */
+	result = cch_index_find(index, 0x505, &value, &entry, &offset);
+	if (result)
+		goto out_free_index;
+	for (i = 1; i < 200; i++) {
+		result = cch_index_insert_direct(index, entry, offset + i,
+			false, (void *) (0xC0DE0500UL + offset + i),
+			&new_entry, &new_offset);
+		if (result)
+			goto out_free_index;
+	}
+	value = (void *) 1;
+	result = cch_index_find_direct(index, entry, offset + 199, &value,
+		&new_entry, &new_offset);
+	if (result || value != (void *) (0xC0DE0500UL + offset + 199)) {
+		PRINT_ERROR("direct lookup failure, result %d", result);
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* and shrinks back to compact one */
+	result = cch_index_remove_range(index, 0x506, 0x5F0);
+	if (result)
+		goto out_free_index;
+	for (i = 0; i < 256; i++) {
+		result = cch_index_find(index, 0x500 | i, &value, NULL, NULL);
+		if ((i == 5) != (result == 0)) {
+			PRINT_ERROR("key 0x%x is wrong, result %d",
+				    0x500 | i, result);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	result = cch_index_iter_start(index, &iter, 0x500);
+	if (result)
+		goto out_free_index;
+	while (cch_index_iter_next(&iter, &key, &value) == 0 &&
+	       key < 0x600)
+		count++;
+	cch_index_iter_stop(&iter);
+	result = 0;
+	if (count != 1) {
+		PRINT_ERROR("iterated over %d records", count);
+		result = 1;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Mid level entries of isolated keys are compact, many children turn
+ * them into full ones, records stay in key order
+ */
+static int compact_mid_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_iter iter;
+	uint64_t key, prev_key = 0;
+	void *value;
+	int i, count = 0;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, CCH_INDEX_COMPACT_MID, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* isolated keys, each one has its own chain of mid entries */
+	for (i = 0; i < 16; i++) {
+		key = ((uint64_t) i << 56) | ((uint64_t) i << 20) | i;
+		result = cch_index_insert(index, key, (void *) ~key, false,
+			NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+	if (cch_index_total_bytes(index) > 64 * 1024) {
+		PRINT_ERROR("sparse index takes %lld bytes",
+			    cch_index_total_bytes(index));
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* children of one entry outgrow compact form */
+	for (i = 0; i < 40; i++) {
+		key = 0x00AA000000000000ULL | ((uint64_t) i << 40);
+		result = cch_index_insert(index, key, (void *) ~key, false,
+			NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	result = cch_index_iter_start(index, &iter, 0);
+	if (result)
+		goto out_free_index;
+	while (cch_index_iter_next(&iter, &key, &value) == 0) {
+		if ((count && key <= prev_key) || value != (void *) ~key) {
+			PRINT_ERROR("unexpected record 0x%llx", key);
+			result = 1;
+		}
+		prev_key = key;
+		count++;
+	}
+	cch_index_iter_stop(&iter);
+	if (result || count != 56) {
+		PRINT_ERROR("iterated over %d records", count);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_remove_range(index, 0, ~0ULL);
+	if (result)
+		goto out_free_index;
+	if (cch_index_total_bytes(index) != 0) {
+		PRINT_ERROR("empty index takes %lld bytes",
+			    cch_index_total_bytes(index));
+		result = 1;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* skip of lone key's first mid entry, NULL if it's not compact */
+static struct cch_index_skip *skip_test_skip(struct cch_index *index,
+	uint64_t key)
+{
+	struct cch_index_entry *entry;
+
+	rcu_read_lock();
+	entry = cch_index_entry_child(index, &index->head,
+		EXTRACT_BIASED_VALUE(key, index->levels_desc, 0));
+	rcu_read_unlock();
+
+	if (entry == NULL || !cch_index_entry_is_compact(entry))
+		return NULL;
+	return cch_index_entry_skip(entry);
+}
+
+/*
+ * Single child chain of compact mid level entries is skipped up to
+ * where keys part, and skip is back once they don't
+ */
+static int skip_test_levels(int levels)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_skip *skip;
+	uint64_t key = 0x0123456789ABCDEFULL, split, other;
+	void *value;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(levels, 64, 8, 8,
+		CCH_INDEX_COMPACT_MID, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* differs from key at level 4 and level 2 */
+	split = key ^ (1ULL << index->levels_desc[4].offset);
+	other = key ^ (1ULL << index->levels_desc[2].offset);
+
+	result = cch_index_insert(index, key, (void *) ~key, false,
+		NULL, NULL);
+	if (result)
+		goto out_free_index;
+
+	/* lone key, lookups go from first mid entry to leaf */
+	skip = skip_test_skip(index, key);
+	if (skip == NULL || skip->target == NULL ||
+	    skip->level != index->levels - 1) {
+		PRINT_ERROR("no skip to lowest level");
+		result = 1;
+		goto out_free_index;
+	}
+	if (cch_index_find(index, key, &value, NULL, NULL) ||
+	    value != (void *) ~key ||
+	    cch_index_find(index, other, &value, NULL, NULL) !=
+	    -ENOENT) {
+		PRINT_ERROR("lookup by skip failed");
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* skip ends where the keys part */
+	result = cch_index_insert(index, split, (void *) ~split,
+		false, NULL, NULL);
+	if (result)
+		goto out_free_index;
+	skip = skip_test_skip(index, key);
+	if (skip == NULL || skip->target == NULL ||
+	    skip->level != 4) {
+		PRINT_ERROR("no skip to level 4");
+		result = 1;
+		goto out_free_index;
+	}
+	if (cch_index_find(index, key, &value, NULL, NULL) ||
+	    value != (void *) ~key ||
+	    cch_index_find(index, split, &value, NULL, NULL) ||
+	    value != (void *) ~split ||
+	    cch_index_find(index, other, &value, NULL, NULL) !=
+	    -ENOENT) {
+		PRINT_ERROR("lookup by split skip failed");
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_remove(index, split);
+	if (result)
+		goto out_free_index;
+	/* chain is single again, so is the skip */
+	skip = skip_test_skip(index, key);
+	if (skip == NULL || skip->target == NULL ||
+	    skip->level != index->levels - 1) {
+		PRINT_ERROR("no skip to lowest level after remove");
+		result = 1;
+		goto out_free_index;
+	}
+	if (cch_index_find(index, key, &value, NULL, NULL) ||
+	    value != (void *) ~key ||
+	    cch_index_find(index, split, &value, NULL, NULL) !=
+	    -ENOENT) {
+		PRINT_ERROR("lookup after remove failed");
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_remove(index, key);
+	if (result)
+		goto out_free_index;
+	if (cch_index_total_bytes(index) != 0) {
+		PRINT_ERROR("empty index takes %lld bytes",
+			    cch_index_total_bytes(index));
+		result = 1;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* skip_test_levels() with specialized and generic walk */
+static int skip_test(void)
+{
+	int result;
+
+	/* specialized walk, then generic one */
+	result = skip_test_levels(6);
+	if (!result)
+		result = skip_test_levels(4);
+	return result;
+}
+
+/*
+ * Contiguous values are kept as one run, a hole in it turns entry
+ * back into plain records
+ */
+static int extent_test(void)
+{
+	int result;
+	struct cch_index *index;
+	struct cch_index_entry *entry;
+	struct cch_index_iter iter;
+	uint64_t key;
+	s64 bytes;
+	void *value;
+	int offset;
+	int i, count = 0;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8,
+		CCH_INDEX_EXTENT_LEAVES, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	/* contiguous blocks, whole entry is one run */
+	result = cch_index_insert(index, 0x1000, (void *) 0xB10C0000UL,
+		false, NULL, NULL);
+	if (result)
+		goto out_free_index;
+	bytes = cch_index_total_bytes(index);
+	for (i = 1; i < 256; i++) {
+		result = cch_index_insert(index, 0x1000 | i,
+			(void *) (0xB10C0000UL + i * 0x1000), false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+	if (cch_index_total_bytes(index) != bytes) {
+		PRINT_ERROR("run takes %lld bytes instead of %lld",
+			    cch_index_total_bytes(index), bytes);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_insert(index, 0x1080, (void *) 1, false,
+		NULL, NULL);
+	if (result != -EEXIST) {
+		PRINT_ERROR("insert into run, result %d", result);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_find(index, 0x1010, &value, &entry, &offset);
+	if (result)
+		goto out_free_index;
+	result = cch_index_find_direct(index, entry, offset + 0x70, &value,
+		NULL, NULL);
+	if (result || value != (void *) 0xB1140000UL) {
+		PRINT_ERROR("direct lookup failure, result %d", result);
+		result = 1;
+		goto out_free_index;
+	}
+
+	result = cch_index_iter_start(index, &iter, 0);
+	if (result)
+		goto out_free_index;
+	while (cch_index_iter_next(&iter, &key, &value) == 0) {
+		if (value != (void *) (0xB10C0000UL + (key & 0xFF) * 0x1000))
+			result = 1;
+		count++;
+	}
+	cch_index_iter_stop(&iter);
+	if (result || count != 256) {
+		PRINT_ERROR("iterated over %d records", count);
+		result = 1;
+		goto out_free_index;
+	}
+
+	/* hole in the run turns it into plain records */
+	result = cch_index_remove(index, 0x1080);
+	if (result)
+		goto out_free_index;
+	for (i = 0x7F; i <= 0x81; i++) {
+		result = cch_index_find(index, 0x1000 | i, &value, NULL, NULL);
+		if ((i == 0x80) != (result == -ENOENT) ||
+		    (result == 0 &&
+		     value != (void *) (0xB10C0000UL + i * 0x1000))) {
+			PRINT_ERROR("key 0x%x is wrong, result %d",
+				    0x1000 | i, result);
+			result = 1;
+			goto out_free_index;
+		}
+	}
+
+	result = cch_index_remove_range(index, 0, ~0ULL);
+	if (result)
+		goto out_free_index;
+	if (cch_index_total_bytes(index) != 0) {
+		PRINT_ERROR("empty index takes %lld bytes",
+			    cch_index_total_bytes(index));
+		result = 1;
+	}
+
+out_free_index:
+	cch_index_destroy(index);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Known geometries get their own walk, others the generic one, keys
+ * over all levels are found either way
+ */
+static int geometry_test(void)
+{
+	/* levels, bits, root_bits, low_bits, expected geometry */
+	static const int geometries[][5] = {
+		{ 2, 32, 8, 8,  2 },
+		{ 3, 48, 8, 16, 0 },
+	};
+	int result = 0;
+	struct cch_index *index;
+	uint64_t key;
+	void *value;
+	int i, g;
+
+	TRACE_ENTRY();
+
+	for (g = 0; g < ARRAY_SIZE(geometries); g++) {
+		result = test_index_create(geometries[g][0],
+			geometries[g][1], geometries[g][2], geometries[g][3],
+			0, &index);
+		if (result != 0) {
+			PRINT_ERROR("index creation failure, result %d",
+				    result);
+			goto out;
+		}
+
+		if (index->geometry != geometries[g][4]) {
+			PRINT_ERROR("geometry %d instead of %d",
+				    index->geometry, geometries[g][4]);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* keys spread over all levels */
+		for (i = 0; i < 1000; i++) {
+			key = (uint64_t) i * 0x00410503;
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+		for (i = 0; i < 1000; i++) {
+			key = (uint64_t) i * 0x00410503;
+			result = cch_index_find(index, key, &value, NULL, NULL);
+			if (result || value != (void *) (key + 1)) {
+				PRINT_ERROR("key 0x%llx is lost, result %d",
+					    key, result);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+		result = cch_index_find(index, 0x00410504, &value, NULL,
+			NULL);
+		if (result != -ENOENT) {
+			PRINT_ERROR("found missing key, result %d", result);
+			result = 1;
+			goto out_free_index;
+		}
+		result = 0;
+
+		cch_index_destroy(index);
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+
+out_free_index:
+	cch_index_destroy(index);
+	goto out;
+}
+
+/*
+ * Not a correctness test: average latency of lookups of present keys
+ * scattered over the whole index, so that walks mostly miss CPU caches.
+ */
+static int walk_bench_test(void)
+{
+	int result;
+	struct cch_index *index;
+	uint64_t *keys, h;
+	void *value;
+	ktime_t start;
+	s64 ns, best_ns = 0;
+	int i, round, nr_keys = 8192, lookups = 1 << 18;
+
+	TRACE_ENTRY();
+
+	keys = vmalloc(nr_keys * sizeof(*keys));
+	if (keys == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out_free_keys;
+	}
+
+	for (i = 0; i < nr_keys; i++) {
+		h = (i + 1) * 0x9E3779B97F4A7C15ULL;
+		keys[i] = (h & 0xFF00000000000000ULL) | (h & 0xFFFFFF);
+		result = cch_index_insert(index, keys[i], (void *) ~keys[i],
+			true, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	/* best of rounds, others are disturbed by the rest of the system */
+	for (round = 0; round < 8; round++) {
+		start = ktime_get();
+		for (i = 0; i < lookups; i++) {
+			result = cch_index_find(index,
+				keys[(i * 7919UL) % nr_keys], &value,
+				NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (round == 0 || ns < best_ns)
+			best_ns = ns;
+	}
+
+	printk(KERN_INFO "walk_bench %lld ns per lookup, %lld index bytes\n",
+	       best_ns / lookups, cch_index_total_bytes(index));
+
+out_free_index:
+	cch_index_destroy(index);
+
+out_free_keys:
+	vfree(keys);
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Read backend entry at given device offset to cluster sized buf,
+ * NULL if its cluster is broken
+ */
+static struct cch_backend_index_entry *read_backend_entry(
+	struct cch_index *index, uint64_t offset, uint8_t *buf)
+{
+	uint64_t cluster_offset;
+
+	cluster_offset = offset & ~((uint64_t) index->backend_cluster_size - 1);
+	if (cch_index_read_cluster_data(index, cluster_offset, buf,
+					index->backend_cluster_size))
+		return NULL;
+	if (cch_index_backend_cluster_parse_start(index,
+			(struct cch_backend_cluster *) buf))
+		return NULL;
+
+	return (struct cch_backend_index_entry *)
+		&buf[offset - cluster_offset];
+}
+
+/*
+ * Full save writes every level at device offsets parents point to,
+ * with records of each key in its lowest level entry
+ */
+static int full_save_test(void)
+{
+	static const unsigned long flags[] = {
+		0,
+		CCH_INDEX_COMPACT_MID | CCH_INDEX_EXTENT_LEAVES,
+	};
+	int result = 0;
+	struct cch_index *index;
+	struct cch_backend_index_entry *backend_entry;
+	uint8_t *buf = NULL;
+	uint64_t key, offset;
+	int i, f, level;
+
+	TRACE_ENTRY();
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		result = test_index_create(6, 64, 8, 8, flags[f], &index);
+		if (result != 0) {
+			PRINT_ERROR("index creation failure, result %d",
+				    result);
+			goto out;
+		}
+
+		cch_index_io_stub_setup(index->backend_cluster_size);
+		buf = vmalloc(index->backend_cluster_size);
+		if (buf == NULL) {
+			result = -ENOMEM;
+			goto out_free_index;
+		}
+
+		/* lowest level entries take more than one write buffer */
+		for (i = 0; i < 600; i++) {
+			key = ((uint64_t) (i % 5) << 56) |
+				((uint64_t) i << 12) | (i & 0xFF);
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+
+		result = cch_index_full_save(index);
+		if (result) {
+			PRINT_ERROR("full save failure, result %d", result);
+			goto out_free_index;
+		}
+
+		/* walk saved levels by device offsets */
+		for (i = 0; i < 600; i++) {
+			key = ((uint64_t) (i % 5) << 56) |
+				((uint64_t) i << 12) | (i & 0xFF);
+			offset = offsetof(struct cch_backend_cluster, data);
+			for (level = 0; level < index->levels; level++) {
+				backend_entry = read_backend_entry(index,
+					offset, buf);
+				if (backend_entry == NULL)
+					break;
+				offset = backend_entry->v[EXTRACT_BIASED_VALUE(
+					key, index->levels_desc,
+					level)].backend_dev_offs;
+				if (offset == 0)
+					break;
+			}
+			if (level != index->levels ||
+			    offset != key + 1) {
+				PRINT_ERROR("key 0x%llx saved wrong at level "
+					    "%d", key, level);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+out_free_index:
+		vfree(buf);
+		buf = NULL;
+		cch_index_destroy(index);
+		cch_index_io_stub_shutdown();
+		if (result)
+			break;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+static uint64_t restore_test_key(int i)
+{
+	/* three records per lowest level entry */
+	return ((uint64_t) (i / 3 % 7) << 56) | ((uint64_t) (i / 3) << 12) |
+		((i % 3) * 0x41);
+}
+
+/*
+ * Index restored from full save has the same records and no others,
+ * broken cluster fails restore
+ */
+static int full_restore_test(void)
+{
+	static const unsigned long flags[] = {
+		0,
+		CCH_INDEX_COMPACT_MID | CCH_INDEX_EXTENT_LEAVES,
+	};
+	int result = 0;
+	struct cch_index *index, *restored = NULL;
+	struct cch_index_entry *entry, *restored_entry;
+	struct cch_index_iter iter;
+	uint8_t *buf = NULL;
+	uint64_t key;
+	void *value;
+	int i, f, nr;
+
+	TRACE_ENTRY();
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		result = test_index_create(6, 64, 8, 8, flags[f], &index);
+		if (result != 0) {
+			PRINT_ERROR("index creation failure, result %d",
+				    result);
+			goto out;
+		}
+
+		cch_index_io_stub_setup(index->backend_cluster_size);
+
+		/* lowest level takes more batches than there are workers */
+		for (i = 0; i < 6000; i++) {
+			key = restore_test_key(i);
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+
+		result = cch_index_full_save(index);
+		if (result) {
+			PRINT_ERROR("full save failure, result %d", result);
+			goto out_free_index;
+		}
+
+		result = test_index_create(6, 64, 8, 8, flags[f], &restored);
+		if (result)
+			goto out_free_index;
+
+		result = cch_index_full_restore(restored);
+		if (result) {
+			PRINT_ERROR("full restore failure, result %d", result);
+			goto out_free_index;
+		}
+
+		for (i = 0; i < 6000; i++) {
+			key = restore_test_key(i);
+			value = NULL;
+			result = cch_index_find(restored, key, &value,
+						NULL, NULL);
+			if (result || value != (void *) (key + 1)) {
+				PRINT_ERROR("key 0x%llx not restored", key);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+		/* nothing extra */
+		nr = 0;
+		result = cch_index_iter_start(restored, &iter, 0);
+		if (result)
+			goto out_free_index;
+		while (cch_index_iter_next(&iter, &key, &value) == 0)
+			nr++;
+		cch_index_iter_stop(&iter);
+		if (nr != 6000) {
+			PRINT_ERROR("%d records restored", nr);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* restored entries are saved where they were read from */
+		if (restored->backend_end != index->backend_end) {
+			PRINT_ERROR("saved data ends at %llu, not %llu",
+				    restored->backend_end, index->backend_end);
+			result = 1;
+			goto out_free_index;
+		}
+		for (i = 0; i < 6000; i += 100) {
+			key = restore_test_key(i);
+			result = cch_index_find(index, key, &value, &entry,
+						NULL);
+			if (!result)
+				result = cch_index_find(restored, key, &value,
+					&restored_entry, NULL);
+			if (result)
+				goto out_free_index;
+			if (!cch_index_entry_is_saved(restored_entry) ||
+			    restored_entry->backend_offs !=
+			    entry->backend_offs) {
+				PRINT_ERROR("key 0x%llx entry not saved", key);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+		/* only into empty index */
+		result = cch_index_full_restore(restored);
+		if (result != -EBUSY) {
+			PRINT_ERROR("restored twice, result %d", result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		cch_index_destroy(restored);
+		restored = NULL;
+
+		/* broken cluster of first mid level fails restore */
+		buf = vmalloc(index->backend_cluster_size);
+		if (buf == NULL) {
+			result = -ENOMEM;
+			goto out_free_index;
+		}
+		memset(buf, 0, index->backend_cluster_size);
+		cch_index_write_cluster_data(index,
+			index->backend_cluster_size, buf,
+			index->backend_cluster_size);
+
+		result = test_index_create(6, 64, 8, 8, flags[f], &restored);
+		if (result)
+			goto out_free_index;
+
+		result = cch_index_full_restore(restored);
+		if (result != -EIO) {
+			PRINT_ERROR("broken cluster restored, result %d",
+				    result);
+			result = 1;
+			goto out_free_index;
+		}
+		result = 0;
+
+out_free_index:
+		vfree(buf);
+		buf = NULL;
+		if (restored != NULL)
+			cch_index_destroy(restored);
+		restored = NULL;
+		cch_index_destroy(index);
+		cch_index_io_stub_shutdown();
+		if (result)
+			break;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* same records in both indexes */
+static int restore_compare(struct cch_index *index,
+			   struct cch_index *restored)
+{
+	struct cch_index_iter iter, restored_iter;
+	uint64_t key, restored_key;
+	void *value, *restored_value;
+	int result, restored_result;
+
+	result = cch_index_iter_start(index, &iter, 0);
+	if (result)
+		return result;
+	result = cch_index_iter_start(restored, &restored_iter, 0);
+	if (result) {
+		cch_index_iter_stop(&iter);
+		return result;
+	}
+
+	do {
+		result = cch_index_iter_next(&iter, &key, &value);
+		restored_result = cch_index_iter_next(&restored_iter,
+			&restored_key, &restored_value);
+		if (result != restored_result ||
+		    (!result && (key != restored_key ||
+				 value != restored_value))) {
+			PRINT_ERROR("key 0x%llx differs after restore", key);
+			result = 1;
+			break;
+		}
+	} while (!result);
+	if (result == -ENOENT)
+		result = 0;
+
+	cch_index_iter_stop(&iter);
+	cch_index_iter_stop(&restored_iter);
+	return result;
+}
+
+/*
+ * Incremental save appends only changed paths and root, restore of
+ * the result matches saved index
+ */
+static int incremental_save_test(void)
+{
+	static const unsigned long flags[] = {
+		0,
+		CCH_INDEX_COMPACT_MID | CCH_INDEX_EXTENT_LEAVES,
+	};
+	int result = 0;
+	struct cch_index *index, *restored = NULL;
+	uint64_t key, full_end, end;
+	int i, f, round;
+
+	TRACE_ENTRY();
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		result = test_index_create(6, 64, 8, 8, flags[f], &index);
+		if (result != 0) {
+			PRINT_ERROR("index creation failure, result %d",
+				    result);
+			goto out;
+		}
+
+		cch_index_io_stub_setup(index->backend_cluster_size);
+
+		for (i = 0; i < 6000; i++) {
+			key = restore_test_key(i);
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+
+		/* nothing saved yet, so it's full save */
+		result = cch_index_incremental_save(index);
+		if (result)
+			goto out_free_index;
+		full_end = index->backend_end;
+
+		/* nothing changed, only root is rewritten */
+		result = cch_index_incremental_save(index);
+		if (result || index->backend_end != full_end) {
+			PRINT_ERROR("clean index appended %llu bytes",
+				    index->backend_end - full_end);
+			result = 1;
+			goto out_free_index;
+		}
+
+		for (round = 0; round < 3; round++) {
+			end = index->backend_end;
+
+			/* replace, insert to new subtree, remove */
+			key = restore_test_key(round * 1000);
+			result = cch_index_insert(index, key,
+				(void *) (key + 2), true, NULL, NULL);
+			if (result)
+				goto out_free_index;
+			key = 0x3300000000000000ULL | round;
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+			result = cch_index_remove(index,
+				restore_test_key(round * 1000 + 500));
+			if (result)
+				goto out_free_index;
+			result = cch_index_remove_range(index,
+				restore_test_key(round * 600 + 3),
+				restore_test_key(round * 600 + 5));
+			if (result)
+				goto out_free_index;
+
+			result = cch_index_incremental_save(index);
+			if (result) {
+				PRINT_ERROR("incremental save failure, "
+					    "result %d", result);
+				goto out_free_index;
+			}
+
+			/* paths of changed entries only */
+			if (index->backend_end - end >= full_end / 4) {
+				PRINT_ERROR("%llu bytes appended for %llu "
+					    "saved", index->backend_end - end,
+					    full_end);
+				result = 1;
+				goto out_free_index;
+			}
+
+			result = test_index_create(6, 64, 8, 8, flags[f],
+				&restored);
+			if (result)
+				goto out_free_index;
+			result = cch_index_full_restore(restored);
+			if (result) {
+				PRINT_ERROR("restore failure, result %d",
+					    result);
+				goto out_free_index;
+			}
+			result = restore_compare(index, restored);
+			if (result)
+				goto out_free_index;
+			cch_index_destroy(restored);
+			restored = NULL;
+		}
+
+out_free_index:
+		if (restored != NULL)
+			cch_index_destroy(restored);
+		restored = NULL;
+		cch_index_destroy(index);
+		cch_index_io_stub_shutdown();
+		if (result)
+			break;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/* keys of two neighbour lowest level entries, besides restore_test_key() */
+#define SHRINK_TEST_BASE 0x3400000000000000ULL
+
+/*
+ * Shrink unloads saved lowest level entries to fit the budget, every
+ * kind of lookup and save loads or copies them back
+ */
+static int shrink_test(void)
+{
+	static const unsigned long flags[] = {
+		0,
+		CCH_INDEX_COMPACT_MID | CCH_INDEX_COMPACT_LEAVES |
+			CCH_INDEX_EXTENT_LEAVES,
+		CCH_INDEX_CLOCK_EVICTION,
+	};
+	int result = 0;
+	struct cch_index *index, *restored = NULL;
+	struct cch_index_entry *entry;
+	struct cch_index_iter iter;
+	uint64_t keys[64];
+	void *values[64];
+	uint64_t key, end;
+	void *value;
+	int budget_kb, offset;
+	int i, f, nr;
+
+	TRACE_ENTRY();
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		result = test_index_create(6, 64, 8, 8, flags[f], &index);
+		if (result != 0) {
+			PRINT_ERROR("index creation failure, result %d",
+				    result);
+			goto out;
+		}
+
+		cch_index_io_stub_setup(index->backend_cluster_size);
+
+		for (i = 0; i < 6000; i++) {
+			key = restore_test_key(i);
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+		for (i = 0; i < 512; i++) {
+			key = SHRINK_TEST_BASE + i;
+			result = cch_index_insert(index, key,
+				(void *) (key + 1), false, NULL, NULL);
+			if (result)
+				goto out_free_index;
+		}
+
+		/* mid level entries take most, half of leaves go */
+		budget_kb = (cch_index_total_bytes(index) -
+			     1000 * index->lowest_level_entry_size) / 1024;
+		result = cch_index_shrink(index, budget_kb);
+		if (result || cch_index_total_bytes(index) >
+		    (s64) budget_kb * 1024 ||
+		    atomic_read(&index->nr_unloaded) == 0) {
+			PRINT_ERROR("shrink to %d kb failure, result %d, "
+				    "%lld bytes left", budget_kb, result,
+				    cch_index_total_bytes(index));
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* unloaded entries are copied, not loaded */
+		nr = atomic_read(&index->nr_unloaded);
+		result = cch_index_full_save(index);
+		if (result || atomic_read(&index->nr_unloaded) != nr) {
+			PRINT_ERROR("full save with unloaded entries, "
+				    "result %d", result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* lookups load them back */
+		for (i = 0; i < 6000; i++) {
+			key = restore_test_key(i);
+			value = NULL;
+			result = cch_index_find(index, key, &value, NULL, NULL);
+			if (result || value != (void *) (key + 1)) {
+				PRINT_ERROR("key 0x%llx lost by shrink", key);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+		/* mid level entries stay, so not everything fits */
+		result = cch_index_shrink(index, 0);
+		if (result != -ENOSPC) {
+			PRINT_ERROR("shrink to nothing, result %d", result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* neighbour entry of direct lookup and insert is unloaded */
+		result = cch_index_find(index, SHRINK_TEST_BASE, &value,
+			&entry, &offset);
+		if (result)
+			goto out_free_index;
+		value = (void *) 1;
+		result = cch_index_find_direct(index, entry, offset + 261,
+			&value, NULL, NULL);
+		if (result || value != (void *) (SHRINK_TEST_BASE + 262)) {
+			PRINT_ERROR("direct lookup failure, result %d",
+				    result);
+			result = 1;
+			goto out_free_index;
+		}
+		cch_index_shrink(index, 0);
+		result = cch_index_find(index, SHRINK_TEST_BASE, &value,
+			&entry, &offset);
+		if (result)
+			goto out_free_index;
+		result = cch_index_insert_direct(index, entry, offset + 263,
+			true, (void *) 0xC0DE, NULL, NULL);
+		if (result)
+			goto out_free_index;
+		result = cch_index_find(index, SHRINK_TEST_BASE + 263, &value,
+			NULL, NULL);
+		if (result || value != (void *) 0xC0DE) {
+			PRINT_ERROR("direct insert failure, result %d",
+				    result);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* and so do iterators and batch lookups */
+		cch_index_shrink(index, 0);
+		nr = 0;
+		result = cch_index_iter_start(index, &iter, 0);
+		if (result)
+			goto out_free_index;
+		while (cch_index_iter_next(&iter, &key, &value) == 0)
+			nr++;
+		cch_index_iter_stop(&iter);
+		if (nr != 6512) {
+			PRINT_ERROR("%d records iterated after shrink", nr);
+			result = 1;
+			goto out_free_index;
+		}
+
+		cch_index_shrink(index, 0);
+		for (i = 0; i < ARRAY_SIZE(keys); i++)
+			keys[i] = restore_test_key(i * 90);
+		nr = cch_index_find_batch(index, keys, ARRAY_SIZE(keys),
+					  values);
+		for (i = 0; i < ARRAY_SIZE(keys); i++) {
+			if (values[i] != (void *) (keys[i] + 1)) {
+				PRINT_ERROR("batch lost key 0x%llx", keys[i]);
+				nr = -1;
+			}
+		}
+		if (nr != ARRAY_SIZE(keys)) {
+			PRINT_ERROR("batch found %d values", nr);
+			result = 1;
+			goto out_free_index;
+		}
+
+		/* changes of unloaded entries get saved */
+		cch_index_shrink(index, 0);
+		result = cch_index_remove(index, restore_test_key(100));
+		if (result)
+			goto out_free_index;
+		result = cch_index_remove_range(index, restore_test_key(301),
+			restore_test_key(301) + (600 << 12));
+		if (result)
+			goto out_free_index;
+		key = restore_test_key(4000);
+		result = cch_index_insert(index, key, (void *) (key + 2), true,
+			NULL, NULL);
+		if (result)
+			goto out_free_index;
+
+		result = cch_index_incremental_save(index);
+		if (result) {
+			PRINT_ERROR("incremental save failure, result %d",
+				    result);
+			goto out_free_index;
+		}
+
+		/* full saves reuse space behind unloaded entries */
+		end = 0;
+		for (i = 0; i < 4; i++) {
+			result = cch_index_full_save(index);
+			if (result)
+				goto out_free_index;
+			if (i < 2)
+				end = max(end, index->backend_end);
+			else if (index->backend_end > end) {
+				PRINT_ERROR("full save %d ends at %llu, "
+					    "after %llu", i,
+					    index->backend_end, end);
+				result = 1;
+				goto out_free_index;
+			}
+		}
+
+		result = test_index_create(6, 64, 8, 8, flags[f], &restored);
+		if (result)
+			goto out_free_index;
+		result = cch_index_full_restore(restored);
+		if (result) {
+			PRINT_ERROR("restore failure, result %d", result);
+			goto out_free_index;
+		}
+		result = restore_compare(index, restored);
+
+out_free_index:
+		if (restored != NULL)
+			cch_index_destroy(restored);
+		restored = NULL;
+		cch_index_destroy(index);
+		cch_index_io_stub_shutdown();
+		if (result)
+			break;
+	}
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+/*
+ * Pinned entry isn't unloaded by shrink nor freed when emptied, so
+ * it's fine for *_direct calls till unpin
+ */
+static int pin_test(void)
+{
+	int result = 0;
+	struct cch_index *index, *restored = NULL;
+	struct cch_index_entry *entry, *found;
+	uint64_t key;
+	void *value;
+	int i, offset;
+
+	TRACE_ENTRY();
+
+	result = test_index_create(6, 64, 8, 8, 0, &index);
+	if (result != 0) {
+		PRINT_ERROR("index creation failure, result %d", result);
+		goto out;
+	}
+
+	cch_index_io_stub_setup(index->backend_cluster_size);
+
+	for (i = 0; i < 6000; i++) {
+		key = restore_test_key(i);
+		result = cch_index_insert(index, key, (void *) (key + 1),
+			false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+	for (i = 0; i < 256; i++) {
+		key = SHRINK_TEST_BASE + i;
+		result = cch_index_insert(index, key, (void *) (key + 1),
+			false, NULL, NULL);
+		if (result)
+			goto out_free_index;
+	}
+
+	result = cch_index_pin(index, SHRINK_TEST_BASE + 5, &entry);
+	if (result)
+		goto out_free_index;
+
+	cch_index_shrink(index, 0);
+	result = cch_index_find(index, SHRINK_TEST_BASE, &value, &found,
+		&offset);
+	if (result || found != entry ||
+	    atomic_read(&index->nr_unloaded) == 0) {
+		PRINT_ERROR("pinned entry unloaded, result %d", result);
+		result = 1;
+		goto out_unpin;
+	}
+
+	/* emptied by range removal, still there for direct insert */
+	result = cch_index_remove_range(index, SHRINK_TEST_BASE - 1000,
+		SHRINK_TEST_BASE + 1000);
+	if (result)
+		goto out_unpin;
+	result = cch_index_find(index, SHRINK_TEST_BASE + 7, &value, NULL,
+		NULL);
+	if (result != -ENOENT || atomic_read(&entry->ref_cnt) != 0) {
+		PRINT_ERROR("pinned entry not emptied, result %d", result);
+		result = 1;
+		goto out_unpin;
+	}
+
+	/* and it's saved and restored empty */
+	result = cch_index_full_save(index);
+	if (result)
+		goto out_unpin;
+	result = test_index_create(6, 64, 8, 8, 0, &restored);
+	if (result)
+		goto out_unpin;
+	result = cch_index_full_restore(restored);
+	if (result) {
+		PRINT_ERROR("restore failure, result %d", result);
+		goto out_unpin;
+	}
+	result = restore_compare(index, restored);
+	if (result)
+		goto out_unpin;
+
+	result = cch_index_insert_direct(index, entry, 7, false,
+		(void *) 0xC0DE, NULL, NULL);
+	if (result)
+		goto out_unpin;
+	result = cch_index_find(index, SHRINK_TEST_BASE + 7, &value, NULL,
+		NULL);
+	if (result || value != (void *) 0xC0DE) {
+		PRINT_ERROR("direct insert to pinned entry failure, "
+			    "result %d", result);
+		result = 1;
+		goto out_unpin;
+	}
+
+	/* empty entry goes with last pin */
+	result = cch_index_remove(index, SHRINK_TEST_BASE + 7);
+	if (result)
+		goto out_unpin;
+	result = cch_index_pin(index, SHRINK_TEST_BASE, &found);
+	if (result || found != entry) {
+		PRINT_ERROR("second pin failure, result %d", result);
+		result = 1;
+		goto out_unpin;
+	}
+	cch_index_unpin(index, entry);
+	cch_index_unpin(index, entry);
+	result = cch_index_pin(index, SHRINK_TEST_BASE, &found);
+	if (result != -ENOENT) {
+		PRINT_ERROR("empty entry kept, result %d", result);
+		if (!result)
+			cch_index_unpin(index, found);
+		result = 1;
+	} else
+		result = 0;
+	goto out_free_index;
+
+out_unpin:
+	cch_index_unpin(index, entry);
+
+out_free_index:
+	if (restored != NULL)
+		cch_index_destroy(restored);
+	cch_index_destroy(index);
+	cch_index_io_stub_shutdown();
+
+out:
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
 static int io_stubs_test(void)
 {
 	int result = 0;
@@ -512,6 +2533,46 @@ static int __init reldata_index_init(void)
 	//CCH_INDEX_TEST(direct, "direct");
 	/* demonstrate that reference counting works */
 	//CCH_INDEX_TEST(remove_cleanup, "remove_cleanup");
+	/* CLOCK eviction gives referenced entries second chance */
+	CCH_INDEX_TEST(clock, "clock");
+	/* sharded front-end routes keys to independent indexes */
+	CCH_INDEX_TEST(sharded, "sharded");
+	/* negative offsets walk to previous lowest level entries */
+	CCH_INDEX_TEST(direct_backward, "direct_backward");
+	/* offsets far outside of lowest level entry */
+	CCH_INDEX_TEST(direct_stride, "direct_stride");
+	/* lookups resume from path of previous one */
+	CCH_INDEX_TEST(finger, "finger");
+	/* batched lookup walks many keys at once */
+	CCH_INDEX_TEST(find_batch, "find_batch");
+	/* sorted bulk insert reuses path per lowest level entry */
+	CCH_INDEX_TEST(insert_batch, "insert_batch");
+	/* range remove frees whole subtrees */
+	CCH_INDEX_TEST(remove_range, "remove_range");
+	/* iterator walks records in key order */
+	CCH_INDEX_TEST(iter, "iter");
+	/* sparse lowest level entries in compact tables */
+	CCH_INDEX_TEST(compact, "compact");
+	/* mid level entries with few children are compact too */
+	CCH_INDEX_TEST(compact_mid, "compact_mid");
+	/* chains of single child mid entries are skipped */
+	CCH_INDEX_TEST(skip, "skip");
+	/* contiguous values are kept as runs */
+	CCH_INDEX_TEST(extent, "extent");
+	/* specialized and generic walks of index geometries */
+	CCH_INDEX_TEST(geometry, "geometry");
+	/* lookup latency, see walk_bench_test() */
+	CCH_INDEX_TEST(walk_bench, "walk_bench");
+	/* full save packs levels into clusters */
+	CCH_INDEX_TEST(full_save, "full_save");
+	/* full restore rebuilds saved index */
+	CCH_INDEX_TEST(full_restore, "full_restore");
+	/* incremental save appends changed entries only */
+	CCH_INDEX_TEST(incremental_save, "incremental_save");
+	/* shrink unloads entries, lookups load them back */
+	CCH_INDEX_TEST(shrink, "shrink");
+	/* pinned entries stay for *_direct calls */
+	CCH_INDEX_TEST(pin, "pin");
 	/* test I/O stubs */
 	CCH_INDEX_TEST(io_stubs, "io_stubs");
 
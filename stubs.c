@@ -1,4 +1,5 @@
 #include <linux/slab.h>
+#include <linux/sched.h>
 
 #define LOG_PREFIX "cch_index_stubs"
 
@@ -81,12 +82,41 @@ void cch_index_on_entry_free(
 	return;
 }
 
+/* backend runs one transaction at a time, nested ones fail */
+static DEFINE_MUTEX(stub_transaction_mutex);
+static struct task_struct *stub_transaction_owner;
+
+static int cch_index_stub_transaction_start(void)
+{
+	int result = 0;
+
+	if (READ_ONCE(stub_transaction_owner) == current) {
+		PRINT_ERROR("nested transaction");
+		result = -EBUSY;
+		goto out;
+	}
+
+	mutex_lock(&stub_transaction_mutex);
+	stub_transaction_owner = current;
+
+out:
+	return result;
+}
+
+static void cch_index_stub_transaction_finish(void)
+{
+	stub_transaction_owner = NULL;
+	mutex_unlock(&stub_transaction_mutex);
+}
+
 int cch_index_start_full_save(struct cch_index *index)
 {
 	int result = 0;
 
 	TRACE_ENTRY();
 
+	result = cch_index_stub_transaction_start();
+
 	TRACE_EXIT_RES(result);
 	return result;
 }
@@ -97,6 +127,8 @@ int cch_index_finish_full_save(struct cch_index *index)
 
 	TRACE_ENTRY();
 
+	cch_index_stub_transaction_finish();
+
 	TRACE_EXIT_RES(result);
 	return result;
 }
@@ -165,8 +197,8 @@ void cch_index_io_stub_shutdown(void)
 	return;
 }
 
-int cch_index_write_cluster_data(struct cch_index * index,
-	uint64_t offset, const uint8_t *buffer, int buf_len)
+static int cch_index_write_one_cluster(uint64_t offset,
+	const uint8_t *buffer, int buf_len)
 {
 	int result = 0;
 	int overwrite = 0; /* should we overwrite existing cluster */
@@ -174,8 +206,6 @@ int cch_index_write_cluster_data(struct cch_index * index,
 	struct cch_written_cluster_stub *cluster;
 	TRACE_ENTRY();
 
-	/* we assume we speak in terms of single clusters now */
-	sBUG_ON(buf_len != stub_cluster_size);
 	/* we write only at offsets that are multiples of cluster size */
 	offset32 = offset & 0xFFFFFFFF;
 	sBUG_ON(offset32 % stub_cluster_size != 0);
@@ -214,8 +244,30 @@ write_cluster:
 	return result;
 }
 
-int cch_index_read_cluster_data(struct cch_index * index,
-	uint64_t offset, uint8_t *buffer, int buf_len)
+/* buffer may hold several clusters, they are kept one by one */
+int cch_index_write_cluster_data(struct cch_index * index,
+	uint64_t offset, const uint8_t *buffer, int buf_len)
+{
+	int result = 0;
+	int done = 0;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(buf_len % stub_cluster_size != 0);
+
+	for (done = 0; done < buf_len; done += stub_cluster_size) {
+		result = cch_index_write_one_cluster(offset + done,
+			buffer + done, stub_cluster_size);
+		if (result)
+			break;
+	}
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
+static int cch_index_read_one_cluster(uint64_t offset,
+	uint8_t *buffer, int buf_len)
 {
 	int result = 0;
 	int found = 0;
@@ -223,10 +275,6 @@ int cch_index_read_cluster_data(struct cch_index * index,
 
 	TRACE_ENTRY();
 
-	/* again, only reads at cluster start and of
-	 * single cluster size are supported */
-	sBUG_ON(buf_len != stub_cluster_size);
-
 	/* seek for cluster having given offset and
 	 * return it
 	 */
@@ -252,12 +300,36 @@ out:
 	return result;
 }
 
+int cch_index_read_cluster_data(struct cch_index * index,
+	uint64_t offset, uint8_t *buffer, int buf_len)
+{
+	int result = 0;
+	int done = 0;
+
+	TRACE_ENTRY();
+
+	/* again, only reads at cluster start are supported */
+	sBUG_ON(buf_len % stub_cluster_size != 0);
+
+	for (done = 0; done < buf_len; done += stub_cluster_size) {
+		result = cch_index_read_one_cluster(offset + done,
+			buffer + done, stub_cluster_size);
+		if (result)
+			break;
+	}
+
+	TRACE_EXIT_RES(result);
+	return result;
+}
+
 int cch_index_start_transaction(struct cch_index *index)
 {
 	int result = 0;
 
 	TRACE_ENTRY();
 
+	result = cch_index_stub_transaction_start();
+
 	TRACE_EXIT_RES(result);
 	return result;
 }
@@ -268,6 +340,8 @@ int cch_index_finish_transaction(struct cch_index *index)
 
 	TRACE_ENTRY();
 
+	cch_index_stub_transaction_finish();
+
 	TRACE_EXIT_RES(result);
 	return result;
 }